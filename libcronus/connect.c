@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -28,6 +29,8 @@
 #include "libcronus_private.h"
 #include "libcronus.h"
 
+#define CRONUS_PORT	"8192"
+
 static int cronus_wait_for_feedbobo(struct cronus_context *cctx)
 {
 	uint32_t pkt[10];
@@ -64,16 +67,31 @@ int cronus_connect(const char *hostname, struct cronus_context **out)
 	struct addrinfo *result;
 	struct sockaddr_in addr;
 	extern int h_errno;
+	const char *port = CRONUS_PORT;
+	char *host, *sep;
 	int fd, ret;
 
 	if (!hostname || !out)
 		return EINVAL;
 
+	/* Server may be given as <host>[:<port>] */
+	host = strdup(hostname);
+	if (!host)
+		return ENOMEM;
+
+	sep = strchr(host, ':');
+	if (sep) {
+		*sep = '\0';
+		port = sep + 1;
+	}
+
 	hints = (struct addrinfo) {
 		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM,
 	};
 
-	ret = getaddrinfo(hostname, NULL, &hints, &result);
+	ret = getaddrinfo(host, port, &hints, &result);
+	free(host);
 	if (ret != 0) {
 		herror("getaddrinfo");
 		return EIO;
@@ -91,7 +109,6 @@ int cronus_connect(const char *hostname, struct cronus_context **out)
 	};
 
 	addr = *(struct sockaddr_in *)result->ai_addr;
-	addr.sin_port = htons(8192);
 
 	freeaddrinfo(result);
 
@@ -14,21 +14,153 @@
  * limitations under the License.
  */
 
+/*
+ * Multiplexing proxy for a Cronus server.
+ *
+ * Any number of clients can connect to the proxy.  Their requests are
+ * forwarded over a small pool of upstream connections to the server.
+ * Each upstream connection carries one request at a time; clients that
+ * send a request while all upstream connections are busy wait in a FIFO
+ * queue.  Instruction keys are rewritten on the way up so that requests
+ * from different clients never collide, and rewritten back on the way
+ * down.
+ *
+ * Request payloads are moved with splice() when they are large enough
+ * to make it worthwhile.  Replies are collected and handed to the
+ * client in a single write, as the libcronus client expects to receive
+ * a reply with a single read().  Writes to clients never block, what a
+ * client does not take is kept until its socket is writable again.
+ *
+ * Per-client request rates and latency percentiles are reported when a
+ * client disconnects, and for all clients on SIGUSR1 or on exit.
+ */
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 
+#include "instruction.h"
+
 #define CRONUS_PORT	8192
 
+#define BUFFER_SIZE	(64 * 1024)
+#define SPLICE_MIN	4096
+#define MAX_EVENTS	32
+
+#define MAX_UPSTREAM	16
+
+enum endpoint_type {
+	EP_LISTEN,
+	EP_SIGNAL,
+	EP_CLIENT,
+	EP_UPSTREAM,
+};
+
+struct endpoint {
+	enum endpoint_type type;
+	int fd;
+};
+
+/* Parser state for the request stream coming from a client */
+enum request_state {
+	REQ_COUNT,
+	REQ_HEADER,
+	REQ_BODY,
+	REQ_DONE,
+};
+
+struct stats {
+	struct timespec connected;
+	uint64_t requests;
+	uint64_t errors;
+	uint32_t *latency;	/* in microseconds */
+	uint64_t nlatency, alloc;
+};
+
+struct upstream;
+
+struct client {
+	struct endpoint ep;
+	int id;
+	struct client *next;
+
+	/* Bound upstream connection while a request is in flight */
+	struct upstream *up;
+	bool waiting;
+	struct client *next_wait;
+
+	struct timespec start;
+	bool started;
+
+	enum request_state state;
+	uint8_t hdr[3 * sizeof(uint32_t)];
+	size_t hdr_len;
+	uint32_t ncmds, cmd;
+	uint32_t body_left;
+
+	/* Part of a reply the socket did not take yet */
+	uint8_t *out;
+	size_t out_len, out_off;
+
+	struct stats stats;
+};
+
+/* Mapping of rewritten keys back to the keys used by the client */
+struct key_map {
+	uint32_t client_key;
+	uint32_t proxy_key;
+};
+
+struct upstream {
+	struct endpoint ep;
+	int id;
+	struct client *client;
+
+	struct key_map *keys;
+	uint32_t nkeys, keys_alloc;
+
+	/* Reply being collected for the bound client */
+	uint8_t *buf;
+	size_t len, alloc;
+	size_t parsed;
+	uint32_t nreplies, reply;
+	bool failed;
+
+	uint64_t requests;
+};
+
+static struct sockaddr_in cro_addr;
+static struct upstream upstreams[MAX_UPSTREAM];
+static int num_upstream = 1;
+static struct client *clients;
+static struct client *wait_head, *wait_tail;
+static int epollfd = -1;
+static int pipefd[2] = { -1, -1 };
+static bool use_splice = true;
+static bool verbose;
+static uint32_t next_key = 1;
+static uint32_t server_hello;
+static int next_client_id;
+
 static bool set_nonblocking(int fd)
 {
 	int val;
@@ -53,7 +185,7 @@ static bool set_nonblocking(int fd)
 static int listen_socket(unsigned short port)
 {
 	struct sockaddr_in addr;
-	int fd, ret;
+	int fd, ret, val = 1;
 
 	fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (fd == -1)
@@ -62,6 +194,8 @@ static int listen_socket(unsigned short port)
 	if (!set_nonblocking(fd))
 		goto fail;
 
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
 	addr = (struct sockaddr_in) {
 		.sin_family = AF_INET,
 		.sin_port = htons(port),
@@ -74,7 +208,7 @@ static int listen_socket(unsigned short port)
 		goto fail;
 	}
 
-	ret = listen(fd, 1);
+	ret = listen(fd, 64);
 	if (ret != 0) {
 		perror("listen");
 		goto fail;
@@ -88,44 +222,67 @@ fail:
 	return -1;
 }
 
-static int connect_socket(struct sockaddr_in *addr)
+static bool read_all(int fd, void *buf, size_t len)
 {
-	int fd, ret;
+	uint8_t *ptr = buf;
+	ssize_t n;
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd == -1)
-		goto fail;
+	while (len > 0) {
+		n = read(fd, ptr, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
 
-	ret = connect(fd, (struct sockaddr *)addr, sizeof(*addr));
-	if (ret == -1) {
-		perror("connect");
-		goto fail;
+		ptr += n;
+		len -= n;
 	}
 
-	if (!set_nonblocking(fd))
-		goto fail;
+	return true;
+}
 
-	return fd;
+/* Wait for a non-blocking socket to become writable or readable */
+static bool wait_fd(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	int ret;
 
-fail:
-	if (fd != -1)
-		close(fd);
-	return -1;
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret == 1 && !(pfd.revents & (POLLERR | POLLNVAL));
 }
 
-static int copy_data(int src_fd, int dst_fd, const char *prefix)
+static bool write_all(int fd, const void *buf, size_t len)
 {
-	uint8_t data[1024];
-	ssize_t n1, n2;
-	unsigned int i;
+	const uint8_t *ptr = buf;
+	ssize_t n;
 
-	n1 = read(src_fd, data, 1024);
-	if (n1 <= 0)
-		return -1;
+	while (len > 0) {
+		n = write(fd, ptr, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && wait_fd(fd, POLLOUT))
+				continue;
+			return false;
+		}
+
+		ptr += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static void dump_data(const char *prefix, int fd, const uint8_t *data, size_t len)
+{
+	unsigned int i;
 
-	fprintf(stderr, "read data fd=%d, len=%zi\n", src_fd, n1);
+	fprintf(stderr, "%s: fd=%d, len=%zu\n", prefix, fd, len);
 
-	for (i=0; i<n1; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0)
 			fprintf(stderr, "%s: 0x%08x", prefix, i);
 
@@ -135,158 +292,987 @@ static int copy_data(int src_fd, int dst_fd, const char *prefix)
 			fprintf(stderr, "\n");
 	}
 	fprintf(stderr, "\n");
+}
 
-	n2 = write(dst_fd, data, n1);
-	if (n2 <= 0 || n1 != n2)
-		return -1;
+static uint64_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
 
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+	       (now.tv_nsec - start->tv_nsec) / 1000;
 }
 
-static int event_loop(int listen_fd, struct sockaddr_in *cro_addr)
+static void stats_add(struct stats *stats, uint64_t usec, bool failed)
 {
-	struct epoll_event ev;
-	int client_fd = -1, proxy_fd = -1;
-	int epollfd, ret;
+	stats->requests++;
+	if (failed)
+		stats->errors++;
 
-	epollfd = epoll_create1(0);
-	if (epollfd == -1) {
-		perror("epollfd");
+	if (stats->nlatency == stats->alloc) {
+		uint64_t alloc = stats->alloc ? 2 * stats->alloc : 256;
+		uint32_t *ptr;
+
+		ptr = realloc(stats->latency, alloc * sizeof(*ptr));
+		if (!ptr)
+			return;
+
+		stats->latency = ptr;
+		stats->alloc = alloc;
+	}
+
+	stats->latency[stats->nlatency++] = usec > UINT32_MAX ? UINT32_MAX : usec;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint64_t n, unsigned int pct)
+{
+	return sorted[(n - 1) * pct / 100];
+}
+
+static void stats_report(struct client *c)
+{
+	struct stats *stats = &c->stats;
+	uint64_t usec = elapsed_us(&stats->connected);
+	double secs = usec / 1000000.0;
+	uint32_t *sorted;
+
+	fprintf(stderr, "client %d: %" PRIu64 " requests (%" PRIu64 " failed) in %.3f s, %.1f req/s\n",
+		c->id, stats->requests, stats->errors, secs,
+		secs > 0 ? stats->requests / secs : 0.0);
+
+	if (!stats->nlatency)
+		return;
+
+	sorted = malloc(stats->nlatency * sizeof(*sorted));
+	if (!sorted)
+		return;
+
+	memcpy(sorted, stats->latency, stats->nlatency * sizeof(*sorted));
+	qsort(sorted, stats->nlatency, sizeof(*sorted), cmp_uint32);
+
+	fprintf(stderr, "client %d: latency us p50=%u p90=%u p99=%u max=%u\n",
+		c->id,
+		percentile(sorted, stats->nlatency, 50),
+		percentile(sorted, stats->nlatency, 90),
+		percentile(sorted, stats->nlatency, 99),
+		sorted[stats->nlatency - 1]);
+
+	free(sorted);
+}
+
+static void report_all(void)
+{
+	struct client *c;
+	int i;
+
+	for (c = clients; c; c = c->next)
+		stats_report(c);
+
+	for (i = 0; i < num_upstream; i++)
+		fprintf(stderr, "upstream %d: %" PRIu64 " requests\n",
+			i, upstreams[i].requests);
+}
+
+static bool epoll_set(struct endpoint *ep, int op, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = ep,
+	};
+
+	if (epoll_ctl(epollfd, op, ep->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+static void upstream_close(struct upstream *up)
+{
+	if (up->ep.fd != -1) {
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, up->ep.fd, NULL);
+		close(up->ep.fd);
+		up->ep.fd = -1;
+	}
+}
+
+static bool upstream_connect(struct upstream *up)
+{
+	uint32_t hello[2];
+	int fd, val = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return false;
+	}
+
+	if (connect(fd, (struct sockaddr *)&cro_addr, sizeof(cro_addr)) == -1) {
+		perror("connect");
 		goto fail;
 	}
 
-	ev.events = EPOLLIN;
-	ev.data.fd = listen_fd;
+	/* Swallow the server greeting, clients get their own from us */
+	if (!read_all(fd, hello, sizeof(hello))) {
+		fprintf(stderr, "upstream %d: no greeting from server\n", up->id);
+		goto fail;
+	}
 
-	ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_fd, &ev);
-	if (ret == -1) {
-		perror("epoll_ctl(ADD, listen_fd)");
+	if ((ntohl(hello[1]) & 0xFFFFFFF0) != 0xFEEDB0B0) {
+		fprintf(stderr, "upstream %d: invalid greeting 0x%08x\n",
+			up->id, ntohl(hello[1]));
 		goto fail;
 	}
 
-	while (1) {
-		struct epoll_event event;
-		int nfds, fd;
+	server_hello = hello[1];
 
-		nfds = epoll_wait(epollfd, &event, 1, -1);
-		if (nfds == -1) {
-			perror("epoll_wait");
-			goto fail;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	if (!set_nonblocking(fd))
+		goto fail;
+
+	up->ep.type = EP_UPSTREAM;
+	up->ep.fd = fd;
+
+	if (!epoll_set(&up->ep, EPOLL_CTL_ADD, EPOLLIN)) {
+		up->ep.fd = -1;
+		goto fail;
+	}
+
+	return true;
+
+fail:
+	close(fd);
+	return false;
+}
+
+static struct upstream *upstream_idle(void)
+{
+	int i;
+
+	for (i = 0; i < num_upstream; i++) {
+		struct upstream *up = &upstreams[i];
+
+		if (up->client)
+			continue;
+
+		if (up->ep.fd == -1 && !upstream_connect(up))
+			continue;
+
+		return up;
+	}
+
+	return NULL;
+}
+
+static void upstream_bind(struct upstream *up, struct client *c)
+{
+	up->client = c;
+	up->nkeys = 0;
+	up->len = 0;
+	up->parsed = 0;
+	up->nreplies = 0;
+	up->reply = 0;
+	up->failed = false;
+	up->requests++;
+
+	c->up = up;
+	c->state = REQ_COUNT;
+	c->hdr_len = 0;
+}
+
+static void wait_enqueue(struct client *c)
+{
+	c->waiting = true;
+	c->next_wait = NULL;
+	if (wait_tail)
+		wait_tail->next_wait = c;
+	else
+		wait_head = c;
+	wait_tail = c;
+}
+
+static struct client *wait_dequeue(void)
+{
+	struct client *c = wait_head;
+
+	if (c) {
+		wait_head = c->next_wait;
+		if (!wait_head)
+			wait_tail = NULL;
+		c->waiting = false;
+	}
+
+	return c;
+}
+
+static void wait_remove(struct client *c)
+{
+	struct client **p;
+
+	for (p = &wait_head; *p; p = &(*p)->next_wait) {
+		if (*p == c) {
+			*p = c->next_wait;
+			break;
+		}
+	}
+
+	wait_tail = NULL;
+	for (c = wait_head; c; c = c->next_wait)
+		wait_tail = c;
+}
+
+static void client_close(struct client *c);
+
+static bool upstream_busy(void)
+{
+	int i;
+
+	for (i = 0; i < num_upstream; i++)
+		if (upstreams[i].client)
+			return true;
+
+	return false;
+}
+
+static void upstream_release(struct upstream *up)
+{
+	struct client *c;
+
+	up->client = NULL;
+
+	if (!wait_head)
+		return;
+
+	if (up->ep.fd == -1 && !upstream_connect(up)) {
+		/*
+		 * Waiting clients are served when another upstream link
+		 * becomes free.  If there is none, give up on them.
+		 */
+		if (!upstream_busy()) {
+			while ((c = wait_dequeue()))
+				client_close(c);
 		}
+		return;
+	}
 
-		if (event.data.fd == listen_fd) {
-			struct sockaddr_in addr;
-			socklen_t addrlen = sizeof(addr);
+	/* Hand the connection to the next waiting client */
+	c = wait_dequeue();
+	upstream_bind(up, c);
+	epoll_set(&c->ep, EPOLL_CTL_MOD, EPOLLIN);
+}
 
-			fd = accept(listen_fd, (struct sockaddr *)&addr, &addrlen);
-			if (fd == -1) {
-				perror("accept");
-				continue;
-			}
+static void client_close(struct client *c)
+{
+	struct client **p;
 
-			if (client_fd != -1) {
-				fprintf(stderr, "Dropping connection\n");
-				close(fd);
-				continue;
-			}
+	stats_report(c);
 
-			proxy_fd = connect_socket(cro_addr);
-			if (proxy_fd == -1) {
-				close(fd);
-				continue;
-			}
+	if (c->waiting)
+		wait_remove(c);
+
+	if (c->up) {
+		struct upstream *up = c->up;
+
+		/*
+		 * The upstream stream is now in an unknown state, a partial
+		 * request may have been sent or a reply may still arrive.
+		 * Start again with a fresh connection.
+		 */
+		upstream_close(up);
+		c->up = NULL;
+		upstream_release(up);
+	}
+
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, c->ep.fd, NULL);
+	close(c->ep.fd);
+
+	for (p = &clients; *p; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+
+	free(c->out);
+	free(c->stats.latency);
+	free(c);
+}
+
+/*
+ * Write out what is left of a reply.  Returns 1 once all of it has been
+ * written, 0 if the socket is full and -1 on error.
+ */
+static int client_flush(struct client *c)
+{
+	ssize_t n;
+
+	while (c->out_off < c->out_len) {
+		n = write(c->ep.fd, c->out + c->out_off, c->out_len - c->out_off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return 0;
+		if (n <= 0)
+			return -1;
+
+		c->out_off += n;
+	}
+
+	free(c->out);
+	c->out = NULL;
+	c->out_len = c->out_off = 0;
+
+	return 1;
+}
+
+/*
+ * Send a reply without blocking.  If the client is not reading, keep
+ * the rest for when it is and don't read its next request until then,
+ * so there is never more than one reply waiting.
+ */
+static bool client_send(struct client *c, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(c->ep.fd, ptr, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			break;
+		if (n <= 0)
+			return false;
+
+		ptr += n;
+		len -= n;
+	}
+
+	if (!len)
+		return epoll_set(&c->ep, EPOLL_CTL_MOD, EPOLLIN);
+
+	c->out = malloc(len);
+	if (!c->out) {
+		fprintf(stderr, "Memory allocation error\n");
+		return false;
+	}
 
-			if (!set_nonblocking(fd)) {
-				close(proxy_fd);
-				close(fd);
+	memcpy(c->out, ptr, len);
+	c->out_len = len;
+	c->out_off = 0;
+
+	return epoll_set(&c->ep, EPOLL_CTL_MOD, EPOLLOUT);
+}
+
+static void client_accept(int listen_fd)
+{
+	struct client *c;
+	uint32_t hello[2];
+	int fd, val = 1;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		perror("accept");
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		fprintf(stderr, "Memory allocation error\n");
+		close(fd);
+		return;
+	}
+
+	c->ep.type = EP_CLIENT;
+	c->ep.fd = fd;
+	c->id = next_client_id++;
+	clock_gettime(CLOCK_MONOTONIC, &c->stats.connected);
+
+	/*
+	 * The greeting is generated locally as upstream links are shared.
+	 * Make sure the server has been seen at least once to report its
+	 * version.
+	 */
+	if (!server_hello && !upstream_connect(&upstreams[0])) {
+		close(fd);
+		free(c);
+		return;
+	}
+
+	hello[0] = htonl(0);
+	hello[1] = server_hello;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	if (!set_nonblocking(fd) ||
+	    !epoll_set(&c->ep, EPOLL_CTL_ADD, 0)) {
+		close(fd);
+		free(c);
+		return;
+	}
+
+	c->next = clients;
+	clients = c;
+
+	if (!client_send(c, hello, sizeof(hello))) {
+		client_close(c);
+		return;
+	}
+
+	fprintf(stderr, "client %d: connected fd=%d\n", c->id, fd);
+}
+
+/* Discard anything left in the splice pipe after a failed transfer */
+static void pipe_drain(void)
+{
+	uint8_t data[BUFFER_SIZE];
+
+	while (read(pipefd[0], data, sizeof(data)) > 0)
+		;
+}
+
+/*
+ * Move up to len bytes of request payload from the client to the
+ * upstream connection.  Returns the number of bytes moved, 0 if no data
+ * is available yet or -1 on error.
+ */
+
+static ssize_t forward_body(struct client *c, uint32_t len)
+{
+	int up_fd = c->up->ep.fd;
+	ssize_t n, m;
+
+	if (use_splice && len >= SPLICE_MIN) {
+		if (len > BUFFER_SIZE)
+			len = BUFFER_SIZE;
+
+		n = splice(c->ep.fd, NULL, pipefd[1], NULL, len,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == -1 && errno == EINVAL) {
+			use_splice = false;
+			goto copy;
+		}
+		if (n == -1)
+			return errno == EAGAIN ? 0 : -1;
+		if (n == 0)
+			return -1;
+
+		for (m = n; m > 0; ) {
+			ssize_t ret;
+
+			ret = splice(pipefd[0], NULL, up_fd, NULL, m, SPLICE_F_MOVE);
+			if (ret == -1 && errno == EAGAIN && wait_fd(up_fd, POLLOUT))
 				continue;
+			if (ret <= 0) {
+				pipe_drain();
+				return -1;
 			}
 
-			fprintf(stderr, "accepted connection fd=%d\n", fd);
-			client_fd = fd;
+			m -= ret;
+		}
 
-			ev.events = EPOLLIN | EPOLLET;
-			ev.data.fd = client_fd;
+		return n;
+	}
 
-			ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, client_fd, &ev);
-			if (ret == -1) {
-				perror("epoll_ctl(ADD, client_fd)");
-				close(client_fd);
-				client_fd = -1;
-				close(proxy_fd);
-				proxy_fd = -1;
+copy:
+	{
+		uint8_t data[BUFFER_SIZE];
 
-				continue;
+		if (len > sizeof(data))
+			len = sizeof(data);
+
+		n = read(c->ep.fd, data, len);
+		if (n == -1)
+			return errno == EAGAIN ? 0 : -1;
+		if (n == 0)
+			return -1;
+
+		if (verbose)
+			dump_data("REQUEST", c->ep.fd, data, n);
+
+		if (!write_all(up_fd, data, n))
+			return -1;
+
+		return n;
+	}
+}
+
+/*
+ * Read the next piece of a fixed size header into c->hdr.  Returns 1
+ * once the header is complete, 0 if more data is needed and -1 on
+ * error.
+ */
+static int read_header(struct client *c, size_t len)
+{
+	ssize_t n;
+
+	n = read(c->ep.fd, c->hdr + c->hdr_len, len - c->hdr_len);
+	if (n == -1)
+		return errno == EAGAIN ? 0 : -1;
+	if (n == 0)
+		return -1;
+
+	c->hdr_len += n;
+	if (c->hdr_len < len)
+		return 0;
+
+	c->hdr_len = 0;
+	if (verbose)
+		dump_data("REQUEST", c->ep.fd, c->hdr, len);
+
+	return 1;
+}
+
+static bool add_key(struct upstream *up, uint32_t client_key, uint32_t proxy_key)
+{
+	if (up->nkeys == up->keys_alloc) {
+		uint32_t alloc = up->keys_alloc ? 2 * up->keys_alloc : 4;
+		struct key_map *ptr;
+
+		ptr = realloc(up->keys, alloc * sizeof(*ptr));
+		if (!ptr)
+			return false;
+
+		up->keys = ptr;
+		up->keys_alloc = alloc;
+	}
+
+	up->keys[up->nkeys++] = (struct key_map) {
+		.client_key = client_key,
+		.proxy_key = proxy_key,
+	};
+
+	return true;
+}
+
+/* Forward as much of the client's current request as is available */
+static bool forward_request(struct client *c)
+{
+	struct upstream *up = c->up;
+	uint32_t *words = (uint32_t *)c->hdr;
+	ssize_t n;
+	int ret;
+
+	while (c->state != REQ_DONE) {
+		switch (c->state) {
+		case REQ_COUNT:
+			ret = read_header(c, sizeof(uint32_t));
+			if (ret <= 0)
+				return ret == 0;
+
+			c->ncmds = be32toh(words[0]);
+			c->cmd = 0;
+			if (!write_all(up->ep.fd, c->hdr, sizeof(uint32_t)))
+				return false;
+
+			c->state = c->ncmds ? REQ_HEADER : REQ_DONE;
+			break;
+
+		case REQ_HEADER:
+			ret = read_header(c, 3 * sizeof(uint32_t));
+			if (ret <= 0)
+				return ret == 0;
+
+			/* Replace the client's key with one unique to the proxy */
+			if (!add_key(up, be32toh(words[0]), next_key))
+				return false;
+			words[0] = htobe32(next_key++);
+
+			c->body_left = be32toh(words[2]);
+			if (!write_all(up->ep.fd, c->hdr, 3 * sizeof(uint32_t)))
+				return false;
+
+			c->state = REQ_BODY;
+			break;
+
+		case REQ_BODY:
+			if (c->body_left) {
+				n = forward_body(c, c->body_left);
+				if (n <= 0)
+					return n == 0;
+
+				c->body_left -= n;
 			}
-			fprintf(stderr, "added fd=%d\n", client_fd);
-
-			ev.events = EPOLLIN | EPOLLET;
-			ev.data.fd = proxy_fd;
-
-			ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, proxy_fd, &ev);
-			if (ret == -1) {
-				perror("epoll_ctl(ADD, proxy_fd)");
-				close(client_fd);
-				client_fd = -1;
-				close(proxy_fd);
-				proxy_fd = -1;
+
+			if (c->body_left == 0) {
+				c->cmd++;
+				c->state = c->cmd < c->ncmds ? REQ_HEADER : REQ_DONE;
 			}
+			break;
 
-			continue;
+		case REQ_DONE:
+			break;
+		}
+	}
+
+	/* Stop reading until the reply has been delivered */
+	return epoll_set(&c->ep, EPOLL_CTL_MOD, 0);
+}
+
+static void client_event(struct client *c, uint32_t events)
+{
+	struct upstream *up;
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		fprintf(stderr, "client %d: closed\n", c->id);
+		client_close(c);
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		int ret = client_flush(c);
+
+		if (ret < 0 || (ret && !epoll_set(&c->ep, EPOLL_CTL_MOD, EPOLLIN))) {
+			fprintf(stderr, "client %d: closed\n", c->id);
+			client_close(c);
+		}
+		return;
+	}
+
+	if (c->waiting)
+		return;
+
+	if (!c->up) {
+		uint8_t byte;
+		ssize_t n;
+
+		/* Don't tie up an upstream link for a client that has gone */
+		n = recv(c->ep.fd, &byte, 1, MSG_PEEK);
+		if (n == 0 || (n == -1 && errno != EAGAIN)) {
+			fprintf(stderr, "client %d: closed\n", c->id);
+			client_close(c);
+			return;
 		}
 
-		ret = 0;
-		if (event.data.fd == client_fd) {
-			ret = copy_data(client_fd, proxy_fd, "REQUEST");
-		} else if (event.data.fd == proxy_fd) {
-			ret = copy_data(proxy_fd, client_fd, "REPLY");
+		if (!c->started) {
+			clock_gettime(CLOCK_MONOTONIC, &c->start);
+			c->started = true;
 		}
-		if (ret != 0) {
-			fprintf(stderr, "closed fd=%d\n", client_fd);
-			epoll_ctl(epollfd, EPOLL_CTL_DEL, client_fd, NULL);
-			close(client_fd);
-			client_fd = -1;
-			epoll_ctl(epollfd, EPOLL_CTL_DEL, proxy_fd, NULL);
-			close(proxy_fd);
-			proxy_fd = -1;
+
+		up = upstream_idle();
+		if (!up) {
+			/* All upstream links are busy, wait for one */
+			wait_enqueue(c);
+			epoll_set(&c->ep, EPOLL_CTL_MOD, 0);
+			return;
 		}
+
+		upstream_bind(up, c);
 	}
 
+	if (!forward_request(c)) {
+		fprintf(stderr, "client %d: closed\n", c->id);
+		client_close(c);
+	}
+}
 
-fail:
-	if (epollfd != -1) {
-		if (client_fd != -1) {
-			epoll_ctl(epollfd, EPOLL_CTL_DEL, client_fd, NULL);
-			close(client_fd);
+static bool reply_grow(struct upstream *up, size_t size)
+{
+	uint8_t *ptr;
+
+	if (up->alloc - up->len >= size)
+		return true;
+
+	size = up->len + size;
+	if (size < 2 * up->alloc)
+		size = 2 * up->alloc;
+
+	ptr = realloc(up->buf, size);
+	if (!ptr)
+		return false;
+
+	up->buf = ptr;
+	up->alloc = size;
+	return true;
+}
+
+static bool rewrite_key(struct upstream *up, uint32_t *word)
+{
+	uint32_t key = be32toh(*word);
+	uint32_t i;
+
+	for (i = 0; i < up->nkeys; i++) {
+		if (up->keys[i].proxy_key == key) {
+			*word = htobe32(up->keys[i].client_key);
+			return true;
 		}
-		if (proxy_fd != -1) {
-			epoll_ctl(epollfd, EPOLL_CTL_DEL, proxy_fd, NULL);
-			close(proxy_fd);
+	}
+
+	fprintf(stderr, "upstream %d: unexpected key 0x%08x\n", up->id, key);
+	return false;
+}
+
+/*
+ * Walk the reply collected so far, restoring client keys.  Returns 1
+ * once the reply is complete, 0 if more data is needed and -1 if the
+ * reply is malformed.
+ */
+static int parse_reply(struct upstream *up)
+{
+	uint32_t type, size, rc;
+	uint8_t *ptr;
+
+	if (up->parsed == 0) {
+		if (up->len < sizeof(uint32_t))
+			return 0;
+
+		memcpy(&up->nreplies, up->buf, sizeof(uint32_t));
+		up->nreplies = be32toh(up->nreplies);
+		up->parsed = sizeof(uint32_t);
+	}
+
+	while (up->reply < up->nreplies) {
+		if (up->len - up->parsed < 3 * sizeof(uint32_t))
+			return 0;
+
+		ptr = up->buf + up->parsed;
+		memcpy(&type, ptr + 4, sizeof(type));
+		memcpy(&size, ptr + 8, sizeof(size));
+		type = be32toh(type);
+		size = be32toh(size);
+
+		if (up->len - up->parsed < 3 * sizeof(uint32_t) + size)
+			return 0;
+
+		if (!rewrite_key(up, (uint32_t *)ptr))
+			return -1;
+
+		if (type == RESULT_TYPE_INSTRUCTION_STATUS &&
+		    size >= 3 * sizeof(uint32_t)) {
+			memcpy(&rc, ptr + 5 * sizeof(uint32_t), sizeof(rc));
+			if (be32toh(rc) != SERVER_COMMAND_COMPLETE)
+				up->failed = true;
 		}
 
-		epoll_ctl(epollfd, EPOLL_CTL_DEL, listen_fd, NULL);
-		close(listen_fd);
+		up->parsed += 3 * sizeof(uint32_t) + size;
+		up->reply++;
 	}
 
-	return -1;
+	/*
+	 * A failed instruction is followed by an error string.  It is not
+	 * length prefixed, so like the client take whatever the server has
+	 * sent so far.
+	 */
+	return 1;
+}
+
+static void upstream_event(struct upstream *up)
+{
+	struct client *c = up->client;
+	ssize_t n;
+	int ret;
+
+	/* Drain the socket */
+	while (1) {
+		if (!reply_grow(up, BUFFER_SIZE)) {
+			fprintf(stderr, "Memory allocation error\n");
+			goto reset;
+		}
+
+		n = read(up->ep.fd, up->buf + up->len, up->alloc - up->len);
+		if (n == -1 && errno == EAGAIN)
+			break;
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "upstream %d: connection lost\n", up->id);
+			goto reset;
+		}
+
+		if (verbose)
+			dump_data("REPLY", up->ep.fd, up->buf + up->len, n);
+
+		up->len += n;
+	}
+
+	if (!c) {
+		fprintf(stderr, "upstream %d: unsolicited data\n", up->id);
+		goto reset;
+	}
+
+	/* Replies to a partially forwarded request are not expected */
+	if (c->state != REQ_DONE) {
+		fprintf(stderr, "upstream %d: early reply\n", up->id);
+		goto reset;
+	}
+
+	ret = parse_reply(up);
+	if (ret == 0)
+		return;
+	if (ret < 0)
+		goto reset;
+
+	stats_add(&c->stats, elapsed_us(&c->start), up->failed);
+	c->started = false;
+	c->up = NULL;
+
+	if (!client_send(c, up->buf, up->len)) {
+		fprintf(stderr, "client %d: closed\n", c->id);
+		client_close(c);
+	}
+
+	upstream_release(up);
+	return;
+
+reset:
+	upstream_close(up);
+	if (c) {
+		c->up = NULL;
+		client_close(c);
+	}
+	upstream_release(up);
 }
 
-int main(int argc, const char **argv)
+static int signal_fd(void)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		perror("sigprocmask");
+		return -1;
+	}
+
+	fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (fd == -1)
+		perror("signalfd");
+
+	return fd;
+}
+
+/* Returns true if the proxy should keep running */
+static bool signal_event(int fd)
+{
+	struct signalfd_siginfo info;
+
+	if (read(fd, &info, sizeof(info)) != sizeof(info))
+		return true;
+
+	report_all();
+
+	return info.ssi_signo == SIGUSR1;
+}
+
+static int event_loop(int listen_fd)
+{
+	struct endpoint listen_ep = { .type = EP_LISTEN, .fd = listen_fd };
+	struct endpoint signal_ep = { .type = EP_SIGNAL };
+	struct epoll_event events[MAX_EVENTS];
+	int nfds, i;
+
+	epollfd = epoll_create1(0);
+	if (epollfd == -1) {
+		perror("epollfd");
+		return -1;
+	}
+
+	signal_ep.fd = signal_fd();
+	if (signal_ep.fd == -1)
+		return -1;
+
+	if (!epoll_set(&listen_ep, EPOLL_CTL_ADD, EPOLLIN) ||
+	    !epoll_set(&signal_ep, EPOLL_CTL_ADD, EPOLLIN))
+		return -1;
+
+	while (1) {
+		nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			struct endpoint *ep = events[i].data.ptr;
+
+			switch (ep->type) {
+			case EP_LISTEN:
+				client_accept(listen_fd);
+				break;
+
+			case EP_SIGNAL:
+				if (!signal_event(ep->fd))
+					return 0;
+				break;
+
+			case EP_CLIENT:
+				client_event((struct client *)ep, events[i].events);
+				break;
+
+			case EP_UPSTREAM:
+				upstream_event((struct upstream *)ep);
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-l <port>] [-u <count>] [-v] <croserver-ip> [<croserver-port>]\n", prog);
+	fprintf(stderr, "\t-l <port>\tPort to listen on (default %d)\n", CRONUS_PORT);
+	fprintf(stderr, "\t-u <count>\tNumber of upstream connections (default 1, max %d)\n", MAX_UPSTREAM);
+	fprintf(stderr, "\t-v\t\tDump all data passing through the proxy\n");
+}
+
+int main(int argc, char * const *argv)
 {
 	struct addrinfo hints, *result;
-	struct sockaddr_in addr;
 	const char *hostname;
 	unsigned short port = CRONUS_PORT;
-	int listen_fd, ret;
+	unsigned short listen_port = CRONUS_PORT;
+	int listen_fd, ret, opt, i;
+
+	while ((opt = getopt(argc, argv, "l:u:v")) != -1) {
+		switch (opt) {
+		case 'l':
+			listen_port = atoi(optarg);
+			break;
+
+		case 'u':
+			num_upstream = atoi(optarg);
+			if (num_upstream < 1 || num_upstream > MAX_UPSTREAM) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+
+		case 'v':
+			verbose = true;
+			break;
+
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
 
-	if (argc < 2 || argc > 3) {
-		fprintf(stderr, "Usage: %s <croserver-ip> [<croserver-port>]\n", argv[0]);
+	if (argc - optind < 1 || argc - optind > 2) {
+		usage(argv[0]);
 		exit(1);
 	}
 
-	hostname = argv[1];
-	if (argc == 3) {
-		port = atoi(argv[2]);
+	hostname = argv[optind];
+	if (argc - optind == 2) {
+		port = atoi(argv[optind + 1]);
 	}
 
 	hints = (struct addrinfo) {
@@ -295,18 +1281,29 @@ int main(int argc, const char **argv)
 
 	ret = getaddrinfo(hostname, NULL, &hints, &result);
 	if (ret != 0) {
-		perror("getaddrinfo");
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
 		exit(1);
 	}
 
-	addr = *(struct sockaddr_in *)result->ai_addr;
-	addr.sin_port = htons(port);
+	cro_addr = *(struct sockaddr_in *)result->ai_addr;
+	cro_addr.sin_port = htons(port);
 
 	freeaddrinfo(result);
 
-	listen_fd = listen_socket(CRONUS_PORT);
+	for (i = 0; i < MAX_UPSTREAM; i++) {
+		upstreams[i].ep.fd = -1;
+		upstreams[i].id = i;
+	}
+
+	/* Data dumps need the bytes in user space */
+	if (verbose || pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) == -1)
+		use_splice = false;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	listen_fd = listen_socket(listen_port);
 	if (listen_fd == -1)
 		exit(1);
 
-	return event_loop(listen_fd, &addr);
+	return event_loop(listen_fd);
 }
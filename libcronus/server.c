@@ -0,0 +1,825 @@
+/* Copyright 2019 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A Cronus server emulator for testing without hardware.
+ *
+ * It speaks the FEEDB0B0 handshake and the FSI (SCOM/CFAM) and SBEFIFO
+ * instructions used by libcronus, backed by an in-memory register model.
+ * Every connection is served by a forked child, the register model lives
+ * in shared memory so writes are visible to later connections.
+ *
+ * SCOM and CFAM registers which have never been written read back as
+ * their own address, memory which has never been written reads as zero.
+ *
+ * Latency and failures can be injected to exercise the client and
+ * cronus_proxy under less than ideal conditions.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libsbefifo/libsbefifo.h"
+#include "libsbefifo/sbefifo_private.h"
+
+#include "buffer.h"
+#include "instruction.h"
+
+#define CRONUS_PORT	8192
+
+#define SERVER_VERSION	1
+
+#define MAX_INSTRUCTIONS	64
+
+/* Number of registers (or 8 byte memory granules) that can be written */
+#define MODEL_SIZE	(1 << 18)
+
+enum space {
+	SPACE_NONE = 0,
+	SPACE_SCOM,
+	SPACE_CFAM,
+	SPACE_MEM,
+};
+
+struct reg {
+	uint32_t space;
+	uint32_t index;
+	uint64_t addr;
+	uint64_t value;
+};
+
+struct model {
+	bool lock;
+	uint32_t used;
+	struct reg regs[MODEL_SIZE];
+};
+
+struct instruction {
+	uint32_t key;
+	uint32_t type;
+	uint32_t version;
+	uint32_t command;
+	uint32_t flags;
+	struct cronus_buffer payload;
+	struct cronus_buffer data;
+	uint32_t rc;
+	const char *error;
+};
+
+static struct model *model;
+
+static unsigned int delay_us;
+static unsigned int jitter_us;
+static unsigned int error_rate;
+static unsigned int seed;
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *ptr = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, ptr, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		ptr += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, ptr, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		ptr += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool read_uint32(int fd, uint32_t *value)
+{
+	uint32_t data;
+
+	if (!read_all(fd, &data, sizeof(data)))
+		return false;
+
+	*value = be32toh(data);
+	return true;
+}
+
+static bool model_init(void)
+{
+	model = mmap(NULL, sizeof(struct model), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (model == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The model is shared between all the forked children, the critical
+ * sections are tiny so a spinlock is plenty.
+ */
+static void model_lock(void)
+{
+	while (__atomic_test_and_set(&model->lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void model_unlock(void)
+{
+	__atomic_clear(&model->lock, __ATOMIC_RELEASE);
+}
+
+static struct reg *model_find(uint32_t space, uint32_t index, uint64_t addr)
+{
+	struct reg *reg;
+	uint64_t hash;
+	uint32_t i;
+
+	hash = (addr ^ ((uint64_t)space << 56) ^ ((uint64_t)index << 48)) *
+		0x9e3779b97f4a7c15ULL;
+
+	for (i = 0; i < MODEL_SIZE; i++) {
+		reg = &model->regs[(hash + i) & (MODEL_SIZE - 1)];
+
+		if (reg->space == SPACE_NONE)
+			return reg;
+
+		if (reg->space == space && reg->index == index &&
+		    reg->addr == addr)
+			return reg;
+	}
+
+	return NULL;
+}
+
+static uint64_t model_read(uint32_t space, uint32_t index, uint64_t addr,
+			   uint64_t def)
+{
+	struct reg *reg;
+	uint64_t value = def;
+
+	model_lock();
+	reg = model_find(space, index, addr);
+	if (reg && reg->space != SPACE_NONE)
+		value = reg->value;
+	model_unlock();
+
+	return value;
+}
+
+static bool model_write(uint32_t space, uint32_t index, uint64_t addr,
+			uint64_t value)
+{
+	struct reg *reg;
+	bool ok = true;
+
+	model_lock();
+	reg = model_find(space, index, addr);
+	if (!reg) {
+		ok = false;
+	} else if (reg->space == SPACE_NONE) {
+		/* Keep the table at most 3/4 full so probing stays short */
+		if (model->used >= MODEL_SIZE / 4 * 3) {
+			ok = false;
+		} else {
+			*reg = (struct reg) {
+				.space = space,
+				.index = index,
+				.addr = addr,
+				.value = value,
+			};
+			model->used++;
+		}
+	} else {
+		reg->value = value;
+	}
+	model_unlock();
+
+	return ok;
+}
+
+static void reply_dbuf(struct cronus_buffer *reply, uint32_t key,
+		       uint8_t *data, uint32_t len)
+{
+	cbuf_write_uint32(reply, key);
+	cbuf_write_uint32(reply, RESULT_TYPE_ECMD_DBUF);
+	cbuf_write_uint32(reply, len);
+	if (len)
+		cbuf_write(reply, data, len);
+}
+
+static void reply_status(struct cronus_buffer *reply, uint32_t key,
+			 uint32_t version, uint32_t rc)
+{
+	cbuf_write_uint32(reply, key);
+	cbuf_write_uint32(reply, RESULT_TYPE_INSTRUCTION_STATUS);
+	cbuf_write_uint32(reply, 4 * sizeof(uint32_t));
+	cbuf_write_uint32(reply, 1);
+	cbuf_write_uint32(reply, version);
+	cbuf_write_uint32(reply, rc);
+	cbuf_write_uint32(reply, 0);
+}
+
+static void data_uint32(struct cronus_buffer *data, uint32_t value)
+{
+	cbuf_write_uint32(data, 8 * sizeof(uint32_t));
+	cbuf_write_uint32(data, 8 * sizeof(uint32_t));
+	cbuf_write_uint32(data, value);
+}
+
+static void data_uint64(struct cronus_buffer *data, uint64_t value)
+{
+	cbuf_write_uint32(data, 8 * sizeof(uint64_t));
+	cbuf_write_uint32(data, 8 * sizeof(uint64_t));
+	cbuf_write_uint64(data, value);
+}
+
+static bool payload_has(struct instruction *insn, size_t len)
+{
+	return cbuf_offset(&insn->payload) + len <= cbuf_size(&insn->payload);
+}
+
+/*
+ * Decode the device string which follows the address in FSI and SBEFIFO
+ * instructions.  libcronus sends "1" for pib index 0, "2" for index 1 and
+ * so on.
+ */
+static bool read_devstr(struct instruction *insn, uint32_t len,
+			uint32_t *index)
+{
+	uint8_t devstr[16];
+
+	if (len == 0 || len > sizeof(devstr) || !payload_has(insn, len))
+		return false;
+
+	cbuf_read(&insn->payload, devstr, len);
+	if (devstr[0] < '1' || devstr[0] > '8')
+		return false;
+
+	*index = devstr[0] - '1';
+	return true;
+}
+
+static bool do_fsi(struct instruction *insn)
+{
+	uint32_t bits, devstr_len, value_len, capacity, index;
+	uint64_t addr64, value64;
+	uint32_t addr32, value32;
+
+	switch (insn->command) {
+	case INSTRUCTION_CMD_SCOMOUT:
+	case INSTRUCTION_CMD_SCOMIN:
+		if (!payload_has(insn, 4 * sizeof(uint32_t)))
+			return false;
+
+		cbuf_read_uint64(&insn->payload, &addr64);
+		cbuf_read_uint32(&insn->payload, &bits);
+		cbuf_read_uint32(&insn->payload, &devstr_len);
+		break;
+
+	case INSTRUCTION_CMD_READSPMEM:
+	case INSTRUCTION_CMD_WRITESPMEM:
+		if (!payload_has(insn, 3 * sizeof(uint32_t)))
+			return false;
+
+		cbuf_read_uint32(&insn->payload, &addr32);
+		cbuf_read_uint32(&insn->payload, &bits);
+		cbuf_read_uint32(&insn->payload, &devstr_len);
+		break;
+
+	default:
+		return false;
+	}
+
+	if (insn->command == INSTRUCTION_CMD_SCOMIN ||
+	    insn->command == INSTRUCTION_CMD_WRITESPMEM) {
+		if (!payload_has(insn, sizeof(uint32_t)))
+			return false;
+
+		cbuf_read_uint32(&insn->payload, &value_len);
+	}
+
+	if (!read_devstr(insn, devstr_len, &index))
+		return false;
+
+	switch (insn->command) {
+	case INSTRUCTION_CMD_SCOMOUT:
+		value64 = model_read(SPACE_SCOM, index, addr64, addr64);
+		data_uint64(&insn->data, value64);
+		return true;
+
+	case INSTRUCTION_CMD_READSPMEM:
+		value32 = model_read(SPACE_CFAM, index, addr32, addr32);
+		data_uint32(&insn->data, value32);
+		return true;
+
+	case INSTRUCTION_CMD_SCOMIN:
+		if (!payload_has(insn, 2 * sizeof(uint32_t) + sizeof(uint64_t)))
+			return false;
+
+		cbuf_read_uint32(&insn->payload, &capacity);
+		cbuf_read_uint32(&insn->payload, &bits);
+		cbuf_read_uint64(&insn->payload, &value64);
+		return model_write(SPACE_SCOM, index, addr64, value64);
+
+	case INSTRUCTION_CMD_WRITESPMEM:
+		if (!payload_has(insn, 3 * sizeof(uint32_t)))
+			return false;
+
+		cbuf_read_uint32(&insn->payload, &capacity);
+		cbuf_read_uint32(&insn->payload, &bits);
+		cbuf_read_uint32(&insn->payload, &value32);
+		return model_write(SPACE_CFAM, index, addr32, value32);
+	}
+
+	return false;
+}
+
+static uint32_t sbefifo_word(uint8_t *buf, uint32_t i)
+{
+	return be32toh(((uint32_t *)buf)[i]);
+}
+
+/*
+ * Execute a single SBEFIFO command.  Response data words are written to
+ * out[] and the SBEFIFO status is returned.
+ */
+static uint32_t do_sbefifo_cmd(uint32_t index, uint8_t *msg, uint32_t msg_len,
+			       uint32_t *out, uint32_t out_max,
+			       uint32_t *out_len)
+{
+	uint32_t nwords, cmd, flags, len, align, i;
+	uint64_t addr, value;
+
+	*out_len = 0;
+
+	nwords = sbefifo_word(msg, 0);
+	cmd = sbefifo_word(msg, 1);
+
+	if (nwords * 4 != msg_len)
+		return SBEFIFO_PRI_INVALID_DATA;
+
+	switch (cmd) {
+	case SBEFIFO_CMD_CLASS_SCOM | SBEFIFO_CMD_GET_SCOM:
+		if (nwords != 4 || out_max < 2)
+			return SBEFIFO_PRI_INVALID_DATA;
+
+		addr = (uint64_t)sbefifo_word(msg, 2) << 32 | sbefifo_word(msg, 3);
+		value = model_read(SPACE_SCOM, index, addr, addr);
+		out[0] = htobe32(value >> 32);
+		out[1] = htobe32(value & 0xffffffff);
+		*out_len = 2;
+		return SBEFIFO_PRI_SUCCESS;
+
+	case SBEFIFO_CMD_CLASS_SCOM | SBEFIFO_CMD_PUT_SCOM:
+		if (nwords != 6)
+			return SBEFIFO_PRI_INVALID_DATA;
+
+		addr = (uint64_t)sbefifo_word(msg, 2) << 32 | sbefifo_word(msg, 3);
+		value = (uint64_t)sbefifo_word(msg, 4) << 32 | sbefifo_word(msg, 5);
+		if (!model_write(SPACE_SCOM, index, addr, value))
+			return SBEFIFO_PRI_INTERNAL_ERROR;
+		return SBEFIFO_PRI_SUCCESS;
+
+	case SBEFIFO_CMD_CLASS_MEMORY | SBEFIFO_CMD_GET_MEMORY:
+	case SBEFIFO_CMD_CLASS_MEMORY | SBEFIFO_CMD_PUT_MEMORY:
+		if (nwords < 6)
+			return SBEFIFO_PRI_INVALID_DATA;
+
+		flags = sbefifo_word(msg, 2);
+		addr = (uint64_t)sbefifo_word(msg, 3) << 32 | sbefifo_word(msg, 4);
+		len = sbefifo_word(msg, 5);
+
+		if (flags & SBEFIFO_MEMORY_FLAG_PROC)
+			align = 8;
+		else if (flags & SBEFIFO_MEMORY_FLAG_PBA)
+			align = 128;
+		else
+			return SBEFIFO_PRI_INVALID_DATA;
+
+		/* ECC and tag bytes are not modelled */
+		if (flags & (SBEFIFO_MEMORY_FLAG_ECC_REQ | SBEFIFO_MEMORY_FLAG_TAG_REQ))
+			return SBEFIFO_PRI_INVALID_DATA;
+
+		if (addr & (align - 1) || len & (align - 1))
+			return SBEFIFO_PRI_INVALID_DATA;
+
+		if (cmd == (SBEFIFO_CMD_CLASS_MEMORY | SBEFIFO_CMD_GET_MEMORY)) {
+			if (nwords != 6 || len / 4 + 1 > out_max)
+				return SBEFIFO_PRI_INVALID_DATA;
+
+			for (i = 0; i < len / 8; i++) {
+				value = model_read(SPACE_MEM, index, addr + i * 8, 0);
+				out[2 * i] = htobe32(value >> 32);
+				out[2 * i + 1] = htobe32(value & 0xffffffff);
+			}
+			out[len / 4] = htobe32(len);
+			*out_len = len / 4 + 1;
+		} else {
+			if (nwords != 6 + len / 4 || out_max < 1)
+				return SBEFIFO_PRI_INVALID_DATA;
+
+			for (i = 0; i < len / 8; i++) {
+				value = (uint64_t)sbefifo_word(msg, 6 + 2 * i) << 32 |
+					sbefifo_word(msg, 6 + 2 * i + 1);
+				if (!model_write(SPACE_MEM, index, addr + i * 8, value))
+					return SBEFIFO_PRI_INTERNAL_ERROR;
+			}
+			out[0] = htobe32(len);
+			*out_len = 1;
+		}
+		return SBEFIFO_PRI_SUCCESS;
+	}
+
+	return SBEFIFO_PRI_INVALID_COMMAND | SBEFIFO_SEC_INVALID_CMD;
+}
+
+static bool do_sbefifo(struct instruction *insn)
+{
+	uint32_t timeout, reply_len, devstr_len, request_len, bits, index;
+	uint32_t *out, out_len, status, cmd;
+	uint8_t *msg;
+	int ret;
+
+	if (insn->command != INSTRUCTION_CMD_SUBMIT)
+		return false;
+
+	if (!payload_has(insn, 4 * sizeof(uint32_t)))
+		return false;
+
+	cbuf_read_uint32(&insn->payload, &timeout);
+	cbuf_read_uint32(&insn->payload, &reply_len);
+	cbuf_read_uint32(&insn->payload, &devstr_len);
+	cbuf_read_uint32(&insn->payload, &request_len);
+
+	if (!read_devstr(insn, devstr_len, &index))
+		return false;
+
+	if (request_len < 2 * sizeof(uint32_t) || request_len & 3 ||
+	    reply_len < 3 * sizeof(uint32_t) ||
+	    !payload_has(insn, 2 * sizeof(uint32_t) + request_len))
+		return false;
+
+	cbuf_read_uint32(&insn->payload, &bits);
+	cbuf_read_uint32(&insn->payload, &bits);
+	msg = cbuf_ptr(&insn->payload);
+
+	/* Leave room for the header, status and offset words */
+	out = malloc(reply_len & ~3);
+	if (!out)
+		return false;
+
+	status = do_sbefifo_cmd(index, msg, request_len, out,
+				reply_len / 4 - 3, &out_len);
+
+	cmd = sbefifo_word(msg, 1);
+	out[out_len++] = htobe32(0xc0de0000 | cmd);
+	out[out_len++] = htobe32(status);
+	out[out_len++] = htobe32(3);
+
+	ret = cbuf_new(&insn->data, 2 * sizeof(uint32_t) + out_len * 4);
+	if (ret) {
+		free(out);
+		return false;
+	}
+
+	cbuf_write_uint32(&insn->data, out_len * 4 * 8);
+	cbuf_write_uint32(&insn->data, out_len * 4 * 8);
+	cbuf_write(&insn->data, (uint8_t *)out, out_len * 4);
+	free(out);
+
+	return true;
+}
+
+static unsigned int random_below(unsigned int limit)
+{
+	return limit ? rand_r(&seed) % limit : 0;
+}
+
+/*
+ * Execute an instruction, filling in the reply data and status.  Returns
+ * false if the instruction failed.
+ */
+static bool do_instruction(struct instruction *insn)
+{
+	bool ok = false;
+
+	if (delay_us || jitter_us)
+		usleep(delay_us + random_below(jitter_us));
+
+	if (random_below(100) < error_rate) {
+		insn->rc = ECMD_ERR_CRONUS;
+		insn->error = "Injected error";
+		return false;
+	}
+
+	if (insn->type == INSTRUCTION_TYPE_FSI) {
+		if (cbuf_new(&insn->data, 4 * sizeof(uint32_t)) == 0)
+			ok = do_fsi(insn);
+	} else if (insn->type == INSTRUCTION_TYPE_SBEFIFO) {
+		ok = do_sbefifo(insn);
+	}
+
+	if (!ok) {
+		/* Don't return partial data */
+		cbuf_free(&insn->data);
+		cbuf_init(&insn->data, NULL, 0);
+
+		insn->rc = ECMD_ERR_CRONUS;
+		insn->error = "Instruction not supported";
+		return false;
+	}
+
+	insn->rc = SERVER_COMMAND_COMPLETE;
+	return true;
+}
+
+static bool read_instruction(int fd, struct instruction *insn)
+{
+	uint32_t size;
+
+	if (!read_uint32(fd, &insn->key) ||
+	    !read_uint32(fd, &insn->type) ||
+	    !read_uint32(fd, &size))
+		return false;
+
+	if (size < 3 * sizeof(uint32_t))
+		return false;
+
+	if (cbuf_new(&insn->payload, size))
+		return false;
+
+	if (!read_all(fd, insn->payload.ptr, size))
+		return false;
+
+	cbuf_read_uint32(&insn->payload, &insn->version);
+	cbuf_read_uint32(&insn->payload, &insn->command);
+	cbuf_read_uint32(&insn->payload, &insn->flags);
+
+	return true;
+}
+
+/*
+ * Read a complete request before executing any of it, so that the reply
+ * can be sent with a single write.  Execution stops at the first failing
+ * instruction, its error message terminates the reply.
+ */
+static bool handle_request(int fd)
+{
+	struct instruction insns[MAX_INSTRUCTIONS];
+	struct cronus_buffer reply;
+	const char *error = NULL;
+	uint32_t count, i, n;
+	size_t len;
+	uint8_t *ptr;
+	bool ok = false;
+
+	if (!read_uint32(fd, &count))
+		return false;
+
+	if (count == 0 || count > MAX_INSTRUCTIONS)
+		return false;
+
+	memset(insns, 0, sizeof(insns));
+
+	for (i = 0; i < count; i++) {
+		if (!read_instruction(fd, &insns[i]))
+			goto out;
+	}
+
+	len = sizeof(uint32_t);
+	for (n = 0; n < count; n++) {
+		bool done = do_instruction(&insns[n]);
+
+		len += 6 * sizeof(uint32_t) + 4 * sizeof(uint32_t) +
+		       cbuf_offset(&insns[n].data);
+
+		if (!done) {
+			error = insns[n].error;
+			len += strlen(error) + 1;
+			n++;
+			break;
+		}
+	}
+
+	if (cbuf_new(&reply, len))
+		goto out;
+
+	cbuf_write_uint32(&reply, 2 * n);
+
+	for (i = 0; i < n; i++) {
+		reply_dbuf(&reply, insns[i].key, insns[i].data.ptr,
+			   cbuf_offset(&insns[i].data));
+		reply_status(&reply, insns[i].key, insns[i].version,
+			     insns[i].rc);
+	}
+
+	if (error)
+		cbuf_write(&reply, (uint8_t *)error, strlen(error) + 1);
+
+	ptr = cbuf_finish(&reply, &len);
+	ok = write_all(fd, ptr, len);
+	cbuf_free(&reply);
+
+out:
+	for (i = 0; i < count; i++) {
+		cbuf_free(&insns[i].payload);
+		cbuf_free(&insns[i].data);
+	}
+
+	return ok;
+}
+
+static void serve(int fd)
+{
+	uint32_t hello[2];
+
+	hello[0] = htonl(0);
+	hello[1] = htonl(0xFEEDB0B0 | SERVER_VERSION);
+
+	if (!write_all(fd, hello, sizeof(hello)))
+		return;
+
+	while (handle_request(fd))
+		;
+}
+
+static int listen_socket(const char *hostname, unsigned short port)
+{
+	struct sockaddr_in addr;
+	int fd, ret, val = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+	addr = (struct sockaddr_in) {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+	};
+
+	if (inet_pton(AF_INET, hostname, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address %s\n", hostname);
+		goto fail;
+	}
+
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret != 0) {
+		perror("bind");
+		goto fail;
+	}
+
+	ret = listen(fd, 16);
+	if (ret != 0) {
+		perror("listen");
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-d <usec>] [-j <usec>] [-e <percent>] [-s <seed>] [<ip> [<port>]]\n", prog);
+	fprintf(stderr, "\t-d <usec>\tDelay every instruction (default 0)\n");
+	fprintf(stderr, "\t-j <usec>\tAdd a random delay of up to <usec> (default 0)\n");
+	fprintf(stderr, "\t-e <percent>\tFail a percentage of instructions (default 0)\n");
+	fprintf(stderr, "\t-s <seed>\tRandom seed for jitter and errors\n");
+}
+
+int main(int argc, char * const *argv)
+{
+	const char *hostname = "127.0.0.1";
+	unsigned short port = CRONUS_PORT;
+	unsigned int connection = 0;
+	int listen_fd, fd, opt;
+
+	seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "d:j:e:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			delay_us = atoi(optarg);
+			break;
+
+		case 'j':
+			jitter_us = atoi(optarg);
+			break;
+
+		case 'e':
+			error_rate = atoi(optarg);
+			if (error_rate > 100) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+
+		case 's':
+			seed = atoi(optarg);
+			break;
+
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (argc - optind > 2) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (optind < argc)
+		hostname = argv[optind];
+	if (optind + 1 < argc)
+		port = atoi(argv[optind + 1]);
+
+	if (!model_init())
+		exit(1);
+
+	listen_fd = listen_socket(hostname, port);
+	if (listen_fd == -1)
+		exit(1);
+
+	signal(SIGCHLD, SIG_IGN);
+
+	while (1) {
+		pid_t pid;
+
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			exit(1);
+		}
+
+		connection++;
+
+		pid = fork();
+		if (pid == 0) {
+			close(listen_fd);
+			seed += connection;
+			serve(fd);
+			close(fd);
+			exit(0);
+		}
+
+		close(fd);
+	}
+
+	return 0;
+}
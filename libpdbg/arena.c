@@ -0,0 +1,119 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+#define ARENA_ALIGN		16
+
+struct pdbg_arena_chunk {
+	struct pdbg_arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct pdbg_arena target_arena = PDBG_ARENA_INIT;
+
+static struct pdbg_arena_chunk *arena_new_chunk(size_t size)
+{
+	struct pdbg_arena_chunk *chunk;
+
+	chunk = calloc(1, sizeof(*chunk) + size);
+	assert(chunk);
+	chunk->size = size;
+
+	return chunk;
+}
+
+static void *arena_alloc_locked(struct pdbg_arena *arena, size_t size)
+{
+	struct pdbg_arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!size)
+		size = ARENA_ALIGN;
+
+	/*
+	 * Large allocations get a chunk of their own behind the current
+	 * one, so the space left in the current chunk is not wasted.
+	 */
+	if (size > ARENA_CHUNK_SIZE / 4) {
+		chunk = arena_new_chunk(size);
+		chunk->used = size;
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			arena->chunks = chunk;
+		}
+
+		return chunk->data;
+	}
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk = arena_new_chunk(ARENA_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+void *arena_alloc(struct pdbg_arena *arena, size_t size)
+{
+	void *ptr;
+
+	pthread_mutex_lock(&arena->lock);
+	ptr = arena_alloc_locked(arena, size);
+	pthread_mutex_unlock(&arena->lock);
+
+	return ptr;
+}
+
+char *arena_strdup(struct pdbg_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy;
+
+	copy = arena_alloc(arena, len);
+	memcpy(copy, str, len);
+
+	return copy;
+}
+
+void arena_free(struct pdbg_arena *arena)
+{
+	struct pdbg_arena_chunk *chunk, *next;
+
+	pthread_mutex_lock(&arena->lock);
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena->chunks = NULL;
+	pthread_mutex_unlock(&arena->lock);
+}
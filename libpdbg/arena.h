@@ -0,0 +1,45 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __LIBPDBG_ARENA_H
+#define __LIBPDBG_ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * A bump allocator.  Memory is handed out from a few large chunks and is
+ * only ever freed all at once.
+ */
+struct pdbg_arena_chunk;
+
+struct pdbg_arena {
+	struct pdbg_arena_chunk *chunks;
+	pthread_mutex_t lock;
+};
+
+#define PDBG_ARENA_INIT { .chunks = NULL, .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/* Allocate zeroed memory, aborts on failure.  Safe to call from any thread. */
+void *arena_alloc(struct pdbg_arena *arena, size_t size);
+char *arena_strdup(struct pdbg_arena *arena, const char *str);
+
+/* Free everything allocated from the arena */
+void arena_free(struct pdbg_arena *arena);
+
+/* The arena holding the target tree, see pdbg_targets_fini() */
+extern struct pdbg_arena target_arena;
+
+#endif
@@ -89,7 +89,12 @@ static uint32_t clock_delay  = 0;
  * accesses. */
 #define FSI2PIB_RELAX	50
 
-/* FSI private data */
+/*
+ * FSI private data.  There is only one bit-banged master and it is only
+ * used through the ops of its fsi target, which fsi_read() and
+ * fsi_write() call with the target locked, so these need no lock of
+ * their own.
+ */
 static void *gpio_reg = NULL;
 static int mem_fd = 0;
 
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <ccan/array_size/array_size.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "hwunit.h"
 #include "operations.h"
@@ -108,22 +109,51 @@ static uint64_t ld(uint64_t rt, uint64_t ds, uint64_t ra)
 	return LD_OPCODE | (rt << 21) | (ra << 16) | (ds << 2);
 }
 
+/*
+ * Returns which SCR0 transfers an opcode needs. Only mfspr/mtspr of
+ * SCR0 itself touch it, every other opcode leaves it alone so there is
+ * no point writing it before or reading it after.
+ */
+static unsigned int ram_scratch_flags(uint64_t opcode)
+{
+	if (MXSPR_SPR(opcode) != 277)
+		return 0;
+
+	switch (opcode & OPCODE_MASK) {
+	case MFSPR_OPCODE:
+		return RAM_SCRATCH_IN;
+
+	case MTSPR_OPCODE:
+		return RAM_SCRATCH_OUT;
+
+	default:
+		return 0;
+	}
+}
+
 /*
  * RAMs the opcodes in *opcodes and store the results of each opcode
  * into *results. *results must point to an array the same size as
- * *opcodes. Each entry from *results is put into SCR0 prior to
- * executing an opcode so that it may also be used to pass in
- * data. Note that only registers r0 and r1 are saved and restored so
- * opcode sequences must preserve other registers.
+ * *opcodes. The entry from *results is put into SCR0 prior to
+ * executing an opcode which reads SCR0 so that it may also be used to
+ * pass in data, and is updated after an opcode which writes SCR0. Other
+ * entries are left untouched. Note that only registers r0 and r1 are
+ * saved and restored so opcode sequences must preserve other registers.
+ *
+ * If an opcode faults the rest are skipped and *fault is set to its
+ * index, otherwise *fault is -1.
  */
-int ram_instructions(struct thread *thread, uint64_t *opcodes,
-			    uint64_t *results, int len, unsigned int lpar)
+static int ram_instructions_fault(struct thread *thread, uint64_t *opcodes,
+				  uint64_t *results, int len, unsigned int lpar,
+				  int *fault)
 {
 	uint64_t opcode = 0, r0 = 0, r1 = 0, scratch = 0;
 	int i;
 	int exception = 0;
 	bool did_setup = false;
 
+	*fault = -1;
+
 	if (!thread->ram_is_setup) {
 		CHECK_ERR(thread->ram_setup(thread));
 		did_setup = true;
@@ -150,13 +180,15 @@ int ram_instructions(struct thread *thread, uint64_t *opcodes,
 			opcode = mfspr(1, 277);
 		}
 
-		if (thread->ram_instruction(thread, opcode, &scratch)) {
+		if (thread->ram_instruction(thread, opcode, &scratch,
+					    ram_scratch_flags(opcode))) {
 			PR_DEBUG("%s: %d, %016" PRIx64 "\n", __FUNCTION__, __LINE__, opcode);
 			exception = 1;
-			if (i >= 0 && i < len)
+			if (i >= 0 && i < len) {
 				/* skip the rest and attempt to restore r0 and r1 */
+				*fault = i;
 				i = len - 1;
-			else
+			} else
 				break;
 		}
 
@@ -174,6 +206,14 @@ int ram_instructions(struct thread *thread, uint64_t *opcodes,
 	return exception;
 }
 
+int ram_instructions(struct thread *thread, uint64_t *opcodes,
+			    uint64_t *results, int len, unsigned int lpar)
+{
+	int fault;
+
+	return ram_instructions_fault(thread, opcodes, results, len, lpar, &fault);
+}
+
 /*
  * Get gpr value. Chip must be stopped.
  */
@@ -306,6 +346,68 @@ int ram_getmem(struct thread *thread, uint64_t addr, uint64_t *value)
 	return 0;
 }
 
+/*
+ * Thread states decoded by core->thread_states() are kept until a thread
+ * is started, stopped, stepped or reset, which bumps the generation, and
+ * for no longer than THREAD_STATES_MAX_AGE_US as threads also change state
+ * by themselves.
+ */
+#define THREAD_STATES_MAX_AGE_US	10000
+
+static unsigned int thread_states_generation = 1;
+
+void thread_states_invalidate(void)
+{
+	__atomic_add_fetch(&thread_states_generation, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t thread_states_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Get the state of a thread, from one read of the registers shared by all
+ * threads of its core when the core supports it.
+ */
+struct thread_state core_thread_state(struct thread *thread)
+{
+	struct pdbg_target *target;
+	struct thread_state state;
+	struct core *core;
+	unsigned int generation;
+	uint64_t now;
+
+	target = pdbg_target_require_parent("core", &thread->target);
+	core = target_to_core(target);
+
+	if (!core->thread_states || thread->id >= CORE_MAX_THREADS)
+		return thread->state(thread);
+
+	generation = __atomic_load_n(&thread_states_generation, __ATOMIC_ACQUIRE);
+	now = thread_states_now();
+
+	pdbg_target_lock(target);
+	if (core->states_generation != generation ||
+	    now - core->states_time > THREAD_STATES_MAX_AGE_US) {
+		if (core->thread_states(core, core->states)) {
+			core->states_generation = 0;
+			pdbg_target_unlock(target);
+			return thread->state(thread);
+		}
+
+		core->states_generation = generation;
+		core->states_time = now;
+	}
+	state = core->states[thread->id];
+	pdbg_target_unlock(target);
+
+	return state;
+}
+
 /*
  * Read the given ring from the given chiplet. Result must be large enough to hold ring_len bits.
  */
@@ -318,10 +420,81 @@ int getring(struct pdbg_target *target, uint64_t ring_addr, uint64_t ring_len, u
 	return chiplet->getring(chiplet, ring_addr, ring_len, result);
 }
 
+/*
+ * A RAM program collects the opcodes for many register reads so they
+ * can be RAMed together, saving and restoring r0 and r1 once instead of
+ * once per register. Each value moved to SCR0 is copied to its
+ * destination once the program has run. If an instruction faults, for
+ * example reading an SPR the processor doesn't implement, that register
+ * is dropped and the program resumes with the next one.
+ */
+#define RAM_PROGRAM_MAX	128
+
+struct ram_program {
+	uint64_t opcodes[RAM_PROGRAM_MAX];
+	uint64_t results[RAM_PROGRAM_MAX];
+	uint64_t *dest[RAM_PROGRAM_MAX];
+	int len;
+};
+
+static int ram_program_add(struct ram_program *prog, uint64_t opcode, uint64_t *dest)
+{
+	assert(prog->len < RAM_PROGRAM_MAX);
+
+	prog->opcodes[prog->len] = opcode;
+	prog->results[prog->len] = 0;
+	prog->dest[prog->len] = dest;
+
+	return prog->len++;
+}
+
+static void ram_program_getgpr(struct ram_program *prog, int gpr, uint64_t *dest)
+{
+	ram_program_add(prog, mtspr(277, gpr), dest);
+}
+
+static void ram_program_getspr(struct ram_program *prog, int spr, uint64_t *dest)
+{
+	ram_program_add(prog, mfspr(0, spr), NULL);
+	ram_program_add(prog, mtspr(277, 0), dest);
+}
+
+static void ram_program_run(struct thread *thread, struct ram_program *prog)
+{
+	int i, start = 0, fault;
+
+	while (start < prog->len &&
+	       ram_instructions_fault(thread, &prog->opcodes[start],
+				      &prog->results[start],
+				      prog->len - start, 0, &fault)) {
+		if (fault < 0) {
+			/* Saving or restoring r0 and r1 failed, give up */
+			for (i = start; i < prog->len; i++)
+				prog->dest[i] = NULL;
+			break;
+		}
+
+		/* Each register ends with the opcode moving it to its destination */
+		for (i = start + fault; i < prog->len && !prog->dest[i]; i++)
+			;
+
+		if (i < prog->len)
+			prog->dest[i] = NULL;
+
+		start = i + 1;
+	}
+
+	for (i = 0; i < prog->len; i++)
+		if (prog->dest[i])
+			*prog->dest[i] = prog->results[i];
+}
+
 int ram_getregs(struct thread *thread, struct thread_regs *regs)
 {
 	struct thread_regs _regs;
-	uint64_t value = 0;
+	struct ram_program prog = { .len = 0 };
+	uint64_t hdsisr = 0, heir = 0, dsisr = 0;
+	uint64_t cr_fields[8] = { 0 };
 	int i;
 
 	if (!regs)
@@ -329,58 +502,66 @@ int ram_getregs(struct thread *thread, struct thread_regs *regs)
 
 	CHECK_ERR(thread->ram_setup(thread));
 
-	ram_getnia(thread, &regs->nia);
-	ram_getspr(thread, SPR_CFAR, &regs->cfar);
-	ram_getmsr(thread, &regs->msr);
-	ram_getspr(thread, SPR_LR, &regs->lr);
-	ram_getspr(thread, SPR_CTR, &regs->ctr);
-	ram_getspr(thread, 815, &regs->tar);
-	ram_getcr(thread, &regs->cr);
+	/* GPRs first, r0 and r1 still hold their saved values */
+	for (i = 0; i < 32; i++)
+		ram_program_getgpr(&prog, i, &regs->gprs[i]);
+
+	ram_program_add(&prog, mfnia(0), NULL);
+	ram_program_add(&prog, mtspr(277, 0), &regs->nia);
+	ram_program_getspr(&prog, SPR_CFAR, &regs->cfar);
+	ram_program_add(&prog, mfmsr(0), NULL);
+	ram_program_add(&prog, mtspr(277, 0), &regs->msr);
+	ram_program_getspr(&prog, SPR_LR, &regs->lr);
+	ram_program_getspr(&prog, SPR_CTR, &regs->ctr);
+	ram_program_getspr(&prog, 815, &regs->tar);
+
+	for (i = 0; i < 8; i++) {
+		ram_program_add(&prog, mfocrf(0, i), NULL);
+		ram_program_add(&prog, mtspr(277, 0), &cr_fields[i]);
+	}
 
+	ram_program_getspr(&prog, SPR_LPCR, &regs->lpcr);
+	ram_program_getspr(&prog, SPR_PTCR, &regs->ptcr);
+	ram_program_getspr(&prog, SPR_LPIDR, &regs->lpidr);
+	ram_program_getspr(&prog, SPR_PIDR, &regs->pidr);
+	ram_program_getspr(&prog, SPR_HFSCR, &regs->hfscr);
+	ram_program_getspr(&prog, SPR_HDSISR, &hdsisr);
+	ram_program_getspr(&prog, SPR_HDAR, &regs->hdar);
+	ram_program_getspr(&prog, SPR_HEIR, &heir);
+	ram_program_getspr(&prog, SPR_HID, &regs->hid);
+	ram_program_getspr(&prog, SPR_HSRR0, &regs->hsrr0);
+	ram_program_getspr(&prog, SPR_HSRR1, &regs->hsrr1);
+	ram_program_getspr(&prog, SPR_HDEC, &regs->hdec);
+	ram_program_getspr(&prog, SPR_HSPRG0, &regs->hsprg0);
+	ram_program_getspr(&prog, SPR_HSPRG1, &regs->hsprg1);
+	ram_program_getspr(&prog, SPR_FSCR, &regs->fscr);
+	ram_program_getspr(&prog, SPR_DSISR, &dsisr);
+	ram_program_getspr(&prog, SPR_DAR, &regs->dar);
+	ram_program_getspr(&prog, SPR_SRR0, &regs->srr0);
+	ram_program_getspr(&prog, SPR_SRR1, &regs->srr1);
+	ram_program_getspr(&prog, SPR_DEC, &regs->dec);
+	ram_program_getspr(&prog, SPR_TB, &regs->tb);
+	ram_program_getspr(&prog, SPR_SPRG0, &regs->sprg0);
+	ram_program_getspr(&prog, SPR_SPRG1, &regs->sprg1);
+	ram_program_getspr(&prog, SPR_SPRG2, &regs->sprg2);
+	ram_program_getspr(&prog, SPR_SPRG3, &regs->sprg3);
+	ram_program_getspr(&prog, SPR_PPR, &regs->ppr);
+
+	ram_program_run(thread, &prog);
+
+	/* XER can't be read with mfspr on all processors */
 	thread->getxer(thread, &regs->xer);
 
-	for (i = 0; i < 32; i++)
-		ram_getgpr(thread, i, &regs->gprs[i]);
-
-	ram_getspr(thread, SPR_LPCR, &regs->lpcr);
-	ram_getspr(thread, SPR_PTCR, &regs->ptcr);
-	ram_getspr(thread, SPR_LPIDR, &regs->lpidr);
-	ram_getspr(thread, SPR_PIDR, &regs->pidr);
-	ram_getspr(thread, SPR_HFSCR, &regs->hfscr);
-
-	ram_getspr(thread, SPR_HDSISR, &value);
-	regs->hdsisr = value;
-
-	ram_getspr(thread, SPR_HDAR, &regs->hdar);
-
-	ram_getspr(thread, SPR_HEIR, &value);
-	regs->heir = value;
-
-	ram_getspr(thread, SPR_HID, &regs->hid);
-	ram_getspr(thread, SPR_HSRR0, &regs->hsrr0);
-	ram_getspr(thread, SPR_HSRR1, &regs->hsrr1);
-	ram_getspr(thread, SPR_HDEC, &regs->hdec);
-	ram_getspr(thread, SPR_HSPRG0, &regs->hsprg0);
-	ram_getspr(thread, SPR_HSPRG1, &regs->hsprg1);
-	ram_getspr(thread, SPR_FSCR, &regs->fscr);
-
-	ram_getspr(thread, SPR_DSISR, &value);
-	regs->dsisr = value;
-
-	ram_getspr(thread, SPR_DAR, &regs->dar);
-	ram_getspr(thread, SPR_SRR0, &regs->srr0);
-	ram_getspr(thread, SPR_SRR1, &regs->srr1);
-	ram_getspr(thread, SPR_DEC, &regs->dec);
-	ram_getspr(thread, SPR_TB, &regs->tb);
-	ram_getspr(thread, SPR_SPRG0, &regs->sprg0);
-	ram_getspr(thread, SPR_SPRG1, &regs->sprg1);
-	ram_getspr(thread, SPR_SPRG2, &regs->sprg2);
-	ram_getspr(thread, SPR_SPRG3, &regs->sprg3);
-	ram_getspr(thread, SPR_PPR, &regs->ppr);
-
 	CHECK_ERR(thread->ram_destroy(thread));
 
-	thread_print_regs(regs);
+	regs->cr = 0;
+	for (i = 0; i < 8; i++)
+		/* We are not guaranteed that the other bits will be zeroed out */
+		regs->cr |= cr_fields[i] & (0xfULL << 4*i);
+
+	regs->hdsisr = hdsisr;
+	regs->heir = heir;
+	regs->dsisr = dsisr;
 
 	return 0;
 }
@@ -43,6 +43,9 @@ int ram_putmsr(struct thread *thread, uint64_t value);
 int ram_getcr(struct thread *thread, uint32_t *value);
 int ram_putcr(struct thread *thread, uint32_t value);
 
+struct thread_state core_thread_state(struct thread *thread);
+void thread_states_invalidate(void);
+
 struct thread_state p9_thread_state(struct thread *thread);
 struct thread_state p10_thread_state(struct thread *thread);
 
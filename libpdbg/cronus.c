@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <libcronus/libcronus.h>
 #include <libsbefifo/libsbefifo.h>
@@ -26,24 +27,32 @@
 #include "hwunit.h"
 #include "debug.h"
 
+/*
+ * All targets share one connection to the server, which carries a single
+ * request at a time.  cctx_lock protects the connection and its refcount.
+ */
 static struct cronus_context *cctx;
 static int cctx_refcount;
+static pthread_mutex_t cctx_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int croserver_connect(const char *server)
 {
 	int ret = 0;
 
+	pthread_mutex_lock(&cctx_lock);
 	if (!cctx)
 		ret = cronus_connect(server, &cctx);
 
 	if (ret == 0)
 		cctx_refcount++;
+	pthread_mutex_unlock(&cctx_lock);
 
 	return ret;
 }
 
 static void croserver_disconnect(void)
 {
+	pthread_mutex_lock(&cctx_lock);
 	if (cctx) {
 		cctx_refcount--;
 
@@ -52,6 +61,7 @@ static void croserver_disconnect(void)
 			cctx = NULL;
 		}
 	}
+	pthread_mutex_unlock(&cctx_lock);
 }
 
 
@@ -89,7 +99,9 @@ static int cronus_pib_read(struct pib *pib, uint64_t addr, uint64_t *value)
 {
 	int ret;
 
+	pthread_mutex_lock(&cctx_lock);
 	ret = cronus_getscom(cctx, pdbg_target_index(&pib->target), addr, value);
+	pthread_mutex_unlock(&cctx_lock);
 	if (ret) {
 		PR_ERROR("cronus: getscom failed, ret=%d\n", ret);
 		return -1;
@@ -102,7 +114,9 @@ static int cronus_pib_write(struct pib *pib, uint64_t addr, uint64_t value)
 {
 	int ret;
 
+	pthread_mutex_lock(&cctx_lock);
 	ret = cronus_putscom(cctx, pdbg_target_index(&pib->target), addr, value);
+	pthread_mutex_unlock(&cctx_lock);
 	if (ret) {
 		PR_ERROR("cronus: putscom failed, ret=%d\n", ret);
 		return -1;
@@ -115,7 +129,9 @@ static int cronus_fsi_read(struct fsi *fsi, uint32_t addr, uint32_t *value)
 {
 	int ret;
 
+	pthread_mutex_lock(&cctx_lock);
 	ret = cronus_getcfam(cctx, pdbg_target_index(&fsi->target), addr, value);
+	pthread_mutex_unlock(&cctx_lock);
 	if (ret) {
 		PR_ERROR("cronus: getcfam failed, ret=%d\n", ret);
 		return -1;
@@ -128,7 +144,9 @@ static int cronus_fsi_write(struct fsi *fsi, uint32_t addr, uint32_t value)
 {
 	int ret;
 
+	pthread_mutex_lock(&cctx_lock);
 	ret = cronus_putcfam(cctx, pdbg_target_index(&fsi->target), addr, value);
+	pthread_mutex_unlock(&cctx_lock);
 	if (ret) {
 		PR_ERROR("cronus: putcfam failed, ret=%d\n", ret);
 		return -1;
@@ -147,9 +165,14 @@ static int cronus_sbefifo_transport(uint8_t *msg, uint32_t msg_len,
 				    void *priv)
 {
 	struct sbefifo *sf = (struct sbefifo *)priv;
+	int ret;
 
-	return cronus_submit(cctx, pdbg_target_index(&sf->target),
-			     msg, msg_len, out, out_len);
+	pthread_mutex_lock(&cctx_lock);
+	ret = cronus_submit(cctx, pdbg_target_index(&sf->target),
+			    msg, msg_len, out, out_len);
+	pthread_mutex_unlock(&cctx_lock);
+
+	return ret;
 }
 
 static int cronus_sbefifo_probe(struct pdbg_target *target)
@@ -181,6 +204,8 @@ static int cronus_sbefifo_probe(struct pdbg_target *target)
 		return rc;
 	}
 
+	sbefifo_set_trace(sf->sf_ctx, access_sbefifo, target);
+
 	return 0;
 }
 
@@ -19,7 +19,7 @@
 
 #include "debug.h"
 
-static int pdbg_loglevel = PDBG_ERROR;
+int pdbg_loglevel = PDBG_ERROR;
 
 static void pdbg_logfunc_default(int loglevel, const char *fmt, va_list ap)
 {
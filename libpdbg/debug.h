@@ -20,15 +20,51 @@
 
 void pdbg_log(int log_level, const char* fmt, ...) __attribute__((format (printf, 2, 3)));
 
+#ifdef LIBPDBG_BUILD
+/*
+ * Only read directly by the PR_* macros, set with pdbg_set_loglevel().
+ * Hidden so it isn't part of the library's interface.
+ */
+extern int pdbg_loglevel __attribute__((visibility("hidden")));
+
+#define pdbg_loglevel_enabled(level)	((level) <= pdbg_loglevel)
+#else
+/* Outside the library pdbg_log() checks the level itself */
+#define pdbg_loglevel_enabled(level)	1
+#endif
+
+/*
+ * Builds configured with --disable-debug-log compile out PR_DEBUG
+ * messages, the arguments are still type checked.
+ */
+#ifdef DISABLE_DEBUG_LOG
+#define PDBG_LOGLEVEL_MAX PDBG_INFO
+#else
+#define PDBG_LOGLEVEL_MAX PDBG_DEBUG
+#endif
+
+/*
+ * Check the level before evaluating any of the arguments, many messages
+ * are logged on every hardware access and are almost never wanted.
+ */
+#define pdbg_log_enabled(level) \
+	__builtin_expect((level) <= PDBG_LOGLEVEL_MAX && pdbg_loglevel_enabled(level), 0)
+
+#define PR_LOG(level, x, args...) \
+	do { \
+		if (pdbg_log_enabled(level)) \
+			pdbg_log(level, x, ##args); \
+	} while (0)
+
 #define PR_ERROR(x, args...) \
-	pdbg_log(PDBG_ERROR, x, ##args)
+	PR_LOG(PDBG_ERROR, x, ##args)
 #define PR_WARNING(x, args...) \
-	pdbg_log(PDBG_WARNING, x, ##args)
+	PR_LOG(PDBG_WARNING, x, ##args)
 #define PR_NOTICE(x, args...) \
-	pdbg_log(PDBG_NOTICE, x, ##args)
+	PR_LOG(PDBG_NOTICE, x, ##args)
 #define PR_INFO(x, args...) \
-	pdbg_log(PDBG_INFO, x, ##args)
+	PR_LOG(PDBG_INFO, x, ##args)
 #define PR_DEBUG(x, args...) \
-	pdbg_log(PDBG_DEBUG, "%s[%d]: " x, __FUNCTION__, __LINE__, ##args)
+	PR_LOG(PDBG_DEBUG, "%s[%d]: " x, __FUNCTION__, __LINE__, ##args)
 
 #endif
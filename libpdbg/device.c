@@ -17,6 +17,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "target.h"
 #include <libfdt.h>
 #include <ccan/list/list.h>
@@ -27,6 +32,10 @@
 #include "debug.h"
 #include "compiler.h"
 #include "hwunit.h"
+#include "arena.h"
+#include "hash.h"
+#include "record.h"
+#include "config.h"
 
 #define prerror printf
 #define is_rodata(p) false
@@ -37,120 +46,304 @@
 /* Used to give unique handles. */
 static uint32_t last_phandle = 0;
 
+/* Bumped whenever a property is written, invalidates decoded values */
+static unsigned int property_generation = 1;
+
+/* Create targets on demand, see pdbg_set_lazy_targets() */
+static bool dt_lazy_targets;
+bool target_tree_partial;
+
+struct pdbg_property {
+	const char *name;
+	uint32_t hash;
+	int len;
+	const void *value;
+};
+
+/* Open addressed table of all the properties of a node */
+struct pdbg_property_cache {
+	unsigned int size;
+	struct pdbg_property props[];
+};
+
+struct pdbg_child_entry {
+	const char *key;
+	unsigned int len;
+	uint32_t hash;
+	struct pdbg_target *child;
+};
+
+/*
+ * Children of a node keyed by their full name, and by their name without
+ * the unit address.  Names without a unit address never contain '@' so
+ * both kinds of key can share a table.
+ */
+struct pdbg_child_index {
+	unsigned int size;
+	unsigned int count;
+	struct pdbg_child_entry *entries;
+};
+
+/* Properties the tree builder looks at, by string table offset */
+enum dt_prop_kind {
+	DT_PROP_UNKNOWN = 0,
+	DT_PROP_OTHER,
+	DT_PROP_INDEX,
+	DT_PROP_STATUS,
+	DT_PROP_PHANDLE,
+	DT_PROP_COMPATIBLE,
+	DT_PROP_SYSTEM_PATH,
+};
+
+struct dt_child {
+	struct pdbg_target *target;
+	int order;
+};
+
+/* State for expanding one fdt into the tree */
+struct dt_builder {
+	void *fdt;
+	uint8_t *prop_kind;
+	int strings_size;
+
+	/* hw unit and location of every node, in fdt order */
+	const struct hw_unit_info **hw_info;
+	size_t *node_offset;
+	int count;
+	int next;
+
+	/* Memory for all the nodes */
+	uint8_t *block;
+
+	/* Children waiting to be attached to their parent */
+	struct dt_child *children;
+	int nchildren;
+};
+
 static struct pdbg_target *pdbg_dt_root;
 
+/* Deepest node dt_expand_system_paths() can handle */
+#define DT_MAX_DEPTH	64
+
 static const char *take_name(const char *name)
 {
-	if (!is_rodata(name) && !(name = strdup(name))) {
-		prerror("Failed to allocate copy of name");
-		abort();
-	}
+	if (!is_rodata(name))
+		name = arena_strdup(&target_arena, name);
+
 	return name;
 }
 
+/* Copy in the hw unit template and add the target to its class */
+static void dt_pdbg_target_init(struct pdbg_target *target,
+				const struct hw_unit_info *hw_info)
+{
+	struct pdbg_target_class *target_class;
+
+	/* hw_info->hw_unit points to a per-target struct type. This
+	 * works because the first member in the per-target struct is
+	 * guaranteed to be the struct pdbg_target (see the comment
+	 * above DECLARE_HW_UNIT). */
+	memcpy(target, hw_info->hw_unit, hw_info->size);
+	target->hw_info = hw_info;
+	/* Intern the class name so iteration can compare class pointers */
+	target_class = get_target_class(target);
+	target->target_class = target_class;
+	target->class = target_class->name;
+	target->class_order = target_class->count++;
+	list_add_tail(&target_class->targets, &target->class_link);
+	target_tree_generation++;
+}
+
+static const struct hw_unit_info *dt_find_hw_unit(const struct fdt_property *prop)
+{
+	/*
+	 * If I understand correctly, the property we have
+	 * here can be a stringlist with a few compatible
+	 * strings
+	 */
+	return pdbg_hwunit_find_compatible(prop->data, fdt32_to_cpu(prop->len));
+}
+
 /* Adds information representing an actual target */
 static struct pdbg_target *dt_pdbg_target_new(const void *fdt, int node_offset)
 {
 	struct pdbg_target *target;
-	struct pdbg_target_class *target_class;
 	const struct hw_unit_info *hw_info = NULL;
 	const struct fdt_property *prop;
-	size_t size;
 
 	prop = fdt_get_property(fdt, node_offset, "compatible", NULL);
-	if (prop) {
-		uint32_t prop_len = fdt32_to_cpu(prop->len);
-
-		/*
-		 * If I understand correctly, the property we have
-		 * here can be a stringlist with a few compatible
-		 * strings
-		 */
-		hw_info = pdbg_hwunit_find_compatible(prop->data, prop_len);
-		if (hw_info)
-			size = hw_info->size;
-	}
+	if (prop)
+		hw_info = dt_find_hw_unit(prop);
 
 	if (!hw_info)
 		/* Couldn't find anything implementing this target */
 		return NULL;
 
-	target = calloc(1, size);
-	if (!target) {
-		prerror("Failed to allocate node\n");
-		abort();
-	}
+	target = arena_alloc(&target_arena, hw_info->size);
+	dt_pdbg_target_init(target, hw_info);
+	return target;
+}
 
-	/* hw_info->hw_unit points to a per-target struct type. This
-	 * works because the first member in the per-target struct is
-	 * guaranteed to be the struct pdbg_target (see the comment
-	 * above DECLARE_HW_UNIT). */
-	memcpy(target, hw_info->hw_unit, size);
-	target_class = get_target_class(target);
-	list_add_tail(&target_class->targets, &target->class_link);
+static void dt_init_node(struct pdbg_target *node, const char *name,
+			 void *fdt, int node_offset)
+{
+	const char *unit;
+	char *end;
 
-	return target;
+	node->fdt = fdt;
+	node->fdt_offset = fdt ? node_offset : -1;
+
+	node->dn_name = take_name(name);
+	node->parent = NULL;
+	list_head_init(&node->properties);
+	list_head_init(&node->children);
+	node->phandle = ++last_phandle;
+	target_lock_init(node);
+
+	/* Parse the unit address once for sorting siblings */
+	unit = strchr(node->dn_name, '@');
+	if (unit) {
+		unit++;
+		node->unit_offset = unit - node->dn_name;
+		node->unit_addr = strtoul(unit, &end, 16);
+		node->unit_valid = (*end == 0);
+	}
 }
 
 static struct pdbg_target *dt_new_node(const char *name, void *fdt, int node_offset)
 {
 	struct pdbg_target *node = NULL;
-	size_t size = sizeof(*node);
 
 	if (fdt)
 		node = dt_pdbg_target_new(fdt, node_offset);
 
 	if (!node)
-		node = calloc(1, size);
+		node = arena_alloc(&target_arena, sizeof(*node));
 
-	if (!node) {
-		prerror("Failed to allocate node\n");
-		abort();
+	dt_init_node(node, name, fdt, node_offset);
+	return node;
+}
+
+static int dt_cmp_subnodes(const struct pdbg_target *a, const struct pdbg_target *b)
+{
+	/* sort hex unit addresses by number */
+	if (a->unit_offset && a->unit_offset == b->unit_offset &&
+	    !strncmp(a->dn_name, b->dn_name, a->unit_offset)) {
+		/* only compare if the unit addr parsed correctly */
+		if (a->unit_valid && b->unit_valid)
+			return (a->unit_addr > b->unit_addr) - (a->unit_addr < b->unit_addr);
 	}
 
-	node->fdt = fdt;
-	node->fdt_offset = fdt ? node_offset : -1;
+	return strcmp(a->dn_name, b->dn_name);
+}
 
-	node->dn_name = take_name(name);
-	node->parent = NULL;
-	list_head_init(&node->properties);
-	list_head_init(&node->children);
-	node->phandle = ++last_phandle;
+static struct pdbg_child_entry *dt_child_entry(struct pdbg_child_index *index,
+					       const char *key, unsigned int len,
+					       uint32_t hash)
+{
+	struct pdbg_child_entry *entry;
+	unsigned int i;
 
-	return node;
+	for (i = hash & (index->size - 1); ; i = (i + 1) & (index->size - 1)) {
+		entry = &index->entries[i];
+		if (!entry->key)
+			return entry;
+
+		if (entry->hash == hash && entry->len == len &&
+		    !strncmp(entry->key, key, len))
+			return entry;
+	}
 }
 
-static const char *get_unitname(const struct pdbg_target *node)
+static void dt_child_index_insert(struct pdbg_child_index *index,
+				  const char *key, unsigned int len,
+				  struct pdbg_target *child)
 {
-	const char *c = strchr(node->dn_name, '@');
+	struct pdbg_child_entry *entry, *old;
+	unsigned int size, i;
+	uint32_t hash;
 
-	if (!c)
-		return NULL;
+	/* Keep the table at most half full */
+	if (2 * (index->count + 1) > index->size) {
+		old = index->entries;
+		size = index->size;
+
+		index->size = size ? 2 * size : 16;
+		index->entries = arena_alloc(&target_arena,
+					     index->size * sizeof(*index->entries));
+
+		for (i = 0; i < size; i++) {
+			if (!old[i].key)
+				continue;
+
+			entry = dt_child_entry(index, old[i].key, old[i].len, old[i].hash);
+			*entry = old[i];
+		}
+	}
+
+	hash = hash_fnv1a(HASH_FNV1A_INIT, key, len);
+	entry = dt_child_entry(index, key, len, hash);
+	if (entry->key) {
+		/*
+		 * Several children can share a name without unit address,
+		 * a lookup by that name finds the first one in the list.
+		 */
+		if (dt_cmp_subnodes(child, entry->child) < 0)
+			entry->child = child;
+		return;
+	}
 
-	return c + 1;
+	*entry = (struct pdbg_child_entry) {
+		.key = key,
+		.len = len,
+		.hash = hash,
+		.child = child,
+	};
+	index->count++;
 }
 
-static int dt_cmp_subnodes(const struct pdbg_target *a, const struct pdbg_target *b)
+static void dt_child_index_add(struct pdbg_child_index *index,
+			       struct pdbg_target *child)
 {
-	const char *a_unit = get_unitname(a);
-	const char *b_unit = get_unitname(b);
+	const char *at;
 
-	ptrdiff_t basenamelen = a_unit - a->dn_name;
+	at = strchr(child->dn_name, '@');
+	if (at) {
+		dt_child_index_insert(index, child->dn_name,
+				      strlen(child->dn_name), child);
+		dt_child_index_insert(index, child->dn_name,
+				      at - child->dn_name, child);
+	} else {
+		dt_child_index_insert(index, child->dn_name,
+				      strlen(child->dn_name), child);
+	}
+}
 
-	/* sort hex unit addresses by number */
-	if (a_unit && b_unit && !strncmp(a->dn_name, b->dn_name, basenamelen)) {
-		unsigned long long a_num, b_num;
-		char *a_end, *b_end;
+static struct pdbg_child_index *dt_child_index(struct pdbg_target *parent)
+{
+	struct pdbg_child_index *index;
+	struct pdbg_target *child;
 
-		a_num = strtoul(a_unit, &a_end, 16);
-		b_num = strtoul(b_unit, &b_end, 16);
+	index = __atomic_load_n(&parent->child_index, __ATOMIC_ACQUIRE);
+	if (index)
+		return index;
 
-		/* only compare if the unit addr parsed correctly */
-		if (*a_end == 0 && *b_end == 0)
-			return (a_num > b_num) - (a_num < b_num);
+	if (target_tree_partial)
+		target_expand_children(parent);
+
+	target_tree_lock();
+	index = parent->child_index;
+	if (!index) {
+		index = arena_alloc(&target_arena, sizeof(*index));
+
+		dt_for_each_child(parent, child)
+			dt_child_index_add(index, child);
+
+		__atomic_store_n(&parent->child_index, index, __ATOMIC_RELEASE);
 	}
+	target_tree_unlock();
 
-	return strcmp(a->dn_name, b->dn_name);
+	return index;
 }
 
 static bool dt_attach_node(struct pdbg_target *parent, struct pdbg_target *child)
@@ -159,10 +352,18 @@ static bool dt_attach_node(struct pdbg_target *parent, struct pdbg_target *child
 
 	assert(!child->parent);
 
+	if (target_tree_partial)
+		target_expand_children(parent);
+
+	target_tree_generation++;
+
 	if (list_empty(&parent->children)) {
 		list_add(&parent->children, &child->list);
 		child->parent = parent;
 
+		if (parent->child_index)
+			dt_child_index_add(parent->child_index, child);
+
 		return true;
 	}
 
@@ -185,9 +386,82 @@ static bool dt_attach_node(struct pdbg_target *parent, struct pdbg_target *child
 	list_add_before(&parent->children, &child->list, &node->list);
 	child->parent = parent;
 
+	if (parent->child_index)
+		dt_child_index_add(parent->child_index, child);
+
 	return true;
 }
 
+static int dt_cmp_children(const void *a, const void *b)
+{
+	const struct dt_child *ca = a, *cb = b;
+	int cmp;
+
+	cmp = dt_cmp_subnodes(ca->target, cb->target);
+	if (cmp)
+		return cmp;
+
+	/* Keep the first of any duplicates first */
+	return ca->order - cb->order;
+}
+
+/*
+ * Attach a batch of new children to a node.  Sorting them once and
+ * merging them into the existing children is much cheaper than a sorted
+ * insert of each child.
+ */
+static void dt_attach_children(struct pdbg_target *parent,
+			       struct dt_child *children, int count)
+{
+	struct pdbg_target *node, *child, *prev = NULL;
+	int cmp, i;
+
+	if (!count)
+		return;
+
+	qsort(children, count, sizeof(*children), dt_cmp_children);
+
+	node = list_top(&parent->children, struct pdbg_target, list);
+
+	for (i = 0; i < count; i++) {
+		child = children[i].target;
+		assert(!child->parent);
+
+		/* Skip the existing children which sort before this one */
+		cmp = 1;
+		while (node) {
+			cmp = dt_cmp_subnodes(node, child);
+			if (cmp >= 0)
+				break;
+
+			if (node->list.next == &parent->children.n)
+				node = NULL;
+			else
+				node = list_entry(node->list.next, struct pdbg_target, list);
+		}
+
+		/* Look for duplicates */
+		if ((node && cmp == 0) || (prev && dt_cmp_subnodes(prev, child) == 0)) {
+			prerror("DT: %s failed, duplicate %s\n",
+				__func__, child->dn_name);
+			continue;
+		}
+
+		if (node)
+			list_add_before(&parent->children, &child->list, &node->list);
+		else
+			list_add_tail(&parent->children, &child->list);
+		child->parent = parent;
+
+		if (parent->child_index)
+			dt_child_index_add(parent->child_index, child);
+
+		prev = child;
+	}
+
+	target_tree_generation++;
+}
+
 static char *dt_get_path(struct pdbg_target *node)
 {
 	unsigned int len = 0;
@@ -196,7 +470,7 @@ static char *dt_get_path(struct pdbg_target *node)
 
 	/* Dealing with NULL is for test/debug purposes */
 	if (!node)
-		return strdup("<NULL>");
+		return arena_strdup(&target_arena, "<NULL>");
 
 	for (n = node; n; n = n->parent) {
 		n = target_to_virtual(n, false);
@@ -204,8 +478,7 @@ static char *dt_get_path(struct pdbg_target *node)
 		if (n->parent || n == node)
 			len++;
 	}
-	path = calloc(1, len + 1);
-	assert(path);
+	path = arena_alloc(&target_arena, len + 1);
 	p = path + len;
 	for (n = node; n; n = n->parent) {
 		n = target_to_virtual(n, false);
@@ -252,12 +525,46 @@ static const char *__dt_path_split(const char *p,
 	return sl;
 }
 
+static struct pdbg_target *dt_find_child(struct pdbg_target *parent,
+					 const char *pn, unsigned int pnl,
+					 const char *pa, unsigned int pal)
+{
+	struct pdbg_child_entry *entry;
+	struct pdbg_child_index *index;
+	struct pdbg_target *n;
+	const char *nn, *na;
+	unsigned int nnl, nal, len;
+
+	if (target_tree_partial)
+		target_expand_children(parent);
+
+	/* Matching on the unit address alone needs to look at every child */
+	if (!pnl) {
+		list_for_each(&parent->children, n, list) {
+			__dt_path_split(n->dn_name, &nn, &nnl, &na, &nal);
+			if (pal == nal && !strncmp(pa, na, pal))
+				return n;
+		}
+		return NULL;
+	}
+
+	index = dt_child_index(parent);
+	if (!index->count)
+		return NULL;
+
+	/* name@addr is contiguous in the path */
+	len = pal ? pnl + 1 + pal : pnl;
+	entry = dt_child_entry(index, pn, len, hash_fnv1a(HASH_FNV1A_INIT, pn, len));
+
+	return entry->key ? entry->child : NULL;
+}
+
 static struct pdbg_target *dt_find_by_path(struct pdbg_target *root, const char *path)
 {
 	struct pdbg_target *n;
-	const char *pn, *pa = NULL, *p = path, *nn = NULL, *na = NULL;
-	unsigned int pnl, pal, nnl, nal;
-	bool match, vnode;
+	const char *pn, *pa = NULL, *p = path;
+	unsigned int pnl, pal;
+	bool vnode;
 
 	/* Walk path components */
 	while (*p) {
@@ -269,23 +576,10 @@ static struct pdbg_target *dt_find_by_path(struct pdbg_target *root, const char
 		vnode = false;
 
 again:
-		/* Compare with each child node */
-		match = false;
-		list_for_each(&root->children, n, list) {
-			match = true;
-			__dt_path_split(n->dn_name, &nn, &nnl, &na, &nal);
-			if (pnl && (pnl != nnl || strncmp(pn, nn, pnl)))
-				match = false;
-			if (pal && (pal != nal || strncmp(pa, na, pal)))
-				match = false;
-			if (match) {
-				root = n;
-				break;
-			}
-		}
+		n = dt_find_child(root, pn, pnl, pa, pal);
 
 		/* No child match */
-		if (!match) {
+		if (!n) {
 			if (!vnode && root->vnode) {
 				vnode = true;
 				root = root->vnode;
@@ -293,6 +587,8 @@ again:
 			}
 			return NULL;
 		}
+
+		root = n;
 	}
 	return target_to_real(root, false);
 }
@@ -313,24 +609,94 @@ static void dt_add_phandle(struct pdbg_target *node, const char *name,
 	}
 }
 
+/*
+ * Read all the properties of a node into a hash table so lookups don't
+ * have to scan the fdt and compare every property name.
+ */
+static struct pdbg_property_cache *dt_property_cache_build(struct pdbg_target *target)
+{
+	struct pdbg_property_cache *cache;
+	struct pdbg_property *prop;
+	unsigned int count = 0, size = 4, i;
+	const char *name;
+	const void *value;
+	uint32_t hash;
+	int offset, len;
+
+	fdt_for_each_property_offset(offset, target->fdt, target->fdt_offset)
+		count++;
+
+	/* Keep the table at most half full */
+	while (size < 2 * count)
+		size *= 2;
+
+	cache = arena_alloc(&target_arena,
+			    sizeof(*cache) + size * sizeof(struct pdbg_property));
+	cache->size = size;
+
+	fdt_for_each_property_offset(offset, target->fdt, target->fdt_offset) {
+		value = fdt_getprop_by_offset(target->fdt, offset, &name, &len);
+		if (!value)
+			continue;
+
+		hash = hash_fnv1a_str(HASH_FNV1A_INIT, name);
+		for (i = hash & (size - 1); cache->props[i].name; i = (i + 1) & (size - 1))
+			;
+
+		prop = &cache->props[i];
+		prop->name = name;
+		prop->hash = hash;
+		prop->len = len;
+		prop->value = value;
+	}
+
+	return cache;
+}
+
+static struct pdbg_property_cache *dt_property_cache(struct pdbg_target *target)
+{
+	struct pdbg_property_cache *cache;
+
+	cache = __atomic_load_n(&target->props, __ATOMIC_ACQUIRE);
+	if (cache)
+		return cache;
+
+	target_tree_lock();
+	cache = target->props;
+	if (!cache) {
+		cache = dt_property_cache_build(target);
+		__atomic_store_n(&target->props, cache, __ATOMIC_RELEASE);
+	}
+	target_tree_unlock();
+
+	return cache;
+}
+
 static const void *_target_property(struct pdbg_target *target, const char *name, size_t *size)
 {
-	const void *buf;
-	int buflen;
+	struct pdbg_property_cache *cache;
+	struct pdbg_property *prop;
+	uint32_t hash;
+	unsigned int i;
 
 	if (target->fdt_offset == -1) {
 		size ? *size = 0 : 0;
 		return NULL;
 	}
 
-	buf = fdt_getprop(target->fdt, target->fdt_offset, name, &buflen);
-	if (!buf) {
-		size ? *size = 0 : 0;
-		return NULL;
+	cache = dt_property_cache(target);
+	hash = hash_fnv1a_str(HASH_FNV1A_INIT, name);
+
+	for (i = hash & (cache->size - 1); cache->props[i].name; i = (i + 1) & (cache->size - 1)) {
+		prop = &cache->props[i];
+		if (prop->hash == hash && !strcmp(prop->name, name)) {
+			size ? *size = prop->len : 0;
+			return prop->value;
+		}
 	}
 
-	size ? *size = buflen : 0;
-	return buf;
+	size ? *size = 0 : 0;
+	return NULL;
 }
 
 bool pdbg_target_set_property(struct pdbg_target *target, const char *name, const void *val, size_t size)
@@ -357,6 +723,12 @@ bool pdbg_target_set_property(struct pdbg_target *target, const char *name, cons
 	if (ret)
 		return false;
 
+	/*
+	 * The value is updated in place, so the cached properties still
+	 * point at the right data.
+	 */
+	property_generation++;
+
 	return true;
 }
 
@@ -379,15 +751,21 @@ static u32 dt_property_get_cell(const void *prop, size_t len, u32 index)
 }
 
 /* First child of this node. */
-static struct pdbg_target *dt_first(const struct pdbg_target *root)
+static struct pdbg_target *dt_first(struct pdbg_target *root)
 {
+	if (target_tree_partial)
+		target_expand_children(root);
+
 	return list_top(&root->children, struct pdbg_target, list);
 }
 
 /* Return next node, or NULL. */
 static struct pdbg_target *dt_next(const struct pdbg_target *root,
-			const struct pdbg_target *prev)
+			struct pdbg_target *prev)
 {
+	if (target_tree_partial)
+		target_expand_children(prev);
+
 	/* Children? */
 	if (!list_empty(&prev->children))
 		return dt_first(prev);
@@ -504,22 +882,138 @@ static enum pdbg_target_status str_to_status(const char *status)
 		abort();
 }
 
-static int dt_expand_node(struct pdbg_target *node, void *fdt, int fdt_node)
+/*
+ * Classify a property name.  Names are looked at once per string table
+ * offset rather than compared for every property.
+ */
+static enum dt_prop_kind dt_builder_prop_kind(struct dt_builder *b,
+					      const struct fdt_property *prop)
+{
+	int nameoff = fdt32_to_cpu(prop->nameoff);
+	const char *name;
+	uint8_t kind;
+
+	if (nameoff < 0 || nameoff >= b->strings_size)
+		return DT_PROP_OTHER;
+
+	kind = b->prop_kind[nameoff];
+	if (kind != DT_PROP_UNKNOWN)
+		return kind;
+
+	name = fdt_string(b->fdt, nameoff);
+	if (!strcmp(name, "index"))
+		kind = DT_PROP_INDEX;
+	else if (!strcmp(name, "status"))
+		kind = DT_PROP_STATUS;
+	else if (!strcmp(name, "phandle") || !strcmp(name, "linux,phandle"))
+		kind = DT_PROP_PHANDLE;
+	else if (!strcmp(name, "compatible"))
+		kind = DT_PROP_COMPATIBLE;
+	else if (!strcmp(name, "system-path"))
+		kind = DT_PROP_SYSTEM_PATH;
+	else
+		kind = DT_PROP_OTHER;
+
+	b->prop_kind[nameoff] = kind;
+	return kind;
+}
+
+/*
+ * Walk the fdt once to count the nodes and find the hw unit of each, so
+ * memory for all the nodes can be allocated up front.
+ */
+/* Set up only what dt_builder_prop_kind() needs */
+static void dt_builder_init_props(struct dt_builder *b, void *fdt)
+{
+	*b = (struct dt_builder) {
+		.fdt = fdt,
+		.strings_size = fdt_size_dt_strings(fdt),
+	};
+
+	b->prop_kind = calloc(1, b->strings_size + 1);
+	assert(b->prop_kind);
+}
+
+static void dt_builder_init(struct dt_builder *b, void *fdt)
+{
+	const struct fdt_property *prop;
+	size_t size = 0, node_size;
+	int node, offset, i;
+
+	dt_builder_init_props(b, fdt);
+
+	for (node = 0; node >= 0; node = fdt_next_node(fdt, node, NULL))
+		b->count++;
+
+	b->hw_info = calloc(b->count, sizeof(*b->hw_info));
+	b->node_offset = calloc(b->count, sizeof(*b->node_offset));
+	b->children = calloc(b->count, sizeof(*b->children));
+	assert(b->hw_info && b->node_offset && b->children);
+
+	i = 0;
+	for (node = 0; node >= 0; node = fdt_next_node(fdt, node, NULL), i++) {
+		fdt_for_each_property_offset(offset, fdt, node) {
+			prop = fdt_get_property_by_offset(fdt, offset, NULL);
+			if (prop && dt_builder_prop_kind(b, prop) == DT_PROP_COMPATIBLE) {
+				b->hw_info[i] = dt_find_hw_unit(prop);
+				break;
+			}
+		}
+
+		/* The root node already exists */
+		if (i == 0)
+			continue;
+
+		node_size = b->hw_info[i] ? b->hw_info[i]->size : sizeof(struct pdbg_target);
+		b->node_offset[i] = size;
+		size += (node_size + 15) & ~(size_t)15;
+	}
+
+	b->block = arena_alloc(&target_arena, size);
+}
+
+static void dt_builder_fini(struct dt_builder *b)
+{
+	free(b->prop_kind);
+	free(b->hw_info);
+	free(b->node_offset);
+	free(b->children);
+}
+
+static struct pdbg_target *dt_builder_new_node(struct dt_builder *b,
+					       const char *name, int offset)
+{
+	struct pdbg_target *node;
+	int i = ++b->next;
+
+	assert(i < b->count);
+
+	node = (struct pdbg_target *)(b->block + b->node_offset[i]);
+	if (b->hw_info[i])
+		dt_pdbg_target_init(node, b->hw_info[i]);
+
+	dt_init_node(node, name, b->fdt, offset);
+	return node;
+}
+
+static int dt_expand_node(struct dt_builder *b, struct pdbg_target *node, int fdt_node)
 {
 	const struct fdt_property *prop;
-	int offset, nextoffset, err;
+	int offset, nextoffset, first_child;
 	struct pdbg_target *child;
+	void *fdt = b->fdt;
 	const char *name;
 	uint32_t tag;
 	uint32_t data;
 
-	if (((err = fdt_check_header(fdt)) != 0)
-	    || (fdt_node < 0) || (fdt_node % FDT_TAGSIZE)
+	if ((fdt_node < 0) || (fdt_node % FDT_TAGSIZE)
 	    || (fdt_next_tag(fdt, fdt_node, &fdt_node) != FDT_BEGIN_NODE)) {
-		prerror("FDT: Error %d parsing node 0x%x\n", err, fdt_node);
+		prerror("FDT: Error parsing node 0x%x\n", fdt_node);
 		return -1;
 	}
 
+	first_child = b->nchildren;
+
 	nextoffset = fdt_node;
 	do {
 		offset = nextoffset;
@@ -528,79 +1022,371 @@ static int dt_expand_node(struct pdbg_target *node, void *fdt, int fdt_node)
 		switch (tag) {
 		case FDT_PROP:
 			prop = fdt_offset_ptr(fdt, offset, 0);
-			name = fdt_string(fdt, fdt32_to_cpu(prop->nameoff));
-			if (strcmp("index", name) == 0) {
+			switch (dt_builder_prop_kind(b, prop)) {
+			case DT_PROP_INDEX:
+				if (fdt32_to_cpu(prop->len) < sizeof(data))
+					break;
+
 				memcpy(&data, prop->data, sizeof(data));
 				node->index = fdt32_to_cpu(data);
-			}
+				break;
 
-			if (strcmp("status", name) == 0)
+			case DT_PROP_STATUS:
 				node->status = str_to_status(prop->data);
+				break;
+
+			case DT_PROP_PHANDLE:
+				name = fdt_string(fdt, fdt32_to_cpu(prop->nameoff));
+				dt_add_phandle(node, name, prop->data,
+					       fdt32_to_cpu(prop->len));
+				break;
 
-			dt_add_phandle(node, name, prop->data,
-					fdt32_to_cpu(prop->len));
+			default:
+				break;
+			}
 			break;
 		case FDT_BEGIN_NODE:
 			name = fdt_get_name(fdt, offset, NULL);
-			child = dt_new_node(name, fdt, offset);
-			assert(child);
-			nextoffset = dt_expand_node(child, fdt, offset);
-
-			/*
-			 * This may fail in case of duplicate, keep it
-			 * going for now, we may ultimately want to
-			 * assert
-			 */
-			(void)dt_attach_node(node, child);
+			child = dt_builder_new_node(b, name, offset);
+			nextoffset = dt_expand_node(b, child, offset);
+
+			b->children[b->nchildren] = (struct dt_child) {
+				.target = child,
+				.order = b->nchildren,
+			};
+			b->nchildren++;
 			break;
 		case FDT_END:
 			return -1;
 		}
 	} while (tag != FDT_END_NODE);
 
+	/*
+	 * This may fail in case of duplicate, keep it going for now, we
+	 * may ultimately want to assert
+	 */
+	dt_attach_children(node, &b->children[first_child],
+			   b->nchildren - first_child);
+	b->nchildren = first_child;
+
 	return nextoffset;
 }
 
 static void dt_expand(struct pdbg_target *root, void *fdt)
 {
+	struct dt_builder b;
+	int err;
+
 	PR_DEBUG("FDT: Parsing fdt @%p\n", fdt);
 
-	if (dt_expand_node(root, fdt, 0) < 0)
+	err = fdt_check_header(fdt);
+	if (err) {
+		prerror("FDT: Error %d parsing fdt\n", err);
 		abort();
-}
+	}
 
-static u64 dt_get_number(const void *pdata, unsigned int cells)
-{
-	const u32 *p = pdata;
-	u64 ret = 0;
+	dt_builder_init(&b, fdt);
 
-	while(cells--)
-		ret = (ret << 32) | be32toh(*(p++));
-	return ret;
-}
+	if (dt_expand_node(&b, root, 0) < 0)
+		abort();
 
-static u32 dt_n_address_cells(const struct pdbg_target *node)
-{
-	if (!node->parent)
-		return 0;
-	return dt_prop_get_u32_def(node->parent, "#address-cells", 2);
+	dt_builder_fini(&b);
 }
 
-static u32 dt_n_size_cells(const struct pdbg_target *node)
+/* Set up a node from its properties, as dt_expand_node() does */
+static void dt_read_props(struct dt_builder *b, struct pdbg_target *node,
+			  int fdt_node)
 {
-	if (!node->parent)
-		return 0;
-	return dt_prop_get_u32_def(node->parent, "#size-cells", 1);
-}
-
-uint64_t pdbg_target_address(struct pdbg_target *target, uint64_t *out_size)
+	const struct fdt_property *prop;
+	void *fdt = b->fdt;
+	const char *name;
+	uint32_t data;
+	int offset, len;
+
+	fdt_for_each_property_offset(offset, fdt, fdt_node) {
+		prop = fdt_get_property_by_offset(fdt, offset, &len);
+		if (!prop)
+			continue;
+
+		switch (dt_builder_prop_kind(b, prop)) {
+		case DT_PROP_INDEX:
+			if (len < (int)sizeof(data))
+				break;
+
+			memcpy(&data, prop->data, sizeof(data));
+			node->index = fdt32_to_cpu(data);
+			break;
+
+		case DT_PROP_STATUS:
+			node->status = str_to_status(prop->data);
+			break;
+
+		case DT_PROP_PHANDLE:
+			name = fdt_string(fdt, fdt32_to_cpu(prop->nameoff));
+			dt_add_phandle(node, name, prop->data, len);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/* Create the children of a node, but not their children */
+static void dt_expand_level(struct pdbg_target *node, void *fdt, int fdt_node)
+{
+	struct pdbg_target *child;
+	struct dt_child *children;
+	struct dt_builder b;
+	int offset, count = 0, i = 0;
+
+	fdt_for_each_subnode(offset, fdt, fdt_node)
+		count++;
+
+	if (!count)
+		return;
+
+	children = calloc(count, sizeof(*children));
+	assert(children);
+
+	dt_builder_init_props(&b, fdt);
+
+	fdt_for_each_subnode(offset, fdt, fdt_node) {
+		child = dt_new_node(fdt_get_name(fdt, offset, NULL), fdt, offset);
+		dt_read_props(&b, child, offset);
+
+		children[i] = (struct dt_child) {
+			.target = child,
+			.order = i,
+		};
+		i++;
+	}
+
+	dt_builder_fini(&b);
+	dt_attach_children(node, children, count);
+	free(children);
+}
+
+void target_expand_children(struct pdbg_target *target)
+{
+	target_tree_lock();
+	if (!target->expanded) {
+		target->expanded = true;
+		if (target->fdt)
+			dt_expand_level(target, target->fdt, target->fdt_offset);
+	}
+	target_tree_unlock();
+}
+
+static void dt_expand_subtree(struct pdbg_target *node)
+{
+	struct pdbg_target *child;
+
+	target_expand_children(node);
+
+	dt_for_each_child(node, child)
+		dt_expand_subtree(child);
+}
+
+/*
+ * Where the whole tree is created up front, targets are added to their
+ * class in fdt order, the backend fdt first.  Sort the class lists the
+ * same way so iteration order does not depend on which targets were
+ * used first.
+ */
+static int dt_cmp_class_order(const void *a, const void *b)
+{
+	const struct pdbg_target *ta = *(const struct pdbg_target **)a;
+	const struct pdbg_target *tb = *(const struct pdbg_target **)b;
+	int ra, rb;
+
+	ra = ta == pdbg_dt_root ? 0 : (ta->fdt == pdbg_dt_root->fdt ? 2 : 1);
+	rb = tb == pdbg_dt_root ? 0 : (tb->fdt == pdbg_dt_root->fdt ? 2 : 1);
+	if (ra != rb)
+		return ra - rb;
+
+	return ta->fdt_offset - tb->fdt_offset;
+}
+
+static void dt_sort_classes(void)
+{
+	struct pdbg_target_class *target_class;
+	struct pdbg_target **targets, *target;
+	unsigned int count, i;
+
+	list_for_each(&target_classes, target_class, class_head_link) {
+		count = 0;
+		list_for_each(&target_class->targets, target, class_link)
+			count++;
+
+		if (!count)
+			continue;
+
+		targets = malloc(count * sizeof(*targets));
+		assert(targets);
+
+		i = 0;
+		list_for_each(&target_class->targets, target, class_link)
+			targets[i++] = target;
+
+		qsort(targets, count, sizeof(*targets), dt_cmp_class_order);
+
+		list_head_init(&target_class->targets);
+		for (i = 0; i < count; i++) {
+			targets[i]->class_order = i;
+			list_add_tail(&target_class->targets, &targets[i]->class_link);
+		}
+
+		free(targets);
+	}
+
+	target_tree_generation++;
+}
+
+void target_tree_expand(void)
+{
+	target_tree_lock();
+	if (target_tree_partial) {
+		dt_expand_subtree(pdbg_dt_root);
+		dt_sort_classes();
+
+		target_tree_partial = false;
+	}
+	target_tree_unlock();
+}
+
+/* Create the node at the end of a path of fdt offsets */
+static void dt_expand_path(struct pdbg_target *root, void *fdt,
+			   int *path, int depth)
+{
+	struct pdbg_target *target = root, *child;
+	int i;
+
+	for (i = 1; target && i <= depth; i++) {
+		target_expand_children(target);
+
+		dt_for_each_child(target, child) {
+			if (child->fdt == fdt && child->fdt_offset == path[i])
+				break;
+		}
+
+		/* Not found, eg. dropped as a duplicate */
+		if (&child->list == &target->children.n)
+			target = NULL;
+		else
+			target = child;
+	}
+}
+
+/*
+ * Create the nodes of an fdt which have a system-path, so linking the
+ * system tree sees the same nodes as when the whole tree is created.
+ */
+static void dt_expand_system_paths(struct pdbg_target *root, void *fdt)
+{
+	const struct fdt_property *prop;
+	struct dt_builder b;
+	int path[DT_MAX_DEPTH];
+	int offset, nextoffset = 0, depth = -1;
+	uint32_t tag;
+
+	dt_builder_init_props(&b, fdt);
+
+	do {
+		offset = nextoffset;
+
+		tag = fdt_next_tag(fdt, offset, &nextoffset);
+		switch (tag) {
+		case FDT_BEGIN_NODE:
+			depth++;
+			assert(depth < DT_MAX_DEPTH);
+			path[depth] = offset;
+			break;
+		case FDT_END_NODE:
+			depth--;
+			break;
+		case FDT_PROP:
+			prop = fdt_offset_ptr(fdt, offset, 0);
+			if (depth > 0 &&
+			    dt_builder_prop_kind(&b, prop) == DT_PROP_SYSTEM_PATH)
+				dt_expand_path(root, fdt, path, depth);
+			break;
+		}
+	} while (tag != FDT_END && depth >= 0);
+
+	dt_builder_fini(&b);
+}
+
+/* Read the root properties and create the top level nodes of one fdt */
+static void dt_init_lazy_fdt(struct pdbg_target *root, void *fdt)
+{
+	struct dt_builder b;
+
+	dt_builder_init_props(&b, fdt);
+	dt_read_props(&b, root, 0);
+	dt_builder_fini(&b);
+
+	dt_expand_level(root, fdt, 0);
+}
+
+static void dt_init_lazy(struct pdbg_target *root, struct pdbg_dtb *dtb)
+{
+	target_tree_partial = true;
+
+	if (dtb->backend.fdt)
+		dt_init_lazy_fdt(root, dtb->backend.fdt);
+
+	dt_init_lazy_fdt(root, dtb->system.fdt);
+	root->expanded = true;
+
+	if (dtb->backend.fdt)
+		dt_expand_system_paths(root, dtb->backend.fdt);
+
+	dt_expand_system_paths(root, dtb->system.fdt);
+}
+
+static u64 dt_get_number(const void *pdata, unsigned int cells)
+{
+	const u32 *p = pdata;
+	u64 ret = 0;
+
+	while(cells--)
+		ret = (ret << 32) | be32toh(*(p++));
+	return ret;
+}
+
+static u32 dt_n_address_cells(const struct pdbg_target *node)
+{
+	if (!node->parent)
+		return 0;
+	return dt_prop_get_u32_def(node->parent, "#address-cells", 2);
+}
+
+static u32 dt_n_size_cells(const struct pdbg_target *node)
+{
+	if (!node->parent)
+		return 0;
+	return dt_prop_get_u32_def(node->parent, "#size-cells", 1);
+}
+
+uint64_t pdbg_target_address(struct pdbg_target *target, uint64_t *out_size)
 {
 	const void *p;
 	size_t len;
+	u32 na, ns, n;
+
+	/* reg is decoded once, until a property is written */
+	if (__atomic_load_n(&target->address_generation, __ATOMIC_ACQUIRE) == property_generation)
+		goto out;
+
+	target_tree_lock();
+	if (target->address_generation == property_generation) {
+		target_tree_unlock();
+		goto out;
+	}
 
-	u32 na = dt_n_address_cells(target);
-	u32 ns = dt_n_size_cells(target);
-	u32 n;
+	na = dt_n_address_cells(target);
+	ns = dt_n_size_cells(target);
 
 	p = dt_require_property(target, "reg", -1, &len);
 	n = (na + ns) * sizeof(u32);
@@ -608,9 +1394,16 @@ uint64_t pdbg_target_address(struct pdbg_target *target, uint64_t *out_size)
 		PR_ERROR("Invalid reg value for %s\n", pdbg_target_path(target));
 		abort();
 	}
+
+	target->address = dt_get_number(p, na);
+	target->address_size = dt_get_number(p + na * sizeof(u32), ns);
+	__atomic_store_n(&target->address_generation, property_generation, __ATOMIC_RELEASE);
+	target_tree_unlock();
+
+out:
 	if (out_size)
-		*out_size = dt_get_number(p + na * sizeof(u32), ns);
-	return dt_get_number(p, na);
+		*out_size = target->address_size;
+	return target->address;
 }
 
 static struct pdbg_target *dt_new_virtual(struct pdbg_target *root, const char *system_path)
@@ -642,10 +1435,8 @@ static struct pdbg_target *dt_new_virtual(struct pdbg_target *root, const char *
 
 	free(parent_path);
 
-	if (!dt_attach_node(parent, vnode)) {
-		free(vnode);
+	if (!dt_attach_node(parent, vnode))
 		return NULL;
-	}
 
 	PR_DEBUG("Created virtual node %s\n", system_path);
 	return vnode;
@@ -655,6 +1446,7 @@ static void dt_link_virtual(struct pdbg_target *node, struct pdbg_target *vnode)
 {
 	node->vnode = vnode;
 	vnode->vnode = node;
+	target_tree_generation++;
 }
 
 static void pdbg_targets_init_virtual(struct pdbg_target *node, struct pdbg_target *root)
@@ -701,15 +1493,571 @@ skip:
 	}
 }
 
+/*
+ * Target tree snapshots
+ *
+ * The tree built by pdbg_targets_init() only depends on the device trees
+ * and on this build of the library, so it can be saved to a file and
+ * mapped back on the next run instead of being built again.  Nodes are
+ * stored in pre-order, so a parent always comes before its children and
+ * the children of a node are stored in their sorted order.  Property
+ * caches and indexes are not saved, they are rebuilt on first use.
+ */
+#define SNAPSHOT_MAGIC		0x53424450	/* "PDBS" */
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_NONE		UINT32_MAX
+
+enum dt_snapshot_fdt {
+	SNAPSHOT_FDT_NONE,
+	SNAPSHOT_FDT_BACKEND,
+	SNAPSHOT_FDT_SYSTEM,
+};
+
+struct dt_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t count;
+	uint32_t strings_size;
+	uint32_t last_phandle;
+	uint32_t reserved;
+};
+
+struct dt_snapshot_node {
+	uint32_t parent;
+	uint32_t vnode;
+	uint32_t name;
+	uint32_t fdt;
+	int32_t fdt_offset;
+	int32_t index;
+	uint32_t status;
+	uint32_t phandle;
+	uint32_t backend;
+	uint32_t hw_unit;
+	uint32_t class_rank;
+	uint32_t class_order;
+};
+
+struct dt_snapshot_map {
+	struct pdbg_target *target;
+	uint32_t id;
+};
+
+struct dt_snapshot_writer {
+	struct pdbg_target **nodes;
+	uint32_t count;
+	uint32_t alloc;
+	struct dt_snapshot_map *map;
+};
+
+static void dt_snapshot_hash_hwunit(enum pdbg_backend backend,
+				    const struct hw_unit_info *hw_unit,
+				    void *priv)
+{
+	struct pdbg_target *target = hw_unit->hw_unit;
+	uint64_t *hash = (uint64_t *)priv;
+
+	*hash = hash_fnv1a(*hash, &backend, sizeof(backend));
+	*hash = hash_fnv1a(*hash, &hw_unit->size, sizeof(hw_unit->size));
+	*hash = hash_fnv1a(*hash, target->compatible,
+			   strlen(target->compatible) + 1);
+}
+
+/*
+ * A snapshot is only valid for the device trees it was built from, for
+ * the selected backend and for the hw units registered by this library.
+ */
+static uint64_t dt_snapshot_key(struct pdbg_dtb *dtb)
+{
+	uint64_t hash = HASH_FNV1A_INIT;
+	uint32_t header[3] = {
+		SNAPSHOT_VERSION,
+		pdbg_get_backend(),
+		sizeof(struct pdbg_target),
+	};
+
+	hash = hash_fnv1a(hash, header, sizeof(header));
+	hash = hash_fnv1a(hash, PACKAGE_VERSION, strlen(PACKAGE_VERSION));
+	pdbg_hwunit_for_each(dt_snapshot_hash_hwunit, &hash);
+
+	if (dtb->backend.fdt)
+		hash = hash_fdt_words(hash, dtb->backend.fdt,
+				      fdt_totalsize(dtb->backend.fdt));
+
+	hash = hash_fnv1a(hash, "system", 6);
+	hash = hash_fdt_words(hash, dtb->system.fdt,
+			      fdt_totalsize(dtb->system.fdt));
+
+	return hash;
+}
+
+static void dt_snapshot_add(struct dt_snapshot_writer *w, struct pdbg_target *node)
+{
+	struct pdbg_target *child;
+
+	if (w->count == w->alloc) {
+		w->alloc = w->alloc ? w->alloc * 2 : 1024;
+		w->nodes = realloc(w->nodes, w->alloc * sizeof(*w->nodes));
+		assert(w->nodes);
+	}
+
+	w->nodes[w->count++] = node;
+
+	dt_for_each_child(node, child)
+		dt_snapshot_add(w, child);
+}
+
+static int dt_snapshot_cmp_map(const void *a, const void *b)
+{
+	const struct dt_snapshot_map *ma = a, *mb = b;
+
+	if (ma->target == mb->target)
+		return 0;
+
+	return (uintptr_t)ma->target < (uintptr_t)mb->target ? -1 : 1;
+}
+
+static void dt_snapshot_build_map(struct dt_snapshot_writer *w)
+{
+	uint32_t i;
+
+	free(w->map);
+	w->map = malloc(w->count * sizeof(*w->map));
+	assert(w->map);
+
+	for (i = 0; i < w->count; i++)
+		w->map[i] = (struct dt_snapshot_map) { w->nodes[i], i };
+
+	qsort(w->map, w->count, sizeof(*w->map), dt_snapshot_cmp_map);
+}
+
+static uint32_t dt_snapshot_id(struct dt_snapshot_writer *w, struct pdbg_target *target)
+{
+	struct dt_snapshot_map key = { .target = target }, *m;
+
+	if (!target)
+		return SNAPSHOT_NONE;
+
+	m = bsearch(&key, w->map, w->count, sizeof(*w->map), dt_snapshot_cmp_map);
+	return m ? m->id : SNAPSHOT_NONE;
+}
+
+/*
+ * Targets which were created but rejected as duplicates are not in the
+ * tree, but they are still in their class list.  Save them as detached
+ * nodes so the class lists come back the same.
+ */
+static void dt_snapshot_add_detached(struct dt_snapshot_writer *w)
+{
+	struct pdbg_target_class *target_class;
+	struct pdbg_target *target;
+
+	list_for_each(&target_classes, target_class, class_head_link) {
+		list_for_each(&target_class->targets, target, class_link) {
+			if (dt_snapshot_id(w, target) != SNAPSHOT_NONE)
+				continue;
+
+			while (target->parent)
+				target = target->parent;
+
+			dt_snapshot_add(w, target);
+			dt_snapshot_build_map(w);
+		}
+	}
+}
+
+static uint32_t dt_snapshot_fdt_id(struct pdbg_dtb *dtb, struct pdbg_target *node)
+{
+	if (!node->fdt)
+		return SNAPSHOT_FDT_NONE;
+	else if (node->fdt == dtb->system.fdt)
+		return SNAPSHOT_FDT_SYSTEM;
+	else if (node->fdt == dtb->backend.fdt)
+		return SNAPSHOT_FDT_BACKEND;
+
+	return SNAPSHOT_NONE;
+}
+
+static void *dt_snapshot_create(struct dt_snapshot_writer *w,
+				struct pdbg_dtb *dtb, uint64_t key, size_t *size)
+{
+	struct dt_snapshot_header *header;
+	struct dt_snapshot_node *rec;
+	struct pdbg_target_class *target_class;
+	struct pdbg_target *target;
+	enum pdbg_backend backend;
+	unsigned int hw_unit;
+	uint32_t i, id, rank, order, strings_size = 0;
+	char *strings;
+	void *buf;
+
+	for (i = 0; i < w->count; i++)
+		strings_size += strlen(w->nodes[i]->dn_name) + 1;
+
+	*size = sizeof(*header) + w->count * sizeof(*rec) + strings_size;
+	buf = calloc(1, *size);
+	if (!buf)
+		return NULL;
+
+	header = buf;
+	rec = (struct dt_snapshot_node *)(header + 1);
+	strings = (char *)(rec + w->count);
+
+	*header = (struct dt_snapshot_header) {
+		.magic = SNAPSHOT_MAGIC,
+		.version = SNAPSHOT_VERSION,
+		.key = key,
+		.count = w->count,
+		.strings_size = strings_size,
+		.last_phandle = last_phandle,
+	};
+
+	strings_size = 0;
+	for (i = 0; i < w->count; i++) {
+		target = w->nodes[i];
+
+		rec[i] = (struct dt_snapshot_node) {
+			.parent = dt_snapshot_id(w, target->parent),
+			.vnode = dt_snapshot_id(w, target->vnode),
+			.name = strings_size,
+			.fdt = dt_snapshot_fdt_id(dtb, target),
+			.fdt_offset = target->fdt_offset,
+			.index = target->index,
+			.status = target->status,
+			.phandle = target->phandle,
+			.backend = SNAPSHOT_NONE,
+			.hw_unit = SNAPSHOT_NONE,
+			.class_rank = SNAPSHOT_NONE,
+			.class_order = SNAPSHOT_NONE,
+		};
+
+		if (rec[i].fdt == SNAPSHOT_NONE)
+			goto fail;
+
+		if (target->hw_info) {
+			if (!pdbg_hwunit_id(target->hw_info, &backend, &hw_unit))
+				goto fail;
+
+			rec[i].backend = backend;
+			rec[i].hw_unit = hw_unit;
+		}
+
+		strcpy(&strings[strings_size], target->dn_name);
+		strings_size += strlen(target->dn_name) + 1;
+	}
+
+	rank = 0;
+	list_for_each(&target_classes, target_class, class_head_link) {
+		order = 0;
+		list_for_each(&target_class->targets, target, class_link) {
+			id = dt_snapshot_id(w, target);
+			assert(id != SNAPSHOT_NONE);
+
+			rec[id].class_rank = rank;
+			rec[id].class_order = order++;
+		}
+		rank++;
+	}
+
+	/* Every target created from a hw unit must be in its class */
+	for (i = 0; i < w->count; i++) {
+		if ((rec[i].hw_unit == SNAPSHOT_NONE) != (rec[i].class_rank == SNAPSHOT_NONE))
+			goto fail;
+	}
+
+	return buf;
+
+fail:
+	free(buf);
+	return NULL;
+}
+
+static bool dt_snapshot_write(const char *file, const void *buf, size_t size)
+{
+	char *tmp;
+	ssize_t n;
+	size_t done = 0;
+	int fd;
+
+	tmp = malloc(strlen(file) + 8);
+	if (!tmp)
+		return false;
+
+	sprintf(tmp, "%s.XXXXXX", file);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return false;
+	}
+
+	while (done < size) {
+		n = write(fd, (const char *)buf + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += n;
+	}
+
+	if (fchmod(fd, 0644) || close(fd) || done < size ||
+	    rename(tmp, file)) {
+		unlink(tmp);
+		free(tmp);
+		return false;
+	}
+
+	free(tmp);
+	return true;
+}
+
+/* Save the tree, it must be complete */
+static void dt_snapshot_save(const char *file, struct pdbg_target *root,
+			     struct pdbg_dtb *dtb, uint64_t key)
+{
+	struct dt_snapshot_writer w = { 0 };
+	size_t size;
+	void *buf;
+
+	assert(!target_tree_partial);
+
+	dt_snapshot_add(&w, root);
+	dt_snapshot_build_map(&w);
+	dt_snapshot_add_detached(&w);
+
+	buf = dt_snapshot_create(&w, dtb, key, &size);
+	if (!buf) {
+		PR_WARNING("Could not create target snapshot\n");
+	} else if (!dt_snapshot_write(file, buf, size)) {
+		PR_WARNING("Could not write target snapshot %s: %s\n",
+			   file, strerror(errno));
+	} else {
+		PR_DEBUG("Wrote target snapshot %s, %u targets\n", file, w.count);
+	}
+
+	free(buf);
+	free(w.map);
+	free(w.nodes);
+}
+
+/* Nodes are only restored at offsets where their fdt has a node */
+static bool dt_snapshot_check_offset(void *fdt, int32_t offset)
+{
+	int next;
+
+	if (offset < 0 || offset % FDT_TAGSIZE ||
+	    (uint32_t)offset >= fdt_totalsize(fdt))
+		return false;
+
+	return fdt_next_tag(fdt, offset, &next) == FDT_BEGIN_NODE;
+}
+
+static bool dt_snapshot_check(const struct dt_snapshot_header *header,
+			      size_t size, struct pdbg_dtb *dtb, uint64_t key)
+{
+	const struct dt_snapshot_node *rec = (const void *)(header + 1);
+	const char *strings;
+	uint32_t i;
+
+	if (size < sizeof(*header) ||
+	    header->magic != SNAPSHOT_MAGIC ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->key != key)
+		return false;
+
+	if (header->count == 0 || header->strings_size == 0 ||
+	    header->count > (size - sizeof(*header)) / sizeof(*rec) ||
+	    size - sizeof(*header) - header->count * sizeof(*rec) != header->strings_size)
+		return false;
+
+	strings = (const char *)(rec + header->count);
+	if (strings[header->strings_size - 1] != '\0')
+		return false;
+
+	for (i = 0; i < header->count; i++) {
+		/* Pre-order, parents come first and the root has none */
+		if (rec[i].parent != SNAPSHOT_NONE && rec[i].parent >= i)
+			return false;
+		if (i == 0 && rec[i].parent != SNAPSHOT_NONE)
+			return false;
+		if (rec[i].vnode != SNAPSHOT_NONE && rec[i].vnode >= header->count)
+			return false;
+		if (rec[i].name >= header->strings_size)
+			return false;
+		if (rec[i].fdt > SNAPSHOT_FDT_SYSTEM ||
+		    (rec[i].fdt == SNAPSHOT_FDT_BACKEND && !dtb->backend.fdt))
+			return false;
+		if (rec[i].fdt != SNAPSHOT_FDT_NONE &&
+		    !dt_snapshot_check_offset(rec[i].fdt == SNAPSHOT_FDT_SYSTEM ?
+					      dtb->system.fdt : dtb->backend.fdt,
+					      rec[i].fdt_offset))
+			return false;
+		if (rec[i].status > PDBG_TARGET_RELEASED)
+			return false;
+		if (rec[i].hw_unit != SNAPSHOT_NONE &&
+		    !pdbg_hwunit_get(rec[i].backend, rec[i].hw_unit))
+			return false;
+		if ((rec[i].hw_unit == SNAPSHOT_NONE) != (rec[i].class_rank == SNAPSHOT_NONE))
+			return false;
+	}
+
+	return true;
+}
+
+struct dt_snapshot_class {
+	uint32_t rank;
+	uint32_t order;
+	uint32_t id;
+};
+
+static int dt_snapshot_cmp_class(const void *a, const void *b)
+{
+	const struct dt_snapshot_class *ca = a, *cb = b;
+
+	if (ca->rank != cb->rank)
+		return ca->rank < cb->rank ? -1 : 1;
+
+	return ca->order < cb->order ? -1 : ca->order > cb->order;
+}
+
+static struct pdbg_target *dt_snapshot_restore(const struct dt_snapshot_header *header,
+					       struct pdbg_dtb *dtb)
+{
+	const struct dt_snapshot_node *rec = (const void *)(header + 1);
+	const char *strings = (const char *)(rec + header->count);
+	struct dt_snapshot_class *classes;
+	struct pdbg_target **nodes, *node;
+	const struct hw_unit_info *hw_info;
+	uint32_t i, nclasses = 0;
+	void *fdt;
+
+	nodes = malloc(header->count * sizeof(*nodes));
+	classes = malloc(header->count * sizeof(*classes));
+	assert(nodes && classes);
+
+	for (i = 0; i < header->count; i++) {
+		hw_info = NULL;
+		if (rec[i].hw_unit != SNAPSHOT_NONE) {
+			hw_info = pdbg_hwunit_get(rec[i].backend, rec[i].hw_unit);
+			classes[nclasses++] = (struct dt_snapshot_class) {
+				.rank = rec[i].class_rank,
+				.order = rec[i].class_order,
+				.id = i,
+			};
+		}
+
+		nodes[i] = arena_alloc(&target_arena,
+				       hw_info ? hw_info->size : sizeof(struct pdbg_target));
+	}
+
+	/*
+	 * Adding targets to their classes in the saved order creates the
+	 * classes and the class lists in the same order as before.
+	 */
+	qsort(classes, nclasses, sizeof(*classes), dt_snapshot_cmp_class);
+	for (i = 0; i < nclasses; i++) {
+		hw_info = pdbg_hwunit_get(rec[classes[i].id].backend,
+					  rec[classes[i].id].hw_unit);
+		dt_pdbg_target_init(nodes[classes[i].id], hw_info);
+	}
+
+	for (i = 0; i < header->count; i++) {
+		node = nodes[i];
+
+		if (rec[i].fdt == SNAPSHOT_FDT_SYSTEM)
+			fdt = dtb->system.fdt;
+		else if (rec[i].fdt == SNAPSHOT_FDT_BACKEND)
+			fdt = dtb->backend.fdt;
+		else
+			fdt = NULL;
+
+		dt_init_node(node, &strings[rec[i].name], fdt, rec[i].fdt_offset);
+		node->phandle = rec[i].phandle;
+		node->index = rec[i].index;
+		node->status = rec[i].status;
+
+		if (rec[i].vnode != SNAPSHOT_NONE)
+			node->vnode = nodes[rec[i].vnode];
+
+		if (rec[i].parent != SNAPSHOT_NONE) {
+			node->parent = nodes[rec[i].parent];
+			list_add_tail(&node->parent->children, &node->list);
+		}
+	}
+
+	last_phandle = header->last_phandle;
+	target_tree_generation++;
+
+	node = nodes[0];
+	free(classes);
+	free(nodes);
+
+	return node;
+}
+
+static struct pdbg_target *dt_snapshot_load(const char *file,
+					    struct pdbg_dtb *dtb, uint64_t key)
+{
+	struct pdbg_target *root = NULL;
+	struct stat statbuf;
+	void *buf;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &statbuf) || statbuf.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	buf = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+	if (dt_snapshot_check(buf, statbuf.st_size, dtb, key)) {
+		root = dt_snapshot_restore(buf, dtb);
+		PR_DEBUG("Loaded target snapshot %s\n", file);
+	} else {
+		PR_INFO("Target snapshot %s is out of date\n", file);
+	}
+
+	munmap(buf, statbuf.st_size);
+	return root;
+}
+
+void pdbg_set_lazy_targets(bool lazy)
+{
+	dt_lazy_targets = lazy;
+}
+
 bool pdbg_targets_init(void *fdt)
 {
 	struct pdbg_dtb *dtb;
+	const char *snapshot, *trace, *record, *replay;
+	uint64_t key = 0;
 
 	if (pdbg_dt_root) {
 		PR_WARNING("pdbg_targets_init() must be called only once\n");
 		return true;
 	}
 
+	trace = getenv("PDBG_TRACE");
+	if (trace && !pdbg_trace_start(trace, 0))
+		PR_WARNING("Unable to trace hardware accesses to %s\n", trace);
+
+	replay = getenv("PDBG_REPLAY");
+	if (replay && !replay_enabled &&
+	    !pdbg_replay_start(replay, getenv("PDBG_REPLAY_TIMED") != NULL))
+		return false;
+
+	record = getenv("PDBG_RECORD");
+	if (record && !record_enabled && !pdbg_record_start(record))
+		PR_WARNING("Unable to record backend accesses to %s\n", record);
+
 	dtb = pdbg_default_dtb(fdt);
 
 	if (!dtb) {
@@ -722,26 +2070,88 @@ bool pdbg_targets_init(void *fdt)
 		return false;
 	}
 
+	snapshot = getenv("PDBG_SNAPSHOT");
+	if (snapshot) {
+		key = dt_snapshot_key(dtb);
+		pdbg_dt_root = dt_snapshot_load(snapshot, dtb, key);
+		if (pdbg_dt_root)
+			return true;
+	}
+
 	/* Root node needs to be valid when this function returns */
 	pdbg_dt_root = dt_new_node("", dtb->system.fdt, 0);
 	if (!pdbg_dt_root)
 		return false;
 
-	if (dtb->backend.fdt)
-		dt_expand(pdbg_dt_root, dtb->backend.fdt);
+	/* A snapshot needs the whole tree */
+	if (dt_lazy_targets && !snapshot) {
+		dt_init_lazy(pdbg_dt_root, dtb);
+	} else {
+		if (dtb->backend.fdt)
+			dt_expand(pdbg_dt_root, dtb->backend.fdt);
 
-	dt_expand(pdbg_dt_root, dtb->system.fdt);
+		dt_expand(pdbg_dt_root, dtb->system.fdt);
+	}
 
 	pdbg_targets_init_virtual(pdbg_dt_root, pdbg_dt_root);
+
+	if (snapshot)
+		dt_snapshot_save(snapshot, pdbg_dt_root, dtb, key);
+
 	return true;
 }
 
+/* Release any probed targets not reachable from the system tree */
+static void dt_release_all(struct pdbg_target *node)
+{
+	struct pdbg_target *child;
+
+	list_for_each(&node->children, child, list)
+		dt_release_all(child);
+
+	if (pdbg_target_status(node) == PDBG_TARGET_ENABLED) {
+		target_release(node);
+		node->status = PDBG_TARGET_RELEASED;
+	}
+}
+
+void pdbg_targets_fini(void)
+{
+	if (!pdbg_dt_root)
+		return;
+
+	pdbg_target_release(pdbg_dt_root);
+	dt_release_all(pdbg_dt_root);
+	pdbg_dt_root = NULL;
+	target_tree_partial = false;
+
+	/* All the targets, names, paths and classes live in the arena */
+	target_classes_reset();
+	arena_free(&target_arena);
+
+	last_phandle = 0;
+	property_generation++;
+
+	pdbg_close_dtbs();
+}
+
 const char *pdbg_target_path(struct pdbg_target *target)
 {
-	if (!target->path)
-		target->path = dt_get_path(target);
+	const char *path;
+
+	path = __atomic_load_n(&target->path, __ATOMIC_ACQUIRE);
+	if (path)
+		return path;
+
+	target_tree_lock();
+	path = target->path;
+	if (!path) {
+		path = dt_get_path(target);
+		__atomic_store_n(&target->path, path, __ATOMIC_RELEASE);
+	}
+	target_tree_unlock();
 
-	return target->path;
+	return path;
 }
 
 struct pdbg_target *pdbg_target_from_path(struct pdbg_target *target, const char *path)
@@ -583,17 +583,33 @@ bool pdbg_fdt_is_readonly(void *fdt)
 	return true;
 }
 
+bool pdbg_fdt_is_backend(void *fdt)
+{
+	return pdbg_dtb.backend.fdt == fdt;
+}
+
 static void close_dtb(struct pdbg_mfile *mfile)
 {
 	if (mfile->fd != -1 && mfile->len != -1 && mfile->fdt) {
 		munmap(mfile->fdt, mfile->len);
 		close(mfile->fd);
 	}
+
+	*mfile = (struct pdbg_mfile) {
+		.fd = -1,
+		.len = -1,
+		.readonly = true,
+	};
 }
 
-__attribute__((destructor))
-static void pdbg_close_targets(void)
+void pdbg_close_dtbs(void)
 {
 	close_dtb(&pdbg_dtb.backend);
 	close_dtb(&pdbg_dtb.system);
 }
+
+__attribute__((destructor))
+static void pdbg_close_targets(void)
+{
+	pdbg_close_dtbs();
+}
@@ -14,6 +14,7 @@
  * limitations under the license.
  */
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include "libpdbg.h"
@@ -87,12 +88,35 @@ static struct core fake_core = {
 };
 DECLARE_HW_UNIT(fake_core);
 
+/* Register values identify the processor, core and thread they came from */
+static int fake_thread_getregs(struct thread *thread, struct thread_regs *regs)
+{
+	struct pdbg_target *core, *proc;
+	uint64_t id;
+	int i;
+
+	core = pdbg_target_require_parent("core", &thread->target);
+	proc = pdbg_target_require_parent("proc", &thread->target);
+	id = (uint64_t)pdbg_target_index(proc) << 16 |
+	     pdbg_target_index(core) << 8 |
+	     pdbg_target_index(&thread->target);
+
+	memset(regs, 0, sizeof(*regs));
+	regs->nia = 0xfa6e000000000000ULL | id;
+	for (i = 0; i < 32; i++)
+		regs->gprs[i] = id << 8 | i;
+
+	PR_DEBUG("fake_thread_getregs(%s)\n", pdbg_target_path(&thread->target));
+	return 0;
+}
+
 static struct thread fake_thread = {
 	.target = {
 		.name =	"Fake Thread",
 		.compatible = "ibm,fake-thread",
 		.class = "thread",
 	},
+	.getregs = fake_thread_getregs,
 };
 DECLARE_HW_UNIT(fake_thread);
 
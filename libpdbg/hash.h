@@ -0,0 +1,70 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __LIBPDBG_HASH_H
+#define __LIBPDBG_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+
+/*
+ * 64-bit FNV-1a.  Start from HASH_FNV1A_INIT, the result of one call can
+ * be passed to the next to hash several buffers as one.
+ */
+#define HASH_FNV1A_INIT		0xcbf29ce484222325ULL
+#define HASH_FNV1A_PRIME	0x100000001b3ULL
+
+static inline uint64_t hash_fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (; len; len--, p++)
+		hash = (hash ^ *p) * HASH_FNV1A_PRIME;
+
+	return hash;
+}
+
+static inline uint64_t hash_fnv1a_str(uint64_t hash, const char *str)
+{
+	for (; *str; str++)
+		hash = (hash ^ (uint8_t)*str) * HASH_FNV1A_PRIME;
+
+	return hash;
+}
+
+/*
+ * Hash a whole device tree blob, which is hashed on every start.  This
+ * takes 8 bytes per FNV step, folding the high half of the hash into the
+ * low half after each, and is not FNV-1a.  Hashes of the same blob are
+ * the same on any host, but hashing A then B differs from hashing A and
+ * B as one buffer.
+ */
+static inline uint64_t hash_fdt_words(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t word;
+
+	for (; len >= sizeof(word); len -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ le64toh(word)) * HASH_FNV1A_PRIME;
+		hash ^= hash >> 32;
+	}
+
+	return hash_fnv1a(hash, p, len);
+}
+
+#endif
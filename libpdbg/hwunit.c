@@ -14,10 +14,12 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
 #include "hwunit.h"
+#include "hash.h"
 
 #define MAX_HW_UNITS	1024
 #define MAX_BACKENDS	16
@@ -25,6 +27,21 @@
 static const struct hw_unit_info *g_hw_unit[MAX_BACKENDS][MAX_HW_UNITS];
 static int g_hw_unit_count[MAX_BACKENDS];
 
+/*
+ * Compatible string to hw unit, open addressed.  Built on the first lookup
+ * and again if more hw units have been registered since.
+ */
+struct hw_unit_hash {
+	const struct hw_unit_info **slots;
+	unsigned int size;
+	int count;
+};
+
+static struct hw_unit_hash g_hw_unit_hash[MAX_BACKENDS];
+
+static uint64_t g_hw_unit_lookups;
+static uint64_t g_hw_unit_misses;
+
 void pdbg_hwunit_register(enum pdbg_backend backend, const struct hw_unit_info *hw_unit)
 {
 	assert(g_hw_unit_count[backend] < MAX_HW_UNITS);
@@ -33,21 +50,71 @@ void pdbg_hwunit_register(enum pdbg_backend backend, const struct hw_unit_info *
 	g_hw_unit_count[backend]++;
 }
 
-static const struct hw_unit_info *find_driver(enum pdbg_backend backend,
-					      const char *compat)
+static const char *hw_unit_compatible(const struct hw_unit_info *hw_unit)
 {
+	struct pdbg_target *target = hw_unit->hw_unit;
+
+	return target->compatible;
+}
+
+static void hw_unit_hash_build(enum pdbg_backend backend)
+{
+	struct hw_unit_hash *h = &g_hw_unit_hash[backend];
 	const struct hw_unit_info *p;
-	struct pdbg_target *target;
+	unsigned int size, slot;
 	int i;
 
+	/* At most half full */
+	for (size = 16; size < 2 * g_hw_unit_count[backend]; size *= 2)
+		;
+
+	free(h->slots);
+	h->slots = calloc(size, sizeof(*h->slots));
+	assert(h->slots);
+	h->size = size;
+	h->count = g_hw_unit_count[backend];
+
 	for (i = 0; i < g_hw_unit_count[backend]; i++) {
 		p = g_hw_unit[backend][i];
-		target = p->hw_unit;
 
-		if (!strcmp(target->compatible, compat))
-			return p;
+		slot = hash_fnv1a_str(HASH_FNV1A_INIT, hw_unit_compatible(p)) & (size - 1);
+		while (h->slots[slot]) {
+			/* The first hw unit registered for a compatible wins */
+			if (!strcmp(hw_unit_compatible(h->slots[slot]),
+				    hw_unit_compatible(p)))
+				break;
+
+			slot = (slot + 1) & (size - 1);
+		}
+
+		if (!h->slots[slot])
+			h->slots[slot] = p;
+	}
+}
+
+static const struct hw_unit_info *find_driver(enum pdbg_backend backend,
+					      const char *compat)
+{
+	struct hw_unit_hash *h = &g_hw_unit_hash[backend];
+	const struct hw_unit_info *p;
+	unsigned int slot;
+
+	g_hw_unit_lookups++;
+
+	if (h->count != g_hw_unit_count[backend])
+		hw_unit_hash_build(backend);
+
+	if (h->size) {
+		slot = hash_fnv1a_str(HASH_FNV1A_INIT, compat) & (h->size - 1);
+		while ((p = h->slots[slot])) {
+			if (!strcmp(hw_unit_compatible(p), compat))
+				return p;
+
+			slot = (slot + 1) & (h->size - 1);
+		}
 	}
 
+	g_hw_unit_misses++;
 	return NULL;
 }
 
@@ -81,3 +148,48 @@ const struct hw_unit_info *pdbg_hwunit_find_compatible(const char *compat_list,
 
 	return p;
 }
+
+bool pdbg_hwunit_id(const struct hw_unit_info *hw_unit,
+		    enum pdbg_backend *backend, unsigned int *index)
+{
+	int b, i;
+
+	for (b = 0; b < MAX_BACKENDS; b++) {
+		for (i = 0; i < g_hw_unit_count[b]; i++) {
+			if (g_hw_unit[b][i] == hw_unit) {
+				*backend = b;
+				*index = i;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+const struct hw_unit_info *pdbg_hwunit_get(enum pdbg_backend backend,
+					   unsigned int index)
+{
+	if (backend >= MAX_BACKENDS || index >= g_hw_unit_count[backend])
+		return NULL;
+
+	return g_hw_unit[backend][index];
+}
+
+void pdbg_hwunit_for_each(void (*fn)(enum pdbg_backend backend,
+				     const struct hw_unit_info *hw_unit,
+				     void *priv),
+			  void *priv)
+{
+	int b, i;
+
+	for (b = 0; b < MAX_BACKENDS; b++)
+		for (i = 0; i < g_hw_unit_count[b]; i++)
+			fn(b, g_hw_unit[b][i], priv);
+}
+
+void pdbg_hwunit_stats(struct pdbg_stats *stats)
+{
+	stats->hwunit_lookups = g_hw_unit_lookups;
+	stats->hwunit_misses = g_hw_unit_misses;
+}
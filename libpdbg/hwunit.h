@@ -35,6 +35,20 @@ void pdbg_hwunit_register(enum pdbg_backend backend, const struct hw_unit_info *
 const struct hw_unit_info *pdbg_hwunit_find_compatible(const char *compat_list,
 						       uint32_t len);
 
+/*
+ * A hw unit is identified by its backend and registration order, which is
+ * fixed for a given build of the library.
+ */
+bool pdbg_hwunit_id(const struct hw_unit_info *hw_unit,
+		    enum pdbg_backend *backend, unsigned int *index);
+const struct hw_unit_info *pdbg_hwunit_get(enum pdbg_backend backend,
+					   unsigned int index);
+void pdbg_hwunit_stats(struct pdbg_stats *stats);
+void pdbg_hwunit_for_each(void (*fn)(enum pdbg_backend backend,
+				     const struct hw_unit_info *hw_unit,
+				     void *priv),
+			  void *priv);
+
 /*
  * If this macro fails to compile for you, you've probably not
  * declared the struct pdbg_target as the first member of the
@@ -72,7 +86,7 @@ struct mem {
 
 struct chipop {
 	struct pdbg_target target;
-	uint32_t (*ffdc_get)(struct chipop *, const uint8_t **, uint32_t *);
+	uint32_t (*ffdc_get)(struct chipop *, uint8_t **, uint32_t *);
 	int (*istep)(struct chipop *, uint32_t major, uint32_t minor);
 	int (*mpipl_enter)(struct chipop *);
 	int (*mpipl_continue)(struct chipop *);
@@ -117,12 +131,24 @@ struct fsi {
 };
 #define target_to_fsi(x) container_of(x, struct fsi, target)
 
+#define CORE_MAX_THREADS	8
+
 struct core {
 	struct pdbg_target target;
 	bool release_spwkup;
+
+	/* Decodes the state of every thread of the core from the registers
+	 * they share, see core_thread_state() */
+	int (*thread_states)(struct core *, struct thread_state *states);
+	struct thread_state states[CORE_MAX_THREADS];
+	unsigned int states_generation;
+	uint64_t states_time;
 };
 #define target_to_core(x) container_of(x, struct core, target)
 
+#define RAM_SCRATCH_IN	0x1
+#define RAM_SCRATCH_OUT	0x2
+
 struct thread {
 	struct pdbg_target target;
 	struct thread_state status;
@@ -137,10 +163,12 @@ struct thread {
 
 	/* ram_setup() should be called prior to using ram_instruction() to
 	 * actually ram the instruction and return the result. ram_destroy()
-	 * should be called at completion to clean-up. */
+	 * should be called at completion to clean-up. The RAM_SCRATCH_* flags
+	 * say whether *scratch is written to SCR0 before the opcode and/or
+	 * read back from it afterwards. */
 	bool ram_is_setup;
 	int (*ram_setup)(struct thread *);
-	int (*ram_instruction)(struct thread *, uint64_t opcode, uint64_t *scratch);
+	int (*ram_instruction)(struct thread *, uint64_t opcode, uint64_t *scratch, unsigned int flags);
 	int (*ram_destroy)(struct thread *);
 	int (*enable_attn)(struct thread *);
 
@@ -25,6 +25,8 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <endian.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "bitutils.h"
 #include "operations.h"
@@ -33,31 +35,33 @@
 #define OPENFSI_LEGACY_PATH "/sys/bus/platform/devices/gpio-fsi/"
 #define OPENFSI_PATH "/sys/class/fsi-master/"
 
+/* How long to wait for a device to appear after an fsi rescan */
+#define FSI_SCAN_TIMEOUT_MS	5000
+#define FSI_SCAN_POLL_MS	10
+
 const char *fsi_base;
+static pthread_mutex_t fsi_base_lock = PTHREAD_MUTEX_INITIALIZER;
 
 const char *kernel_get_fsi_path(void)
 {
-	int rc;
-
-	if (fsi_base)
-		return fsi_base;
-
-	rc = access(OPENFSI_PATH, F_OK);
-	if (rc == 0) {
-		fsi_base = OPENFSI_PATH;
-		return fsi_base;
-	}
-
-	rc = access(OPENFSI_LEGACY_PATH, F_OK);
-	if (rc == 0) {
-		fsi_base = OPENFSI_LEGACY_PATH;
-		return fsi_base;
+	const char *path;
+
+	/* Targets of several processors may be probed at once */
+	pthread_mutex_lock(&fsi_base_lock);
+	if (!fsi_base) {
+		if (access(OPENFSI_PATH, F_OK) == 0)
+			fsi_base = OPENFSI_PATH;
+		else if (access(OPENFSI_LEGACY_PATH, F_OK) == 0)
+			fsi_base = OPENFSI_LEGACY_PATH;
 	}
+	path = fsi_base;
+	pthread_mutex_unlock(&fsi_base_lock);
 
 	/* This is an error, but callers use this function when probing */
-	PR_DEBUG("Failed to find kernel FSI path\n");
+	if (!path)
+		PR_DEBUG("Failed to find kernel FSI path\n");
 
-	return NULL;
+	return path;
 }
 
 static int kernel_fsi_getcfam(struct fsi *fsi, uint32_t addr64, uint32_t *value)
@@ -141,15 +145,37 @@ static void kernel_fsi_scan_devices(void)
 	close(fd);
 }
 
+/*
+ * After a rescan the kernel re-creates the slave devices in the
+ * background.  sysfs does not report new files through inotify, so poll
+ * for the device with a short interval instead of waiting for a second
+ * at a time.
+ */
+static int kernel_fsi_wait_open(const char *path)
+{
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = FSI_SCAN_POLL_MS * 1000000 };
+	int waited_ms = 0;
+	int fd;
+
+	for (;;) {
+		fd = open(path, O_RDWR | O_SYNC);
+		if (fd >= 0 || waited_ms >= FSI_SCAN_TIMEOUT_MS)
+			return fd;
+
+		nanosleep(&delay, NULL);
+		waited_ms += FSI_SCAN_POLL_MS;
+	}
+}
+
 int kernel_fsi_probe(struct pdbg_target *target)
 {
 	struct fsi *fsi = target_to_fsi(target);
-	int tries = 5;
 	int rc;
 	const char *kernel_path = kernel_get_fsi_path();
 	const char *fsi_path;
 	char *path;
 	static bool first_probe = true;
+	static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
 
 	if (!kernel_path)
 		return -1;
@@ -163,27 +189,26 @@ int kernel_fsi_probe(struct pdbg_target *target)
 		return rc;
 	}
 
-	while (tries) {
-		fsi->fd = open(path, O_RDWR | O_SYNC);
-		if (fsi->fd >= 0) {
-			free(path);
-			first_probe = false;
-			return 0;
-		}
-		tries--;
-
-		/*
-		 * On fsi bus rescan, kernel re-creates all the slave device
-		 * entries.  It means any currently open devices will be
-		 * invalid and need to be re-opened.  So avoid scanning if
-		 * some devices are already probed.
-		 */
-		if (first_probe) {
-			kernel_fsi_scan_devices();
-			sleep(1);
-		} else {
-			break;
-		}
+	fsi->fd = open(path, O_RDWR | O_SYNC);
+
+	/*
+	 * On fsi bus rescan, kernel re-creates all the slave device
+	 * entries.  It means any currently open devices will be
+	 * invalid and need to be re-opened.  So avoid scanning if
+	 * some devices are already probed.
+	 */
+	pthread_mutex_lock(&scan_lock);
+	if (fsi->fd < 0 && first_probe) {
+		kernel_fsi_scan_devices();
+		fsi->fd = kernel_fsi_wait_open(path);
+	}
+	if (fsi->fd >= 0)
+		first_probe = false;
+	pthread_mutex_unlock(&scan_lock);
+
+	if (fsi->fd >= 0) {
+		free(path);
+		return 0;
 	}
 
 	PR_INFO("Unable to open %s\n", path);
@@ -1,10 +1,16 @@
+#include <stdlib.h>
 #include <string.h>
 #include <endian.h>
+#include <assert.h>
 
 #include "target.h"
 #include "libpdbg.h"
+#include "arena.h"
+#include "hwunit.h"
+#include "record.h"
 
-static pdbg_progress_tick_t progress_tick;
+/* Each thread has its own progress callback */
+static __thread pdbg_progress_tick_t progress_tick;
 
 struct pdbg_target *get_parent(struct pdbg_target *target, bool system)
 {
@@ -35,17 +41,149 @@ struct pdbg_target *get_parent(struct pdbg_target *target, bool system)
 	return target_to_real(parent, false);
 }
 
+static struct pdbg_target_index *target_index_get(struct pdbg_target *target,
+						  struct pdbg_target_class *target_class,
+						  bool system)
+{
+	struct pdbg_target_index *index;
+
+	for (index = target->descendants; index; index = index->next)
+		if (index->target_class == target_class && index->system == system)
+			return index;
+
+	return NULL;
+}
+
+/*
+ * Index every target of a class under each of its ancestors, including
+ * the target itself and the root.  Building the index for all ancestors
+ * in one go costs one walk up the tree per target of the class.  An index
+ * rebuilt after the tree changed keeps its array if it is large enough.
+ */
+static void target_index_build(struct pdbg_target_class *target_class, bool system)
+{
+	struct pdbg_target_index *index;
+	struct pdbg_target *target, *tmp;
+
+	list_for_each(&target_class->targets, target, class_link) {
+		for (tmp = target; tmp; tmp = get_parent(tmp, system)) {
+			index = target_index_get(tmp, target_class, system);
+			if (!index) {
+				index = arena_alloc(&target_arena, sizeof(*index));
+				index->target_class = target_class;
+				index->system = system;
+				index->next = tmp->descendants;
+				tmp->descendants = index;
+			}
+
+			if (index->generation != target_tree_generation) {
+				index->generation = target_tree_generation;
+				index->count = 0;
+				index->cursor = 0;
+			}
+
+			index->count++;
+		}
+	}
+
+	/* The cursor is where the next target goes until the index is built */
+	list_for_each(&target_class->targets, target, class_link) {
+		for (tmp = target; tmp; tmp = get_parent(tmp, system)) {
+			index = target_index_get(tmp, target_class, system);
+			if (!index->cursor && index->alloc < index->count) {
+				index->alloc = index->count;
+				index->targets = arena_alloc(&target_arena,
+							     index->alloc * sizeof(*index->targets));
+			}
+
+			index->targets[index->cursor++] = target;
+		}
+	}
+
+	__atomic_store_n(&target_class->index_generation[system],
+			 target_tree_generation, __ATOMIC_RELEASE);
+}
+
+static struct pdbg_target_index *target_index(struct pdbg_target *parent,
+					      struct pdbg_target_class *target_class,
+					      bool system)
+{
+	struct pdbg_target_index *index;
+
+	if (__atomic_load_n(&target_class->index_generation[system], __ATOMIC_ACQUIRE) !=
+	    target_tree_generation) {
+		target_tree_lock();
+		if (target_class->index_generation[system] != target_tree_generation)
+			target_index_build(target_class, system);
+		target_tree_unlock();
+	}
+
+	index = target_index_get(parent, target_class, system);
+	if (!index || index->generation != target_tree_generation)
+		return NULL;
+
+	return index;
+}
+
+/*
+ * Find the position of the first target in the index which comes after
+ * last in the class list.
+ */
+static unsigned int target_index_next(struct pdbg_target_index *index,
+				      struct pdbg_target *last)
+{
+	unsigned int lo = 0, hi = index->count, mid;
+	unsigned int cursor = __atomic_load_n(&index->cursor, __ATOMIC_RELAXED);
+
+	/* Plain iteration always asks for the one after the previous result */
+	if (cursor < index->count && index->targets[cursor] == last)
+		return cursor + 1;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->targets[mid]->class_order <= last->class_order)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
 struct pdbg_target *__pdbg_next_target(const char *class, struct pdbg_target *parent, struct pdbg_target *last, bool system)
 {
-	struct pdbg_target *next, *tmp;
+	struct pdbg_target *next;
 	struct pdbg_target_class *target_class;
+	struct pdbg_target_index *index;
+	unsigned int pos;
+
+	/* Class iteration needs every target of the class */
+	if (target_tree_partial)
+		target_tree_expand();
 
-	if (class && !find_target_class(class))
+	/* Carry on with the class of the last target to avoid a lookup */
+	if (last)
+		target_class = last->target_class;
+	else
+		target_class = find_target_class(class);
+
+	if (!target_class)
 		return NULL;
 
-	target_class = require_target_class(class);
+	if (parent) {
+		index = target_index(parent, target_class, system);
+		if (!index)
+			return NULL;
+
+		pos = last ? target_index_next(index, last) : 0;
+		if (pos >= index->count)
+			return NULL;
+
+		/* Only a hint, other threads may be iterating too */
+		__atomic_store_n(&index->cursor, pos, __ATOMIC_RELAXED);
+		return index->targets[pos];
+	}
 
-retry:
 	/* No more targets left to check in this class */
 	if ((last && last->class_link.next == &target_class->targets.n) ||
 	    list_empty(&target_class->targets))
@@ -54,22 +192,9 @@ retry:
 	if (last)
 		next = list_entry(last->class_link.next, struct pdbg_target, class_link);
 	else
-		if (!(next = list_top(&target_class->targets, struct pdbg_target, class_link)))
-			return NULL;
+		next = list_top(&target_class->targets, struct pdbg_target, class_link);
 
-	if (!parent)
-		/* Parent is null, no need to check if this is a child */
-		return next;
-	else {
-		/* Check if this target is a child of the given parent */
-		for (tmp = next; tmp && get_parent(tmp, system) && tmp != parent; tmp = get_parent(tmp, system)) {}
-		if (tmp == parent)
-			return next;
-		else {
-			last = next;
-			goto retry;
-		}
-	}
+	return next;
 }
 
 static struct pdbg_target *target_map_child(struct pdbg_target *next, bool system)
@@ -113,6 +238,9 @@ struct pdbg_target *__pdbg_next_child_target(struct pdbg_target *parent, struct
 	if (!parent)
 		return NULL;
 
+	if (target_tree_partial)
+		target_expand_children(parent);
+
 	/*
 	 * Parent node can be virtual or real.
 	 *
@@ -128,6 +256,9 @@ struct pdbg_target *__pdbg_next_child_target(struct pdbg_target *parent, struct
 			parent = parent->vnode;
 		else
 			return NULL;
+
+		if (target_tree_partial)
+			target_expand_children(parent);
 	}
 
 	 /*
@@ -202,7 +333,7 @@ int pdbg_target_traverse(struct pdbg_target *parent,
 
 enum pdbg_target_status pdbg_target_status(struct pdbg_target *target)
 {
-	return target->status;
+	return __atomic_load_n(&target->status, __ATOMIC_ACQUIRE);
 }
 
 void pdbg_target_status_set(struct pdbg_target *target, enum pdbg_target_status status)
@@ -211,7 +342,10 @@ void pdbg_target_status_set(struct pdbg_target *target, enum pdbg_target_status
 	 * blow up obviously if this happens */
 	assert(status == PDBG_TARGET_DISABLED || status == PDBG_TARGET_MUSTEXIST);
 
-	target->status = status;
+	/* Not while the target is being probed */
+	pthread_mutex_lock(&target->lock);
+	target_status_store(target, status);
+	pthread_mutex_unlock(&target->lock);
 }
 
 /* Searches up the tree and returns the first valid index found */
@@ -230,18 +364,18 @@ uint32_t pdbg_target_index(struct pdbg_target *target)
 /* Find a target parent from the given class */
 struct pdbg_target *target_parent(const char *klass, struct pdbg_target *target, bool system)
 {
+	struct pdbg_target_class *target_class;
 	struct pdbg_target *parent;
 
 	if (!klass)
 		return get_parent(target, system);
 
-	for (parent = get_parent(target, system); parent && get_parent(parent, system); parent = get_parent(parent, system)) {
-		const char *tclass = pdbg_target_class_name(parent);
-
-		if (!tclass)
-			continue;
+	target_class = find_target_class(klass);
+	if (!target_class)
+		return NULL;
 
-		if (!strcmp(klass, tclass))
+	for (parent = get_parent(target, system); parent && get_parent(parent, system); parent = get_parent(parent, system)) {
+		if (parent->target_class == target_class)
 			return parent;
 	}
 
@@ -342,3 +476,22 @@ void pdbg_set_progress_tick(pdbg_progress_tick_t fn)
 {
 	progress_tick = fn;
 }
+
+pdbg_progress_tick_t progress_tick_swap(pdbg_progress_tick_t fn)
+{
+	pdbg_progress_tick_t old = progress_tick;
+
+	progress_tick = fn;
+	return old;
+}
+
+void pdbg_get_stats(struct pdbg_stats *stats, size_t size)
+{
+	struct pdbg_stats all;
+
+	memset(&all, 0, sizeof(all));
+	pdbg_hwunit_stats(&all);
+	replay_stats(&all);
+
+	memcpy(stats, &all, size < sizeof(all) ? size : sizeof(all));
+}
@@ -530,6 +530,53 @@ uint64_t pdbg_target_address(struct pdbg_target *target, uint64_t *size);
  */
 bool pdbg_set_backend(enum pdbg_backend backend, const char *backend_option);
 
+/**
+ * @brief Create targets on demand
+ *
+ * @param[in]  lazy true to create targets when they are first used
+ *
+ * By default pdbg_targets_init() creates every target in the device
+ * tree.  With lazy targets only the targets needed to link the system
+ * tree are created up front.  The children of a target are created the
+ * first time they are iterated over or looked up by path.  Iterating
+ * over a class of targets, including with pdbg_for_each_target(),
+ * creates all the remaining targets.
+ *
+ * Must be called before calling pdbg_targets_init().
+ */
+void pdbg_set_lazy_targets(bool lazy);
+
+/**
+ * @brief Counters describing the work done by libpdbg
+ *
+ * hwunit_lookups counts the compatible strings looked up to create
+ * targets, hwunit_misses the ones which did not match any hw unit.
+ *
+ * While replaying a recording, replay_accesses counts the accesses served
+ * from it, replay_missing the ones it had no access left for and
+ * replay_mismatches the ones which differ from the recording.
+ *
+ * New counters are only ever added at the end.
+ */
+struct pdbg_stats {
+	uint64_t hwunit_lookups;
+	uint64_t hwunit_misses;
+	uint64_t replay_accesses;
+	uint64_t replay_missing;
+	uint64_t replay_mismatches;
+};
+
+/**
+ * @brief Get the counters since the program started
+ *
+ * @param[out]  stats the counters
+ * @param[in]  size sizeof(*stats) as the caller was built with
+ *
+ * Only the first size bytes of stats are filled in, so a program built
+ * against an older struct pdbg_stats keeps working.
+ */
+void pdbg_get_stats(struct pdbg_stats *stats, size_t size);
+
 /**
  * @brief Initialises the targeting system from the given flattened device tree.
  *
@@ -543,6 +590,20 @@ bool pdbg_set_backend(enum pdbg_backend backend, const char *backend_option);
  * PDBG_DTB, then it will override the default device tree or the specified
  * device tree.
  *
+ * If the PDBG_SNAPSHOT environment variable names a file, the targets are
+ * loaded from that file when it was saved for the same device trees and
+ * the same version of libpdbg.  Otherwise all targets are created and
+ * saved to the file for the next time.
+ *
+ * If the PDBG_TRACE environment variable names a file, hardware accesses
+ * are traced to that file, see pdbg_trace_start().
+ *
+ * If the PDBG_REPLAY environment variable names a recording, backend
+ * accesses are served from it, with the recorded timing if
+ * PDBG_REPLAY_TIMED is set, see pdbg_replay_start().  If PDBG_RECORD
+ * names a file, backend accesses are recorded to it, see
+ * pdbg_record_start().
+ *
  * @note This function can only be called once.  If the call fails, then it
  * indicates failure to identify the system device tree to load. On failure,
  * it's possible to call this function again with different argument or after
@@ -552,6 +613,17 @@ bool pdbg_set_backend(enum pdbg_backend backend, const char *backend_option);
  */
 bool pdbg_targets_init(void *fdt);
 
+/**
+ * @brief Free the targeting system
+ *
+ * Releases any probed targets, frees all the targets and closes the
+ * device trees loaded by pdbg_targets_init().  Any pointers to targets,
+ * target paths or property values are invalid afterwards.
+ *
+ * pdbg_targets_init() may be called again after this.
+ */
+void pdbg_targets_fini(void);
+
 /**
  * @brief Probe all targets
  *
@@ -568,9 +640,71 @@ bool pdbg_targets_init(void *fdt);
  * For example targets with a pdbg_target_status of
  * PDBG_TARGET_DISABLED will not be probed, and therefore any children
  * underneath it will also not be probed.
+ *
+ * Targets are probed with pdbg_target_probe_list(), so with more than
+ * one probe thread set the targets of different processors are probed
+ * in parallel.
  */
 void pdbg_target_probe_all(struct pdbg_target *parent);
 
+/**
+ * @brief Set the number of threads used to probe targets
+ *
+ * @param[in] threads the maximum number of threads, 1 to probe serially
+ *
+ * Probing can take a long time on a BMC, most of it waiting for devices.
+ * pdbg_target_probe_list() and pdbg_target_probe_all() probe the targets
+ * of each processor on their own thread, up to this many threads at a
+ * time.  Parents are always probed before their children.
+ *
+ * Only the kernel, sbefifo and fake backends probe in parallel, the
+ * other backends share a single bus or connection between processors
+ * and always probe serially.  The default is 1.
+ *
+ * The same threads are used to read the registers of several threads
+ * with thread_getregs_list() and to run pdbg_target_run_per_proc().
+ */
+void pdbg_set_probe_threads(unsigned int threads);
+
+typedef void (*pdbg_target_fn)(struct pdbg_target *target, unsigned int index, void *priv);
+
+/**
+ * @brief Call a function on a list of targets, per processor
+ *
+ * @param[in] targets the targets
+ * @param[in] count the number of targets
+ * @param[in] fn called with each target, its index in targets and priv
+ * @param[in] priv passed to fn
+ *
+ * The targets of each processor are passed to fn in order from one
+ * thread, those of different processors may be run in parallel, see
+ * pdbg_set_probe_threads().  Targets which don't belong to a processor
+ * are run by the calling thread.
+ */
+void pdbg_target_run_per_proc(struct pdbg_target **targets, unsigned int count,
+			      pdbg_target_fn fn, void *priv);
+
+/**
+ * @brief Probe a list of targets
+ *
+ * @param[in] targets the targets to probe
+ * @param[in] count the number of targets
+ *
+ * Same as calling pdbg_target_probe() on each target, but targets of
+ * different processors may be probed in parallel, see
+ * pdbg_set_probe_threads().
+ */
+void pdbg_target_probe_list(struct pdbg_target **targets, unsigned int count);
+
+/**
+ * @brief Time taken to probe a target
+ *
+ * @param[in] target the pdbg_target
+ * @return the time in microseconds spent in the probe of the target
+ * itself, excluding its parents, 0 if it has not been probed
+ */
+uint64_t pdbg_target_probe_time(struct pdbg_target *target);
+
 /**
  * @brief Probe a specific target
  *
@@ -611,6 +745,38 @@ enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target);
  */
 void pdbg_target_release(struct pdbg_target *target);
 
+/**
+ * @brief Lock the given target
+ * @param[in] target the pdbg_target to lock
+ *
+ * libpdbg may be used from more than one thread.  Once
+ * pdbg_targets_init() has returned, targets may be looked up, probed,
+ * released and accessed from any thread.  pdbg_targets_init(),
+ * pdbg_targets_fini(), pdbg_set_backend(), pdbg_set_lazy_targets(),
+ * pdbg_set_logfunc(), pdbg_set_loglevel() and pdbg_target_set_property()
+ * must not run at the same time as any other call.
+ *
+ * Each target has a recursive lock.  It is held while the target is
+ * probed or released and around each access to a pib, opb, fsi, mem or
+ * ocmb target, so accesses through one bus are serialised while
+ * accesses through the buses of different processors run concurrently.
+ * pib_write_mask() and fsi_write_mask() hold the lock of the bus across
+ * the read and the write.
+ *
+ * A sequence of accesses which must not be interleaved with those of
+ * other threads, for example ramming instructions on a thread, can hold
+ * the lock of the bus target they go through for the whole sequence.
+ * Locks must only be taken from a target towards the root of the tree,
+ * never the other way round.
+ */
+void pdbg_target_lock(struct pdbg_target *target);
+
+/**
+ * @brief Unlock a target locked with pdbg_target_lock()
+ * @param[in] target the pdbg_target to unlock
+ */
+void pdbg_target_unlock(struct pdbg_target *target);
+
 /**
  * @brief Get the current pdbg_target status
  * @param[in] target the pdbg_target
@@ -984,6 +1150,20 @@ int thread_getfpr(struct pdbg_target *thread, int fpr, uint64_t *value);
  */
 int thread_getregs(struct pdbg_target *target, struct thread_regs *regs);
 
+/**
+ * @brief Get the registers of several threads
+ * @param[in] targets the thread targets to operate on
+ * @param[in] count the number of targets
+ * @param[out] regs an array of count structures for the register values
+ * @param[out] rc an array of count results, as thread_getregs() returns
+ * @return the number of threads whose registers were read
+ *
+ * Threads of different processors are read in parallel, see
+ * pdbg_set_probe_threads(). Unlike thread_getregs() nothing is printed.
+ */
+int thread_getregs_list(struct pdbg_target **targets, unsigned int count,
+			struct thread_regs *regs, int *rc);
+
 /**
  * @brief the pdbg thread states
  */
@@ -1032,6 +1212,22 @@ int thread_start(struct pdbg_target *target);
  */
 int thread_step(struct pdbg_target *target, int steps);
 
+/**
+ * @brief Step a thread until it reaches an address
+ * @param[in] target the thread target to operate on
+ * @param[in] addr the address to stop at, before it is executed
+ * @param[in] max_steps the maximum number of instructions to step
+ * @param[out] steps the number of instructions stepped, may be NULL
+ * @return 0 if the thread reached addr, 1 if it did not within max_steps,
+ * -1 on error
+ *
+ * The NIA is read before each step, each read setting up and restoring
+ * RAM mode, so this is several times slower per instruction than
+ * thread_step(). Progress is reported through pdbg_progress_tick().
+ */
+int thread_run_to(struct pdbg_target *target, uint64_t addr, uint64_t max_steps,
+		  uint64_t *steps);
+
 /**
  * @brief Stop execution on the given thread
  * @param[in] target the thread target to operate on
@@ -1345,6 +1541,9 @@ typedef void (*pdbg_progress_tick_t)(uint64_t cur, uint64_t end);
  * some other work during long running operations such as reading
  * large amounts of memory. This function lets an application set a
  * callback to do this.
+ *
+ * The callback is set for the calling thread only and is called for
+ * operations made by that thread.
  */
 void pdbg_set_progress_tick(pdbg_progress_tick_t fn);
 
@@ -1397,6 +1596,83 @@ void pdbg_set_loglevel(int loglevel);
  */
 void pdbg_log(int loglevel, const char *fmt, ...);
 
+/**
+ * @brief Start a binary trace of hardware accesses
+ * @param[in] path the file the trace is written to
+ * @param[in] entries the number of accesses kept per thread, 0 for the
+ * default of 65536
+ * @return true on success, false on failure
+ *
+ * Every pib, fsi and mem access and sbefifo operation is recorded with
+ * its time, target, address, data, return code and duration.  Each
+ * thread keeps its latest accesses in a ring of its own, so recording
+ * takes no lock and costs far less than debug logging.
+ *
+ * The trace is written to the file when the program exits and whenever
+ * pdbg_trace_dump() is called.  pdbg-trace decodes it to text or CSV.
+ */
+bool pdbg_trace_start(const char *path, unsigned int entries);
+
+/**
+ * @brief Stop recording hardware accesses
+ *
+ * Accesses recorded so far are kept and still written by
+ * pdbg_trace_dump() and at exit.
+ */
+void pdbg_trace_stop(void);
+
+/**
+ * @brief Write the trace of hardware accesses to its file
+ * @return 0 on success, -1 if there is no trace or it could not be written
+ *
+ * Only uses async-signal-safe functions, so it may be called from a
+ * signal handler.  Accesses made by other threads while the trace is
+ * written may be left out.
+ */
+int pdbg_trace_dump(void);
+
+/**
+ * @brief Record backend accesses for a later replay
+ * @param[in] path the file the accesses are written to
+ * @return true on success, false on failure
+ *
+ * Every pib, fsi, opb, mem and ocmb access is written to the file with
+ * its result, mem reads with the data read.  So is the raw request and
+ * reply of every sbefifo transfer and the result of probing each target
+ * of the backend device tree.  Accesses to a target are recorded in the
+ * order they were made.
+ *
+ * Must be called after pdbg_set_backend() and before pdbg_targets_init().
+ * Only one recording can be made by a process, it is completed by
+ * pdbg_record_stop() or when the program exits.
+ */
+bool pdbg_record_start(const char *path);
+
+/**
+ * @brief Stop recording backend accesses and complete the recording
+ */
+void pdbg_record_stop(void);
+
+/**
+ * @brief Serve backend accesses from a recording
+ * @param[in] path the recording made by pdbg_record_start()
+ * @param[in] timed true for each access to take as long as it was
+ * recorded to take, false to serve it right away
+ * @return true on success, false if the recording could not be read
+ *
+ * Targets of the backend device tree are not probed or released and no
+ * backend is accessed.  Each access is given the result of the next
+ * recorded access with the same target path, type and address, so a
+ * session replays as it was recorded as long as libpdbg makes the same
+ * accesses.  Accesses which were not recorded fail, writes which differ
+ * from the recording are logged, both are counted in struct pdbg_stats.
+ *
+ * The backend and system type of the recording are used unless
+ * pdbg_set_backend() was called.  Must be called before
+ * pdbg_targets_init().
+ */
+bool pdbg_replay_start(const char *path, bool timed);
+
 #ifdef __cplusplus
 }
 #endif
@@ -56,18 +56,17 @@ static uint64_t thread_write(struct thread *thread, uint64_t addr, uint64_t data
 	return pib_write(chip, addr, data);
 }
 
-struct thread_state p10_thread_state(struct thread *thread)
+static struct thread_state p10_decode_thread_state(int id, uint64_t ras_status,
+						   uint64_t thread_info,
+						   uint64_t core_thread_state)
 {
 	struct thread_state thread_state;
-	uint64_t value;
 	bool maint_mode, thread_quiesced, ict_empty;
 	uint8_t smt_mode;
 
-	thread_read(thread, P10_RAS_STATUS, &value);
-
-	maint_mode	= (value & PPC_BIT(0 + 8*thread->id));
-	thread_quiesced	= (value & PPC_BIT(1 + 8*thread->id));
-	ict_empty	= (value & PPC_BIT(2 + 8*thread->id));
+	maint_mode	= (ras_status & PPC_BIT(0 + 8*id));
+	thread_quiesced	= (ras_status & PPC_BIT(1 + 8*id));
+	ict_empty	= (ras_status & PPC_BIT(2 + 8*id));
 
 	/*
 	 * RAM mode (if implemented) additionally requires bit 3 (LSU quiesce)
@@ -79,10 +78,9 @@ struct thread_state p10_thread_state(struct thread *thread)
 	else
 		thread_state.quiesced = false;
 
-	thread_read(thread, P10_THREAD_INFO, &value);
-	thread_state.active = !!(value & PPC_BIT(thread->id));
+	thread_state.active = !!(thread_info & PPC_BIT(id));
 
-	smt_mode = GETFIELD(PPC_BITMASK(8,9), value);
+	smt_mode = GETFIELD(PPC_BITMASK(8,9), thread_info);
 	switch (smt_mode) {
 	case 0:
 		thread_state.smt_state = PDBG_SMT_1;
@@ -101,8 +99,7 @@ struct thread_state p10_thread_state(struct thread *thread)
 		break;
 	}
 
-	thread_read(thread, P10_CORE_THREAD_STATE, &value);
-	if (value & PPC_BIT(56 + thread->id))
+	if (core_thread_state & PPC_BIT(56 + id))
 		thread_state.sleep_state = PDBG_THREAD_STATE_STOP;
 	else
 		thread_state.sleep_state = PDBG_THREAD_STATE_RUN;
@@ -110,12 +107,41 @@ struct thread_state p10_thread_state(struct thread *thread)
 	return thread_state;
 }
 
+struct thread_state p10_thread_state(struct thread *thread)
+{
+	uint64_t ras_status, thread_info, core_thread_state;
+
+	thread_read(thread, P10_RAS_STATUS, &ras_status);
+	thread_read(thread, P10_THREAD_INFO, &thread_info);
+	thread_read(thread, P10_CORE_THREAD_STATE, &core_thread_state);
+
+	return p10_decode_thread_state(thread->id, ras_status, thread_info,
+				       core_thread_state);
+}
+
+/* The status registers are per core, decode all four threads from one read */
+static int p10_core_thread_states(struct core *core, struct thread_state *states)
+{
+	uint64_t ras_status, thread_info, core_thread_state;
+	int i;
+
+	CHECK_ERR(pib_read(&core->target, P10_RAS_STATUS, &ras_status));
+	CHECK_ERR(pib_read(&core->target, P10_THREAD_INFO, &thread_info));
+	CHECK_ERR(pib_read(&core->target, P10_CORE_THREAD_STATE, &core_thread_state));
+
+	for (i = 0; i < 4; i++)
+		states[i] = p10_decode_thread_state(i, ras_status, thread_info,
+						    core_thread_state);
+
+	return 0;
+}
+
 static int p10_thread_probe(struct pdbg_target *target)
 {
 	struct thread *thread = target_to_thread(target);
 
 	thread->id = pdbg_target_index(target);
-	thread->status = thread->state(thread);
+	thread->status = core_thread_state(thread);
 
 	return 0;
 }
@@ -289,6 +315,7 @@ static struct core p10_core = {
 		.release = p10_core_release,
 		.translate = translate_cast(p10_core_translate),
 	},
+	.thread_states = p10_core_thread_states,
 };
 DECLARE_HW_UNIT(p10_core);
 
@@ -268,6 +268,8 @@ static int p8_thread_step(struct thread *thread, int count)
 		do {
 			CHECK_ERR(pib_read(&thread->target, RAS_STATUS_REG, &ras_status));
 		} while (!(ras_status & RAS_STATUS_INST_COMPLETE));
+
+		pdbg_progress_tick(i + 1, count);
 	}
 
 	/* Deactivate single-step mode */
@@ -420,7 +422,8 @@ static int p8_ram_setup(struct thread *thread)
 	return 0;
 }
 
-static int p8_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *scratch)
+static int p8_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *scratch,
+			      unsigned int flags)
 {
 	struct core *chip = target_to_core(
 		pdbg_target_require_parent("core", &thread->target));
@@ -429,7 +432,8 @@ static int p8_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *
 	if (!thread->ram_is_setup)
 		return 1;
 
-	CHECK_ERR(pib_write(&chip->target, SCR0_REG, *scratch));
+	if (flags & RAM_SCRATCH_IN)
+		CHECK_ERR(pib_write(&chip->target, SCR0_REG, *scratch));
 
 	/* ram instruction */
 	val = SETFIELD(RAM_THREAD_SELECT, 0ULL, thread->id);
@@ -451,7 +455,8 @@ static int p8_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *
 	}
 
 	/* Save the results */
-	CHECK_ERR(pib_read(&chip->target, SCR0_REG, scratch));
+	if (flags & RAM_SCRATCH_OUT)
+		CHECK_ERR(pib_read(&chip->target, SCR0_REG, scratch));
 
 	return 0;
 }
@@ -90,20 +90,16 @@ static uint64_t thread_write(struct thread *thread, uint64_t addr, uint64_t data
 	return pib_write(chip, addr, data);
 }
 
-struct thread_state p9_thread_state(struct thread *thread)
+static struct thread_state p9_decode_thread_state(int id, uint64_t ras_status,
+						  uint64_t thread_info,
+						  uint64_t core_thread_state)
 {
-	uint64_t value;
 	struct thread_state thread_state;
 
-	thread_read(thread, P9_RAS_STATUS, &value);
-
-	thread_state.quiesced = (GETFIELD(PPC_BITMASK(8*thread->id, 3 + 8*thread->id), value) == 0xf);
+	thread_state.quiesced = (GETFIELD(PPC_BITMASK(8*id, 3 + 8*id), ras_status) == 0xf);
+	thread_state.active = !!(thread_info & PPC_BIT(id));
 
-	thread_read(thread, P9_THREAD_INFO, &value);
-	thread_state.active = !!(value & PPC_BIT(thread->id));
-
-	thread_read(thread, P9_CORE_THREAD_STATE, &value);
-	if (value & PPC_BIT(56 + thread->id))
+	if (core_thread_state & PPC_BIT(56 + id))
 		thread_state.sleep_state = PDBG_THREAD_STATE_STOP;
 	else
 		thread_state.sleep_state = PDBG_THREAD_STATE_RUN;
@@ -113,12 +109,41 @@ struct thread_state p9_thread_state(struct thread *thread)
 	return thread_state;
 }
 
+struct thread_state p9_thread_state(struct thread *thread)
+{
+	uint64_t ras_status, thread_info, core_thread_state;
+
+	thread_read(thread, P9_RAS_STATUS, &ras_status);
+	thread_read(thread, P9_THREAD_INFO, &thread_info);
+	thread_read(thread, P9_CORE_THREAD_STATE, &core_thread_state);
+
+	return p9_decode_thread_state(thread->id, ras_status, thread_info,
+				      core_thread_state);
+}
+
+/* The status registers are per core, decode all four threads from one read */
+static int p9_core_thread_states(struct core *core, struct thread_state *states)
+{
+	uint64_t ras_status, thread_info, core_thread_state;
+	int i;
+
+	CHECK_ERR(pib_read(&core->target, P9_RAS_STATUS, &ras_status));
+	CHECK_ERR(pib_read(&core->target, P9_THREAD_INFO, &thread_info));
+	CHECK_ERR(pib_read(&core->target, P9_CORE_THREAD_STATE, &core_thread_state));
+
+	for (i = 0; i < 4; i++)
+		states[i] = p9_decode_thread_state(i, ras_status, thread_info,
+						   core_thread_state);
+
+	return 0;
+}
+
 static int p9_thread_probe(struct pdbg_target *target)
 {
 	struct thread *thread = target_to_thread(target);
 
 	thread->id = pdbg_target_index(target);
-	thread->status = thread->state(thread);
+	thread->status = core_thread_state(thread);
 
 	return 0;
 }
@@ -198,6 +223,8 @@ static int p9_thread_step(struct thread *thread, int count)
 		do {
 			thread_read(thread, P9_RAS_STATUS, &value);
 		} while (!(value & PPC_BIT(4 + 8*thread->id)));
+
+		pdbg_progress_tick(i + 1, count);
 	}
 
 	/* Un-fence */
@@ -280,7 +307,8 @@ out_fail:
 
 
 
-static int __p9_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *scratch)
+static int __p9_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *scratch,
+				unsigned int flags)
 {
 	uint64_t predecode, value;
 	int rc;
@@ -331,7 +359,8 @@ static int __p9_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t
 		predecode = 0;
 	}
 
-	CHECK_ERR(thread_write(thread, P9_SCR0_REG, *scratch));
+	if (flags & RAM_SCRATCH_IN)
+		CHECK_ERR(thread_write(thread, P9_SCR0_REG, *scratch));
 	value = SETFIELD(PPC_BITMASK(0, 1), 0ull, thread->id);
 	value = SETFIELD(PPC_BITMASK(2, 5), value, predecode);
 	value = SETFIELD(PPC_BITMASK(8, 39), value, opcode);
@@ -361,13 +390,14 @@ out:
 		}
 	}
 
-	if (!rc)
+	if (!rc && (flags & RAM_SCRATCH_OUT))
 		CHECK_ERR(thread_read(thread, P9_SCR0_REG, scratch));
 
 	return rc;
 }
 
-static int p9_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *scratch)
+static int p9_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *scratch,
+			      unsigned int flags)
 {
 	if ((opcode & OPCODE_MASK) == LD_OPCODE) {
 		printf("RAM LSU opcodes are disabled for POWER9 because exceptions will checkstop. Use ADU instead.\n");
@@ -380,11 +410,11 @@ static int p9_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *
 		 * A fault should still be returned though. Unfortunately
 		 * any load fault seems to be a checkstop.
 		 */
-		int rc = __p9_ram_instruction(thread, opcode, scratch);
+		int rc = __p9_ram_instruction(thread, opcode, scratch, flags);
 		if (rc)
 			return rc;
 	}
-	return __p9_ram_instruction(thread, opcode, scratch);
+	return __p9_ram_instruction(thread, opcode, scratch, flags);
 }
 
 static int p9_ram_destroy(struct thread *thread)
@@ -518,6 +548,7 @@ static struct core p9_core = {
 		.probe = p9_core_probe,
 		.release = p9_core_release,
 	},
+	.thread_states = p9_core_thread_states,
 };
 DECLARE_HW_UNIT(p9_core);
 
@@ -0,0 +1,686 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libsbefifo/libsbefifo.h>
+
+#include "hwunit.h"
+#include "hash.h"
+#include "record.h"
+#include "trace.h"
+#include "debug.h"
+
+/* Ids of targets missing from the recording being replayed */
+#define REPLAY_TARGET_NONE	UINT32_MAX
+
+#define RECORD_BUFFER_SIZE	(1024 * 1024)
+
+bool record_enabled;
+bool replay_enabled;
+
+static FILE *record_file;
+static uint32_t record_num_targets;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Recorded accesses with the same target, op and address, in order */
+struct replay_key {
+	struct replay_key *hash_next;
+	uint32_t target;
+	uint16_t op;
+	uint64_t addr;
+	uint32_t *accesses;
+	uint32_t count;
+	uint32_t alloc;
+	uint32_t next;
+};
+
+struct replay_access {
+	struct record_entry entry;
+	const uint8_t *payload;
+};
+
+static struct {
+	uint8_t *buf;
+	struct replay_access *accesses;
+	uint32_t num_accesses;
+	char **targets;
+	uint32_t num_targets;
+	struct replay_key **hash;
+	uint32_t hash_size;
+	bool timed;
+	uint64_t served;
+	uint64_t missing;
+	uint64_t mismatches;
+	uint64_t recorded_ns;
+} replay;
+
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool record_backend_target(struct pdbg_target *target)
+{
+	return target->fdt && pdbg_fdt_is_backend(target->fdt);
+}
+
+/* sbefifo transfers are recorded and replayed keyed on their request */
+uint64_t record_sbefifo_hash(const uint8_t *msg, uint32_t msg_len)
+{
+	return hash_fnv1a(HASH_FNV1A_INIT, msg, msg_len);
+}
+
+/* Call with record_lock held */
+static int record_write(const struct record_entry *entry, const void *payload)
+{
+	if (fwrite(entry, sizeof(*entry), 1, record_file) != 1)
+		return -1;
+
+	if (entry->len && fwrite(payload, entry->len, 1, record_file) != 1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Targets have their trace id, introduce any ids not in the recording
+ * yet so they stay in order.  Call with record_lock held.
+ */
+static uint32_t record_target_id(struct pdbg_target *target)
+{
+	struct record_entry entry;
+	const char *path;
+	uint32_t id;
+
+	id = trace_target_id(target);
+	while (record_num_targets < id) {
+		path = trace_target_path(record_num_targets + 1);
+		entry = (struct record_entry) {
+			.access = {
+				.target = record_num_targets + 1,
+				.op = ACCESS_TARGET,
+			},
+			.len = strlen(path),
+		};
+
+		if (record_write(&entry, path))
+			return 0;
+
+		record_num_targets++;
+	}
+
+	return id;
+}
+
+void record_access(enum access_op op, struct pdbg_target *target,
+		   uint64_t addr, uint64_t data, const void *buf,
+		   uint32_t len, int rc, uint64_t start)
+{
+	struct record_entry entry;
+	uint64_t duration = trace_now() - start;
+
+	pthread_mutex_lock(&record_lock);
+	if (!record_file)
+		goto out;
+
+	entry = (struct record_entry) {
+		.access = {
+			.time_ns = start,
+			.addr = addr,
+			.data = data,
+			.duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration,
+			.rc = rc,
+			.target = record_target_id(target),
+			.op = op,
+		},
+		.len = buf ? len : 0,
+	};
+
+	if (entry.access.target && record_write(&entry, buf)) {
+		PR_ERROR("Unable to write the recording, stopped recording\n");
+		__atomic_store_n(&record_enabled, false, __ATOMIC_RELEASE);
+	}
+
+out:
+	pthread_mutex_unlock(&record_lock);
+}
+
+static bool record_write_header(const char *option)
+{
+	struct record_header hdr;
+
+	hdr = (struct record_header) {
+		.magic = RECORD_MAGIC,
+		.version = RECORD_VERSION,
+		.entry_size = sizeof(struct record_entry),
+		.backend = pdbg_get_backend(),
+		.proc = pdbg_get_proc(),
+		.option_len = option ? strlen(option) : 0,
+	};
+
+	if (fwrite(&hdr, sizeof(hdr), 1, record_file) != 1)
+		return false;
+
+	if (hdr.option_len && fwrite(option, hdr.option_len, 1, record_file) != 1)
+		return false;
+
+	return true;
+}
+
+static void record_atexit(void)
+{
+	pdbg_record_stop();
+}
+
+bool pdbg_record_start(const char *path)
+{
+	static bool started;
+
+	if (replay_enabled) {
+		PR_ERROR("Cannot record accesses which are replayed\n");
+		return false;
+	}
+
+	/* Target ids are not reset, so there is one recording per process */
+	if (started) {
+		PR_ERROR("Accesses can only be recorded once\n");
+		return false;
+	}
+
+	record_file = fopen(path, "w");
+	if (!record_file) {
+		PR_ERROR("Unable to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	setvbuf(record_file, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+
+	/* The backend option must not change after this */
+	if (!record_write_header(pdbg_get_backend_option())) {
+		PR_ERROR("Unable to write %s\n", path);
+		fclose(record_file);
+		record_file = NULL;
+		return false;
+	}
+
+	started = true;
+	atexit(record_atexit);
+
+	PR_INFO("Recording backend accesses to %s\n", path);
+	__atomic_store_n(&record_enabled, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+void pdbg_record_stop(void)
+{
+	__atomic_store_n(&record_enabled, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&record_lock);
+	if (record_file) {
+		/* The backend and processor are only known once targets exist */
+		if (fseek(record_file, 0, SEEK_SET) ||
+		    !record_write_header(pdbg_get_backend_option()))
+			PR_ERROR("Unable to update the recording header\n");
+
+		if (fclose(record_file))
+			PR_ERROR("Unable to write the recording\n");
+		record_file = NULL;
+	}
+	pthread_mutex_unlock(&record_lock);
+}
+
+static struct replay_key **replay_key_slot(uint32_t target, uint16_t op, uint64_t addr)
+{
+	struct replay_key **slot;
+	uint64_t hash;
+
+	hash = hash_fnv1a(HASH_FNV1A_INIT, &target, sizeof(target));
+	hash = hash_fnv1a(hash, &op, sizeof(op));
+	hash = hash_fnv1a(hash, &addr, sizeof(addr));
+
+	slot = &replay.hash[hash & (replay.hash_size - 1)];
+	for (; *slot; slot = &(*slot)->hash_next)
+		if ((*slot)->target == target && (*slot)->op == op &&
+		    (*slot)->addr == addr)
+			break;
+
+	return slot;
+}
+
+static bool replay_add(uint32_t index)
+{
+	struct record_entry *entry = &replay.accesses[index].entry;
+	struct replay_key **slot, *key;
+
+	slot = replay_key_slot(entry->access.target, entry->access.op, entry->access.addr);
+	key = *slot;
+	if (!key) {
+		key = calloc(1, sizeof(*key));
+		if (!key)
+			return false;
+
+		key->target = entry->access.target;
+		key->op = entry->access.op;
+		key->addr = entry->access.addr;
+		*slot = key;
+	}
+
+	if (key->count == key->alloc) {
+		key->alloc = key->alloc ? key->alloc * 2 : 4;
+		key->accesses = realloc(key->accesses, key->alloc * sizeof(*key->accesses));
+		if (!key->accesses)
+			return false;
+	}
+
+	key->accesses[key->count++] = index;
+	return true;
+}
+
+static uint32_t replay_find_target(const char *path, size_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < replay.num_targets; i++)
+		if (strlen(replay.targets[i]) == len &&
+		    !memcmp(replay.targets[i], path, len))
+			return i + 1;
+
+	return REPLAY_TARGET_NONE;
+}
+
+/*
+ * Split the recording into accesses, keyed on the id of the path of
+ * their target in the replay.
+ */
+static bool replay_parse(const uint8_t *data, size_t size, const char *path)
+{
+	struct record_entry entry;
+	uint32_t *ids = NULL, num_ids = 0, i;
+	size_t offset = 0;
+	const uint8_t *payload;
+
+	while (offset + sizeof(entry) <= size) {
+		memcpy(&entry, data + offset, sizeof(entry));
+		offset += sizeof(entry);
+
+		payload = data + offset;
+		if (entry.len > size - offset)
+			break;
+		offset += entry.len;
+
+		if (entry.access.op == ACCESS_TARGET) {
+			if (entry.access.target != num_ids + 1)
+				goto fail;
+
+			ids = realloc(ids, (num_ids + 1) * sizeof(*ids));
+			if (!ids)
+				goto fail;
+
+			ids[num_ids] = replay_find_target((const char *)payload, entry.len);
+			if (ids[num_ids] == REPLAY_TARGET_NONE) {
+				replay.targets = realloc(replay.targets,
+							 (replay.num_targets + 1) * sizeof(char *));
+				if (!replay.targets)
+					goto fail;
+
+				replay.targets[replay.num_targets] = strndup((const char *)payload, entry.len);
+				ids[num_ids] = ++replay.num_targets;
+			}
+			num_ids++;
+			continue;
+		}
+
+		if (!entry.access.target || entry.access.target > num_ids ||
+		    entry.access.op >= ACCESS_OP_MAX)
+			goto fail;
+
+		entry.access.target = ids[entry.access.target - 1];
+
+		if (!(replay.num_accesses & (replay.num_accesses + 1))) {
+			replay.accesses = realloc(replay.accesses,
+						  (replay.num_accesses + 1) * 2 * sizeof(*replay.accesses));
+			if (!replay.accesses)
+				goto fail;
+		}
+
+		replay.accesses[replay.num_accesses++] = (struct replay_access) {
+			.entry = entry,
+			.payload = payload,
+		};
+	}
+
+	if (offset != size)
+		PR_WARNING("Ignoring a truncated access at the end of %s\n", path);
+
+	for (replay.hash_size = 64; replay.hash_size < replay.num_accesses; replay.hash_size <<= 1)
+		;
+
+	replay.hash = calloc(replay.hash_size, sizeof(*replay.hash));
+	if (!replay.hash)
+		goto fail;
+
+	for (i = 0; i < replay.num_accesses; i++)
+		if (!replay_add(i))
+			goto fail;
+
+	free(ids);
+	return true;
+
+fail:
+	PR_ERROR("Invalid recording %s\n", path);
+	free(ids);
+	return false;
+}
+
+static const char *replay_proc_option(uint32_t proc)
+{
+	switch (proc) {
+	case PDBG_PROC_P8:
+		return "p8";
+
+	case PDBG_PROC_P9:
+		return "p9";
+
+	case PDBG_PROC_P10:
+		return "p10";
+
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Replaying needs the backend which was recorded, set it unless the
+ * caller already chose one.  Without an option most backends look at the
+ * hardware to work out the processor, so use the recorded one.
+ */
+static void replay_set_backend(struct record_header *hdr, const uint8_t *option)
+{
+	const char *backend_option = NULL;
+
+	if (pdbg_get_backend() != PDBG_DEFAULT_BACKEND) {
+		if (pdbg_get_backend() != hdr->backend)
+			PR_WARNING("Replaying accesses recorded with a different backend\n");
+		return;
+	}
+
+	if (hdr->option_len)
+		backend_option = strndup((const char *)option, hdr->option_len);
+	else if (hdr->backend != PDBG_BACKEND_FAKE)
+		backend_option = replay_proc_option(hdr->proc);
+
+	pdbg_set_backend(hdr->backend, backend_option);
+}
+
+static void replay_atexit(void)
+{
+	if (!replay.served && !replay.missing)
+		return;
+
+	PR_INFO("Replayed %" PRIu64 " accesses, %" PRIu64 " missing, %" PRIu64
+		" mismatched, %" PRIu64 " us of recorded hardware time\n",
+		replay.served, replay.missing, replay.mismatches,
+		replay.recorded_ns / 1000);
+}
+
+bool pdbg_replay_start(const char *path, bool timed)
+{
+	struct record_header hdr;
+	FILE *file;
+	long size;
+
+	if (replay_enabled || record_enabled) {
+		PR_ERROR("Accesses are already recorded or replayed\n");
+		return false;
+	}
+
+	if (pdbg_target_root()) {
+		PR_ERROR("pdbg_replay_start() must be called before pdbg_targets_init()\n");
+		return false;
+	}
+
+	file = fopen(path, "r");
+	if (!file) {
+		PR_ERROR("Unable to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 ||
+	    fseek(file, 0, SEEK_SET))
+		goto fail_close;
+
+	replay.buf = malloc(size);
+	if (!replay.buf || fread(replay.buf, 1, size, file) != (size_t)size)
+		goto fail_close;
+
+	fclose(file);
+
+	if ((size_t)size < sizeof(hdr))
+		goto fail_format;
+
+	memcpy(&hdr, replay.buf, sizeof(hdr));
+	if (hdr.magic != RECORD_MAGIC || hdr.version != RECORD_VERSION ||
+	    hdr.entry_size != sizeof(struct record_entry) ||
+	    hdr.option_len > size - sizeof(hdr))
+		goto fail_format;
+
+	if (!replay_parse(replay.buf + sizeof(hdr) + hdr.option_len,
+			  size - sizeof(hdr) - hdr.option_len, path)) {
+		free(replay.buf);
+		replay.buf = NULL;
+		return false;
+	}
+
+	replay_set_backend(&hdr, replay.buf + sizeof(hdr));
+	replay.timed = timed;
+	atexit(replay_atexit);
+
+	PR_INFO("Replaying %u accesses from %s%s\n", replay.num_accesses, path,
+		timed ? " with recorded timing" : "");
+	__atomic_store_n(&replay_enabled, true, __ATOMIC_RELEASE);
+	return true;
+
+fail_format:
+	PR_ERROR("%s is not a recording of this version of libpdbg\n", path);
+	free(replay.buf);
+	replay.buf = NULL;
+	return false;
+
+fail_close:
+	PR_ERROR("Unable to read %s\n", path);
+	fclose(file);
+	free(replay.buf);
+	replay.buf = NULL;
+	return false;
+}
+
+static uint32_t replay_target_id(struct pdbg_target *target)
+{
+	const char *path;
+	uint32_t id;
+
+	id = __atomic_load_n(&target->replay_id, __ATOMIC_ACQUIRE);
+	if (id)
+		return id;
+
+	path = pdbg_target_path(target);
+	id = replay_find_target(path, strlen(path));
+	__atomic_store_n(&target->replay_id, id, __ATOMIC_RELEASE);
+
+	return id;
+}
+
+/* Returns the next recorded access, NULL if there are no more */
+static struct replay_access *replay_next(enum access_op op,
+					 struct pdbg_target *target,
+					 uint64_t addr)
+{
+	struct replay_access *access = NULL;
+	struct replay_key *key;
+	uint32_t id;
+
+	id = replay_target_id(target);
+
+	pthread_mutex_lock(&replay_lock);
+	if (id != REPLAY_TARGET_NONE) {
+		key = *replay_key_slot(id, op, addr);
+		if (key && key->next < key->count)
+			access = &replay.accesses[key->accesses[key->next++]];
+	}
+
+	if (access) {
+		replay.served++;
+		replay.recorded_ns += access->entry.access.duration_ns;
+	} else if (op != ACCESS_PROBE) {
+		replay.missing++;
+	}
+	pthread_mutex_unlock(&replay_lock);
+
+	if (!access && op != ACCESS_PROBE)
+		PR_ERROR("No recorded access left for op %d to 0x%016" PRIx64 " on %s\n",
+			 op, addr, pdbg_target_path(target));
+
+	return access;
+}
+
+static void replay_mismatch(struct replay_access *access,
+			    struct pdbg_target *target)
+{
+	__atomic_add_fetch(&replay.mismatches, 1, __ATOMIC_RELAXED);
+	PR_WARNING("Replayed op %d to 0x%016" PRIx64 " on %s differs from the recording\n",
+		   access->entry.access.op, access->entry.access.addr, pdbg_target_path(target));
+}
+
+/* Take at least as long as the recorded access did */
+static void replay_wait(struct replay_access *access, uint64_t start)
+{
+	uint64_t end = start + access->entry.access.duration_ns;
+	struct timespec ts = {
+		.tv_sec = end / 1000000000,
+		.tv_nsec = end % 1000000000,
+	};
+
+	if (!replay.timed)
+		return;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/*
+ * Serve an access from the recording.  Reads return the recorded data in
+ * *data or buf, writes are checked against the recording.
+ */
+int replay_access(enum access_op op, struct pdbg_target *target,
+		  uint64_t addr, uint64_t *data, void *buf, uint32_t len)
+{
+	struct replay_access *access;
+	uint64_t start = replay.timed ? trace_now() : 0;
+
+	access = replay_next(op, target, addr);
+	if (!access)
+		return -1;
+
+	switch (op) {
+	case ACCESS_PIB_READ:
+	case ACCESS_FSI_READ:
+	case ACCESS_OPB_READ:
+	case ACCESS_OCMB_READ:
+		*data = access->entry.access.data;
+		break;
+
+	case ACCESS_MEM_READ:
+		if (access->entry.len != len) {
+			replay_mismatch(access, target);
+			return -1;
+		}
+		memcpy(buf, access->payload, len);
+		break;
+
+	default:
+		if (access->entry.access.data != *data)
+			replay_mismatch(access, target);
+		break;
+	}
+
+	replay_wait(access, start);
+	return access->entry.access.rc;
+}
+
+static int replay_sbefifo_transport(uint8_t *msg, uint32_t msg_len,
+				    uint8_t *out, uint32_t *out_len,
+				    void *priv)
+{
+	struct pdbg_target *target = priv;
+	struct replay_access *access;
+	uint64_t start = replay.timed ? trace_now() : 0;
+
+	access = replay_next(ACCESS_SBEFIFO, target, record_sbefifo_hash(msg, msg_len));
+	if (!access)
+		return EIO;
+
+	if (access->entry.len > *out_len) {
+		replay_mismatch(access, target);
+		return EMSGSIZE;
+	}
+
+	memcpy(out, access->payload, access->entry.len);
+	*out_len = access->entry.len;
+
+	replay_wait(access, start);
+	return access->entry.access.rc;
+}
+
+/*
+ * Backend targets are not probed, a target only exists if its probe
+ * succeeded in the recording.  An sbefifo gets a context which serves
+ * its operations from the recording.
+ */
+int replay_probe(struct pdbg_target *target)
+{
+	struct replay_access *access;
+	struct sbefifo *sf;
+	int proc;
+
+	access = replay_next(ACCESS_PROBE, target, 0);
+	if (!access)
+		return -1;
+
+	if (access->entry.access.rc || !pdbg_target_is_class(target, "sbefifo"))
+		return access->entry.access.rc;
+
+	proc = pdbg_get_proc() == PDBG_PROC_P10 ? SBEFIFO_PROC_P10 : SBEFIFO_PROC_P9;
+
+	sf = target_to_sbefifo(target);
+	if (sbefifo_connect_transport(proc, replay_sbefifo_transport, target, &sf->sf_ctx))
+		return -1;
+
+	sbefifo_set_trace(sf->sf_ctx, access_sbefifo, target);
+	return 0;
+}
+
+void replay_stats(struct pdbg_stats *stats)
+{
+	pthread_mutex_lock(&replay_lock);
+	stats->replay_accesses = replay.served;
+	stats->replay_missing = replay.missing;
+	stats->replay_mismatches = __atomic_load_n(&replay.mismatches, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&replay_lock);
+}
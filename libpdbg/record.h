@@ -0,0 +1,84 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __LIBPDBG_RECORD_H
+#define __LIBPDBG_RECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "trace.h"
+
+/*
+ * Recording of backend accesses, see pdbg_record_start() and
+ * pdbg_replay_start().  Only the outermost access is recorded, replaying
+ * it never makes the accesses a backend implements it with.
+ *
+ * A recording is written in the byte order of the host which made it and
+ * contains a struct record_header followed by option_len bytes of backend
+ * option, then a stream of struct record_entry each followed by len bytes
+ * of payload.  An ACCESS_TARGET entry gives the path of the target id it
+ * introduces as its payload, before the first access to that target.  A
+ * mem read has the data read as its payload, an sbefifo transfer the raw
+ * reply.
+ */
+#define RECORD_MAGIC	0x5044424752454300ULL	/* "PDBGREC" */
+#define RECORD_VERSION	3
+
+struct record_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t backend;
+	uint32_t proc;
+	uint32_t option_len;
+	uint32_t reserved;
+};
+
+struct record_entry {
+	struct trace_entry access;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct pdbg_target;
+struct pdbg_stats;
+
+/* Set while accesses are recorded or replayed */
+extern bool record_enabled;
+extern bool replay_enabled;
+
+void record_access(enum access_op op, struct pdbg_target *target,
+		   uint64_t addr, uint64_t data, const void *buf,
+		   uint32_t len, int rc, uint64_t start);
+int replay_access(enum access_op op, struct pdbg_target *target,
+		  uint64_t addr, uint64_t *data, void *buf, uint32_t len);
+uint64_t record_sbefifo_hash(const uint8_t *msg, uint32_t msg_len);
+
+static inline bool replay_active(void)
+{
+	return __builtin_expect(replay_enabled, 0);
+}
+
+/*
+ * Targets of the backend device tree talk to the hardware from their
+ * probe and release, those are recorded and replayed too.
+ */
+bool record_backend_target(struct pdbg_target *target);
+int replay_probe(struct pdbg_target *target);
+
+void replay_stats(struct pdbg_stats *stats);
+
+#endif
@@ -196,8 +196,6 @@ int sbe_dump(struct pdbg_target *target, uint8_t type, uint8_t clock, uint8_t fa
 int sbe_ffdc_get(struct pdbg_target *target, uint32_t *status, uint8_t **ffdc, uint32_t *ffdc_len)
 {
 	struct chipop *chipop;
-	const uint8_t *data = NULL;
-	uint32_t len = 0;
 
 	chipop = pib_to_chipop(target);
 	if (!chipop)
@@ -208,16 +206,7 @@ int sbe_ffdc_get(struct pdbg_target *target, uint32_t *status, uint8_t **ffdc, u
 		return -1;
 	}
 
-	*status = chipop->ffdc_get(chipop, &data, &len);
-	if (data && len > 0) {
-		*ffdc = malloc(len);
-		assert(*ffdc);
-		memcpy(*ffdc, data, len);
-		*ffdc_len = len;
-	} else {
-		*ffdc = NULL;
-		*ffdc_len = 0;
-	}
+	*status = chipop->ffdc_get(chipop, ffdc, ffdc_len);
 
 	return 0;
 }
@@ -166,7 +166,7 @@ static int sbefifo_op_putmem_pba(struct mem *sbefifo_mem,
 	return 0;
 }
 
-static uint32_t sbefifo_op_ffdc_get(struct chipop *chipop, const uint8_t **ffdc, uint32_t *ffdc_len)
+static uint32_t sbefifo_op_ffdc_get(struct chipop *chipop, uint8_t **ffdc, uint32_t *ffdc_len)
 {
 	struct pdbg_target *fsi = pdbg_target_require_parent("fsi", &chipop->target);
 	struct sbefifo *sbefifo = target_to_sbefifo(chipop->target.parent);
@@ -174,10 +174,12 @@ static uint32_t sbefifo_op_ffdc_get(struct chipop *chipop, const uint8_t **ffdc,
 	uint32_t status, value = 0;
 	int rc;
 
-	status = sbefifo_ffdc_get(sctx, ffdc, ffdc_len);
+	status = sbefifo_ffdc_copy(sctx, ffdc, ffdc_len);
 	if (status)
 		return status;
 
+	free(*ffdc);
+
 	/* Check if async FFDC is set */
 	rc = fsi_read(fsi, SBE_MSG_REG, &value);
 	if (rc) {
@@ -187,7 +189,7 @@ static uint32_t sbefifo_op_ffdc_get(struct chipop *chipop, const uint8_t **ffdc,
 
 	if ((value & SBE_MSG_ASYNC_FFDC) == SBE_MSG_ASYNC_FFDC) {
 		sbefifo_get_ffdc(sbefifo->sf_ctx);
-		return sbefifo_ffdc_get(sctx, ffdc, ffdc_len);
+		return sbefifo_ffdc_copy(sctx, ffdc, ffdc_len);
 	}
 
 end:
@@ -334,8 +336,10 @@ static int sbefifo_pib_thread_step(struct pib *pib, int count)
 {
 	int i, rc = 0;
 
-	for (i = 0; i < count; i++)
+	for (i = 0; i < count; i++) {
 		rc |= sbefifo_pib_thread_op(pib, SBEFIFO_INSN_OP_STEP);
+		pdbg_progress_tick(i + 1, count);
+	}
 
 	return rc;
 }
@@ -370,7 +374,7 @@ static int sbefifo_thread_probe(struct pdbg_target *target)
 	struct thread *thread = target_to_thread(target);
 
 	thread->id = pdbg_target_index(target);
-	thread->status = thread->state(thread);
+	thread->status = core_thread_state(thread);
 
 	return 0;
 }
@@ -455,8 +459,10 @@ static int sbefifo_thread_step(struct thread *thread, int count)
 	if (!(thread->status.active))
 		return 1;
 
-	for (i = 0; i < count; i++)
+	for (i = 0; i < count; i++) {
 		rc |= sbefifo_thread_op(thread, SBEFIFO_INSN_OP_STEP);
+		pdbg_progress_tick(i + 1, count);
+	}
 
 	return rc;
 }
@@ -790,6 +796,8 @@ static int sbefifo_probe(struct pdbg_target *target)
 		return rc;
 	}
 
+	sbefifo_set_trace(sf->sf_ctx, access_sbefifo, target);
+
 	return 0;
 }
 
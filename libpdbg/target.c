@@ -3,6 +3,9 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
 #include <ccan/list/list.h>
 #include <libfdt.h>
 
@@ -10,18 +13,61 @@
 #include "hwunit.h"
 #include "operations.h"
 #include "debug.h"
+#include "arena.h"
+#include "hash.h"
+#include "trace.h"
+#include "record.h"
 
 struct list_head empty_list = LIST_HEAD_INIT(empty_list);
 struct list_head target_classes = LIST_HEAD_INIT(target_classes);
 
+/* Bumped on every change to the tree shape, invalidates target indexes */
+unsigned int target_tree_generation = 1;
+
+#define TARGET_CLASS_HASH_SIZE 128
+
+static struct pdbg_target_class *target_class_hash[TARGET_CLASS_HASH_SIZE];
+
+static pthread_once_t target_lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutexattr_t target_lock_attr;
+static pthread_mutex_t target_tree_mutex;
+
+/* Threads target_run_per_proc() may use, see pdbg_set_probe_threads() */
+static unsigned int probe_threads = 1;
+
+static void target_lock_setup(void)
+{
+	pthread_mutexattr_init(&target_lock_attr);
+	pthread_mutexattr_settype(&target_lock_attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&target_tree_mutex, &target_lock_attr);
+}
+
+void target_tree_lock(void)
+{
+	pthread_once(&target_lock_once, target_lock_setup);
+	pthread_mutex_lock(&target_tree_mutex);
+}
+
+void target_tree_unlock(void)
+{
+	pthread_mutex_unlock(&target_tree_mutex);
+}
+
+void target_lock_init(struct pdbg_target *target)
+{
+	pthread_once(&target_lock_once, target_lock_setup);
+	pthread_mutex_init(&target->lock, &target_lock_attr);
+}
+
 /* Work out the address to access based on the current target and
  * final class name */
 static struct pdbg_target *get_class_target_addr(struct pdbg_target *target, const char *name, uint64_t *addr)
 {
+	struct pdbg_target_class *target_class = require_target_class(name);
 	uint64_t old_addr = *addr;
 
 	/* Check class */
-	while (strcmp(target->class, name)) {
+	while (target->target_class != target_class) {
 		if (target->translate) {
 			*addr = target->translate(target, *addr);
 			target = target_parent(name, target, false);
@@ -39,8 +85,8 @@ static struct pdbg_target *get_class_target_addr(struct pdbg_target *target, con
 		assert(target != pdbg_target_root());
 	}
 
-	pdbg_log(PDBG_DEBUG, "Translating target addr 0x%" PRIx64 " -> 0x%" PRIx64 " on %s\n",
-		 old_addr, *addr, pdbg_target_path(target));
+	PR_LOG(PDBG_DEBUG, "Translating target addr 0x%" PRIx64 " -> 0x%" PRIx64 " on %s\n",
+	       old_addr, *addr, pdbg_target_path(target));
 	return target;
 }
 
@@ -49,6 +95,81 @@ struct pdbg_target *pdbg_address_absolute(struct pdbg_target *target, uint64_t *
 	return get_class_target_addr(target, "pib", addr);
 }
 
+/*
+ * Every hardware access below is traced, recorded and replayed through
+ * access_start() and access_end().  Backends implement some accesses with
+ * others, fsi2pib reads a SCOM with fsi_read() and fsi_write(), and only
+ * the outermost access is recorded as replaying it never makes the
+ * accesses it is implemented with.
+ */
+struct access {
+	enum access_op op;
+	struct pdbg_target *target;
+	uint64_t addr;
+	uint64_t start;
+	bool outer;
+};
+
+static __thread unsigned int access_depth;
+
+/* Returns true if the access must be served from the replay */
+static bool access_start(struct access *access, enum access_op op,
+			 struct pdbg_target *target, uint64_t addr)
+{
+	*access = (struct access) {
+		.op = op,
+		.target = target,
+		.addr = addr,
+		.outer = access_depth++ == 0,
+	};
+
+	if (__builtin_expect(trace_enabled || (record_enabled && access->outer), 0))
+		access->start = trace_now();
+
+	return replay_active() && access->outer;
+}
+
+static int access_replay(struct access *access, uint64_t *data, void *buf, uint32_t len)
+{
+	return replay_access(access->op, access->target, access->addr, data, buf, len);
+}
+
+/* buf is the data read, if it is to be recorded */
+static void access_end(struct access *access, uint64_t data,
+		       const void *buf, uint32_t len, int rc)
+{
+	access_depth--;
+
+	if (__builtin_expect(!access->start, 1))
+		return;
+
+	if (trace_enabled)
+		trace_record(access->op, access->target, access->addr, data, rc, access->start);
+
+	if (record_enabled && access->outer)
+		record_access(access->op, access->target, access->addr, data,
+			      buf, len, rc, access->start);
+}
+
+/*
+ * Called by libsbefifo with every transfer.  Operations made by an
+ * access, an sbefifo pib reading a SCOM, are only traced.
+ */
+void access_sbefifo(const uint8_t *msg, uint32_t msg_len,
+		    const uint8_t *out, uint32_t out_len,
+		    int rc, uint64_t duration_ns, void *priv)
+{
+	uint64_t start = trace_now() - duration_ns;
+	uint32_t cmd = be32toh(*(uint32_t *)(msg + 4));
+
+	if (trace_enabled)
+		trace_record(ACCESS_SBEFIFO, priv, msg_len, cmd, rc, start);
+
+	if (record_enabled && !access_depth)
+		record_access(ACCESS_SBEFIFO, priv, record_sbefifo_hash(msg, msg_len),
+			      cmd, out, out_len, rc, start);
+}
+
 /* The indirect access code was largely stolen from hw/xscom.c in skiboot */
 #define PIB_IND_MAX_RETRIES 10
 #define PIB_IND_READ PPC_BIT(0)
@@ -126,14 +247,11 @@ static int pib_indirect_write(struct pib *pib, uint64_t addr, uint64_t data)
 	return 0;
 }
 
-int pib_read(struct pdbg_target *pib_dt, uint64_t addr, uint64_t *data)
+static int target_pib_read(struct pdbg_target *pib_dt, uint64_t target_addr, uint64_t *data)
 {
 	struct pib *pib;
-	uint64_t target_addr = addr;
 	int rc;
 
-	pib_dt = get_class_target_addr(pib_dt, "pib", &target_addr);
-
 	if (pdbg_target_status(pib_dt) != PDBG_TARGET_ENABLED)
 		return -1;
 
@@ -155,14 +273,30 @@ int pib_read(struct pdbg_target *pib_dt, uint64_t addr, uint64_t *data)
 	return rc;
 }
 
-int pib_write(struct pdbg_target *pib_dt, uint64_t addr, uint64_t data)
+int pib_read(struct pdbg_target *pib_dt, uint64_t addr, uint64_t *data)
 {
-	struct pib *pib;
+	struct access access;
 	uint64_t target_addr = addr;
 	int rc;
 
 	pib_dt = get_class_target_addr(pib_dt, "pib", &target_addr);
 
+	pthread_mutex_lock(&pib_dt->lock);
+	if (access_start(&access, ACCESS_PIB_READ, pib_dt, target_addr))
+		rc = access_replay(&access, data, NULL, 0);
+	else
+		rc = target_pib_read(pib_dt, target_addr, data);
+	access_end(&access, rc ? 0 : *data, NULL, 0, rc);
+	pthread_mutex_unlock(&pib_dt->lock);
+
+	return rc;
+}
+
+static int target_pib_write(struct pdbg_target *pib_dt, uint64_t target_addr, uint64_t data)
+{
+	struct pib *pib;
+	int rc;
+
 	if (pdbg_target_status(pib_dt) != PDBG_TARGET_ENABLED)
 		return -1;
 
@@ -186,23 +320,58 @@ int pib_write(struct pdbg_target *pib_dt, uint64_t addr, uint64_t data)
 	return rc;
 }
 
+int pib_write(struct pdbg_target *pib_dt, uint64_t addr, uint64_t data)
+{
+	struct access access;
+	uint64_t target_addr = addr;
+	int rc;
+
+	pib_dt = get_class_target_addr(pib_dt, "pib", &target_addr);
+
+	pthread_mutex_lock(&pib_dt->lock);
+	if (access_start(&access, ACCESS_PIB_WRITE, pib_dt, target_addr))
+		rc = access_replay(&access, &data, NULL, 0);
+	else
+		rc = target_pib_write(pib_dt, target_addr, data);
+	access_end(&access, data, NULL, 0, rc);
+	pthread_mutex_unlock(&pib_dt->lock);
+
+	return rc;
+}
+
 int pib_write_mask(struct pdbg_target *pib_dt, uint64_t addr, uint64_t data, uint64_t mask)
 {
+	struct access access;
+	uint64_t target_addr = addr;
 	uint64_t value;
 	int rc;
 
-	rc = pib_read(pib_dt, addr, &value);
-	if (rc)
-		return rc;
+	pib_dt = get_class_target_addr(pib_dt, "pib", &target_addr);
 
-	value = (value & ~mask) | (data & mask);
+	/* Nobody else may write the register between the read and write */
+	pthread_mutex_lock(&pib_dt->lock);
+	if (access_start(&access, ACCESS_PIB_READ, pib_dt, target_addr))
+		rc = access_replay(&access, &value, NULL, 0);
+	else
+		rc = target_pib_read(pib_dt, target_addr, &value);
+	access_end(&access, rc ? 0 : value, NULL, 0, rc);
+	if (!rc) {
+		value = (value & ~mask) | (data & mask);
+		if (access_start(&access, ACCESS_PIB_WRITE, pib_dt, target_addr))
+			rc = access_replay(&access, &value, NULL, 0);
+		else
+			rc = target_pib_write(pib_dt, target_addr, value);
+		access_end(&access, value, NULL, 0, rc);
+	}
+	pthread_mutex_unlock(&pib_dt->lock);
 
-	return pib_write(pib_dt, addr, value);
+	return rc;
 }
 
 /* Wait for a SCOM register addr to match value & mask == data */
 int pib_wait(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask, uint64_t data)
 {
+	struct access access;
 	struct pib *pib;
 	uint64_t tmp;
 	int rc;
@@ -219,11 +388,19 @@ int pib_wait(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask, uint64_t
 		return -1;
 	}
 
+	/* Others may use the pib between reads */
 	do {
-		if (addr & PPC_BIT(0))
+		pthread_mutex_lock(&pib_dt->lock);
+		if (access_start(&access, ACCESS_PIB_READ, pib_dt, addr))
+			rc = access_replay(&access, &tmp, NULL, 0);
+		else if (pdbg_target_status(pib_dt) != PDBG_TARGET_ENABLED)
+			rc = -1;
+		else if (addr & PPC_BIT(0))
 			rc = pib_indirect_read(pib, addr, &tmp);
 		else
 			rc = pib->read(pib, addr, &tmp);
+		access_end(&access, rc ? 0 : tmp, NULL, 0, rc);
+		pthread_mutex_unlock(&pib_dt->lock);
 		if (rc)
 			return rc;
 	} while ((tmp & mask) != data);
@@ -233,14 +410,13 @@ int pib_wait(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask, uint64_t
 
 int opb_read(struct pdbg_target *opb_dt, uint32_t addr, uint32_t *data)
 {
+	struct access access;
 	struct opb *opb;
 	uint64_t addr64 = addr;
+	uint64_t value;
+	int rc = -1;
 
 	opb_dt = get_class_target_addr(opb_dt, "opb", &addr64);
-
-	if (pdbg_target_status(opb_dt) != PDBG_TARGET_ENABLED)
-		return -1;
-
 	opb = target_to_opb(opb_dt);
 
 	if (!opb->read) {
@@ -248,33 +424,57 @@ int opb_read(struct pdbg_target *opb_dt, uint32_t addr, uint32_t *data)
 		return -1;
 	}
 
-	return opb->read(opb, addr64, data);
+	pthread_mutex_lock(&opb_dt->lock);
+	if (access_start(&access, ACCESS_OPB_READ, opb_dt, addr64)) {
+		rc = access_replay(&access, &value, NULL, 0);
+		*data = value;
+	} else if (pdbg_target_status(opb_dt) != PDBG_TARGET_ENABLED) {
+		rc = -1;
+	} else {
+		rc = opb->read(opb, addr64, data);
+	}
+	access_end(&access, rc ? 0 : *data, NULL, 0, rc);
+	pthread_mutex_unlock(&opb_dt->lock);
+
+	return rc;
 }
 
 int opb_write(struct pdbg_target *opb_dt, uint32_t addr, uint32_t data)
 {
+	struct access access;
 	struct opb *opb;
 	uint64_t addr64 = addr;
+	uint64_t value = data;
+	int rc = -1;
 
 	opb_dt = get_class_target_addr(opb_dt, "opb", &addr64);
-
-	if (pdbg_target_status(opb_dt) != PDBG_TARGET_ENABLED)
-		return -1;
-
 	opb = target_to_opb(opb_dt);
 
 	if (!opb->write) {
 		PR_ERROR("write() not implemented for the target\n");
 		return -1;
 	}
-	return opb->write(opb, addr64, data);
+
+	pthread_mutex_lock(&opb_dt->lock);
+	if (access_start(&access, ACCESS_OPB_WRITE, opb_dt, addr64))
+		rc = access_replay(&access, &value, NULL, 0);
+	else if (pdbg_target_status(opb_dt) != PDBG_TARGET_ENABLED)
+		rc = -1;
+	else
+		rc = opb->write(opb, addr64, data);
+	access_end(&access, data, NULL, 0, rc);
+	pthread_mutex_unlock(&opb_dt->lock);
+
+	return rc;
 }
 
 int fsi_read(struct pdbg_target *fsi_dt, uint32_t addr, uint32_t *data)
 {
+	struct access access;
 	struct fsi *fsi;
 	int rc;
 	uint64_t addr64 = addr;
+	uint64_t value;
 
 	fsi_dt = get_class_target_addr(fsi_dt, "fsi", &addr64);
 	fsi = target_to_fsi(fsi_dt);
@@ -284,7 +484,16 @@ int fsi_read(struct pdbg_target *fsi_dt, uint32_t addr, uint32_t *data)
 		return -1;
 	}
 
-	rc = fsi->read(fsi, addr64, data);
+	pthread_mutex_lock(&fsi_dt->lock);
+	if (access_start(&access, ACCESS_FSI_READ, fsi_dt, addr64)) {
+		rc = access_replay(&access, &value, NULL, 0);
+		*data = value;
+	} else {
+		rc = fsi->read(fsi, addr64, data);
+	}
+	access_end(&access, rc ? 0 : *data, NULL, 0, rc);
+	pthread_mutex_unlock(&fsi_dt->lock);
+
 	PR_DEBUG("rc = %d, addr = 0x%05" PRIx64 ", data = 0x%08" PRIx32 ", target = %s\n",
 		 rc, addr64, *data, pdbg_target_path(&fsi->target));
 	return rc;
@@ -292,9 +501,11 @@ int fsi_read(struct pdbg_target *fsi_dt, uint32_t addr, uint32_t *data)
 
 int fsi_write(struct pdbg_target *fsi_dt, uint32_t addr, uint32_t data)
 {
+	struct access access;
 	struct fsi *fsi;
 	int rc;
 	uint64_t addr64 = addr;
+	uint64_t value = data;
 
 	fsi_dt = get_class_target_addr(fsi_dt, "fsi", &addr64);
 	fsi = target_to_fsi(fsi_dt);
@@ -304,7 +515,14 @@ int fsi_write(struct pdbg_target *fsi_dt, uint32_t addr, uint32_t data)
 		return -1;
 	}
 
-	rc = fsi->write(fsi, addr64, data);
+	pthread_mutex_lock(&fsi_dt->lock);
+	if (access_start(&access, ACCESS_FSI_WRITE, fsi_dt, addr64))
+		rc = access_replay(&access, &value, NULL, 0);
+	else
+		rc = fsi->write(fsi, addr64, data);
+	access_end(&access, data, NULL, 0, rc);
+	pthread_mutex_unlock(&fsi_dt->lock);
+
 	PR_DEBUG("rc = %d, addr = 0x%05" PRIx64 ", data = 0x%08" PRIx32 ", target = %s\n",
 		 rc, addr64, data, pdbg_target_path(&fsi->target));
 	return rc;
@@ -312,28 +530,33 @@ int fsi_write(struct pdbg_target *fsi_dt, uint32_t addr, uint32_t data)
 
 int fsi_write_mask(struct pdbg_target *fsi_dt, uint32_t addr, uint32_t data, uint32_t mask)
 {
+	struct pdbg_target *target;
+	uint64_t addr64 = addr;
 	uint32_t value;
 	int rc;
 
-	rc = fsi_read(fsi_dt, addr, &value);
-	if (rc)
-		return rc;
+	/* The lock is recursive, hold it over the read and write */
+	target = get_class_target_addr(fsi_dt, "fsi", &addr64);
+	pthread_mutex_lock(&target->lock);
 
-	value = (value & ~mask) | (data & mask);
+	rc = fsi_read(fsi_dt, addr, &value);
+	if (!rc) {
+		value = (value & ~mask) | (data & mask);
+		rc = fsi_write(fsi_dt, addr, value);
+	}
 
-	return fsi_write(fsi_dt, addr, value);
+	pthread_mutex_unlock(&target->lock);
+	return rc;
 }
 
 int mem_read(struct pdbg_target *target, uint64_t addr, uint8_t *output, uint64_t size, uint8_t block_size, bool ci)
 {
+	struct access access;
 	struct mem *mem;
 	int rc = -1;
 
 	assert(pdbg_target_is_class(target, "mem"));
 
-	if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
-		return -1;
-
 	mem = target_to_mem(target);
 
 	if (!mem->read) {
@@ -341,21 +564,27 @@ int mem_read(struct pdbg_target *target, uint64_t addr, uint8_t *output, uint64_
 		return -1;
 	}
 
-	rc = mem->read(mem, addr, output, size, block_size, ci);
+	pthread_mutex_lock(&target->lock);
+	if (access_start(&access, ACCESS_MEM_READ, target, addr))
+		rc = access_replay(&access, &size, output, size);
+	else if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+		rc = -1;
+	else
+		rc = mem->read(mem, addr, output, size, block_size, ci);
+	access_end(&access, size, rc ? NULL : output, size, rc);
+	pthread_mutex_unlock(&target->lock);
 
 	return rc;
 }
 
 int mem_write(struct pdbg_target *target, uint64_t addr, uint8_t *input, uint64_t size, uint8_t block_size, bool ci)
 {
+	struct access access;
 	struct mem *mem;
 	int rc = -1;
 
 	assert(pdbg_target_is_class(target, "mem"));
 
-	if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
-		return -1;
-
 	mem = target_to_mem(target);
 
 	if (!mem->write) {
@@ -363,20 +592,27 @@ int mem_write(struct pdbg_target *target, uint64_t addr, uint8_t *input, uint64_
 		return -1;
 	}
 
-	rc = mem->write(mem, addr, input, size, block_size, ci);
+	pthread_mutex_lock(&target->lock);
+	if (access_start(&access, ACCESS_MEM_WRITE, target, addr))
+		rc = access_replay(&access, &size, NULL, 0);
+	else if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+		rc = -1;
+	else
+		rc = mem->write(mem, addr, input, size, block_size, ci);
+	access_end(&access, size, NULL, 0, rc);
+	pthread_mutex_unlock(&target->lock);
 
 	return rc;
 }
 
 int ocmb_getscom(struct pdbg_target *target, uint64_t addr, uint64_t *val)
 {
+	struct access access;
 	struct ocmb *ocmb;
+	int rc = -1;
 
 	assert(pdbg_target_is_class(target, "ocmb"));
 
-	if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
-		return -1;
-
 	ocmb = target_to_ocmb(target);
 
 	if (!ocmb->getscom) {
@@ -384,18 +620,27 @@ int ocmb_getscom(struct pdbg_target *target, uint64_t addr, uint64_t *val)
 		return -1;
 	}
 
-	return ocmb->getscom(ocmb, addr, val);
+	pthread_mutex_lock(&target->lock);
+	if (access_start(&access, ACCESS_OCMB_READ, target, addr))
+		rc = access_replay(&access, val, NULL, 0);
+	else if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+		rc = -1;
+	else
+		rc = ocmb->getscom(ocmb, addr, val);
+	access_end(&access, rc ? 0 : *val, NULL, 0, rc);
+	pthread_mutex_unlock(&target->lock);
+
+	return rc;
 }
 
 int ocmb_putscom(struct pdbg_target *target, uint64_t addr, uint64_t val)
 {
+	struct access access;
 	struct ocmb *ocmb;
+	int rc = -1;
 
 	assert(pdbg_target_is_class(target, "ocmb"));
 
-	if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
-		return -1;
-
 	ocmb = target_to_ocmb(target);
 
 	if (!ocmb->putscom) {
@@ -403,15 +648,31 @@ int ocmb_putscom(struct pdbg_target *target, uint64_t addr, uint64_t val)
 		return -1;
 	}
 
-	return ocmb->putscom(ocmb, addr, val);
+	pthread_mutex_lock(&target->lock);
+	if (access_start(&access, ACCESS_OCMB_WRITE, target, addr))
+		rc = access_replay(&access, &val, NULL, 0);
+	else if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+		rc = -1;
+	else
+		rc = ocmb->putscom(ocmb, addr, val);
+	access_end(&access, val, NULL, 0, rc);
+	pthread_mutex_unlock(&target->lock);
+
+	return rc;
+}
+
+static unsigned int target_class_hash_index(const char *name)
+{
+	return hash_fnv1a_str(HASH_FNV1A_INIT, name) % TARGET_CLASS_HASH_SIZE;
 }
 
 /* Finds the given class. Returns NULL if not found. */
 struct pdbg_target_class *find_target_class(const char *name)
 {
-	struct pdbg_target_class *target_class = NULL;
+	struct pdbg_target_class *target_class;
 
-	list_for_each(&target_classes, target_class, class_head_link)
+	target_class = target_class_hash[target_class_hash_index(name)];
+	for (; target_class; target_class = target_class->hash_next)
 		if (!strcmp(target_class->name, name))
 			return target_class;
 
@@ -425,6 +686,11 @@ struct pdbg_target_class *require_target_class(const char *name)
 	struct pdbg_target_class *target_class;
 
 	target_class = find_target_class(name);
+	if (!target_class && target_tree_partial) {
+		target_tree_expand();
+		target_class = find_target_class(name);
+	}
+
 	if (!target_class) {
 		PR_ERROR("Couldn't find class %s\n", name);
 		assert(0);
@@ -436,28 +702,94 @@ struct pdbg_target_class *require_target_class(const char *name)
 struct pdbg_target_class *get_target_class(struct pdbg_target *target)
 {
 	struct pdbg_target_class *target_class;
+	unsigned int index;
 
 	if ((target_class = find_target_class(target->class)))
 		return target_class;
 
 	/* Need to allocate a new class */
 	PR_DEBUG("Allocating %s target class\n", target->class);
-	target_class = calloc(1, sizeof(*target_class));
-	assert(target_class);
-	target_class->name = strdup(target->class);
+	target_class = arena_alloc(&target_arena, sizeof(*target_class));
+	target_class->name = arena_strdup(&target_arena, target->class);
 	list_head_init(&target_class->targets);
 	list_add_tail(&target_classes, &target_class->class_head_link);
+
+	index = target_class_hash_index(target_class->name);
+	target_class->hash_next = target_class_hash[index];
+	target_class_hash[index] = target_class;
+
 	return target_class;
 }
 
+/* Forget all the classes, their memory goes with the target arena */
+void target_classes_reset(void)
+{
+	list_head_init(&target_classes);
+	memset(target_class_hash, 0, sizeof(target_class_hash));
+	target_tree_generation++;
+}
+
+static uint64_t probe_elapsed_us(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000 +
+	       (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Backend targets talk to the hardware from their probe and release.  The
+ * probe is recorded and replayed as a whole, leaving out the accesses it
+ * makes, and the release is not replayed.
+ */
+static int target_probe_backend(struct pdbg_target *target)
+{
+	uint64_t start = 0;
+	int rc;
+
+	if (replay_active())
+		return replay_probe(target);
+
+	if (record_enabled)
+		start = trace_now();
+
+	access_depth++;
+	rc = target->probe(target);
+	access_depth--;
+
+	if (start)
+		record_access(ACCESS_PROBE, target, 0, 0, NULL, 0, rc, start);
+
+	return rc;
+}
+
+void target_release(struct pdbg_target *target)
+{
+	if (!target->release)
+		return;
+
+	if (!record_backend_target(target)) {
+		target->release(target);
+		return;
+	}
+
+	if (replay_active())
+		return;
+
+	access_depth++;
+	target->release(target);
+	access_depth--;
+}
+
 /* We walk the tree root down disabling targets which might/should
  * exist but don't */
-enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target)
+static enum pdbg_target_status target_probe(struct pdbg_target *target)
 {
 	struct pdbg_target *parent, *vnode;
 	enum pdbg_target_status status;
-
-	assert(target);
+	struct timespec start;
+	int rc;
 
 	status = pdbg_target_status(target);
 	assert(status != PDBG_TARGET_RELEASED);
@@ -477,7 +809,7 @@ enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target)
 		case PDBG_TARGET_NONEXISTENT:
 			/* The parent doesn't exist neither does it's
 			 * children */
-			target->status = PDBG_TARGET_NONEXISTENT;
+			target_status_store(target, PDBG_TARGET_NONEXISTENT);
 			return PDBG_TARGET_NONEXISTENT;
 
 		case PDBG_TARGET_DISABLED:
@@ -506,18 +838,56 @@ enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target)
 		pdbg_target_probe(vnode);
 
 	/* At this point any parents must exist and have already been probed */
-	if (target->probe && target->probe(target)) {
+	rc = 0;
+	if (target->probe) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (record_backend_target(target))
+			rc = target_probe_backend(target);
+		else
+			rc = target->probe(target);
+		target->probe_time_us = probe_elapsed_us(&start);
+		PR_DEBUG("Probed %s in %" PRIu64 " us\n",
+			 pdbg_target_path(target), target->probe_time_us);
+	}
+
+	if (rc) {
 		/* Could not find the target */
 		assert(pdbg_target_status(target) != PDBG_TARGET_MUSTEXIST);
-		target->status = PDBG_TARGET_NONEXISTENT;
+		target_status_store(target, PDBG_TARGET_NONEXISTENT);
 		return PDBG_TARGET_NONEXISTENT;
 	}
 
-	target->status = PDBG_TARGET_ENABLED;
+	target_status_store(target, PDBG_TARGET_ENABLED);
 	return PDBG_TARGET_ENABLED;
 }
 
-/* Releases a target by first recursively releasing all its children */
+enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target)
+{
+	enum pdbg_target_status status;
+
+	assert(target);
+
+	/*
+	 * Parents and virtual nodes are probed with this lock held, so locks
+	 * are always taken from a target towards the root.
+	 */
+	pthread_mutex_lock(&target->lock);
+	status = target_probe(target);
+	pthread_mutex_unlock(&target->lock);
+
+	return status;
+}
+
+uint64_t pdbg_target_probe_time(struct pdbg_target *target)
+{
+	return target->probe_time_us;
+}
+
+/*
+ * Releases a target by first recursively releasing all its children.  The
+ * children are released before taking the lock of the target, as locks
+ * are always taken from a target towards the root.
+ */
 void pdbg_target_release(struct pdbg_target *target)
 {
 	struct pdbg_target *child;
@@ -528,10 +898,248 @@ void pdbg_target_release(struct pdbg_target *target)
 	pdbg_for_each_child_target(target, child)
 		pdbg_target_release(child);
 
-	/* Release the target */
-	if (target->release)
-		target->release(target);
-	target->status = PDBG_TARGET_RELEASED;
+	pthread_mutex_lock(&target->lock);
+	if (pdbg_target_status(target) == PDBG_TARGET_ENABLED) {
+		target_release(target);
+		target_status_store(target, PDBG_TARGET_RELEASED);
+	}
+	pthread_mutex_unlock(&target->lock);
+}
+
+void pdbg_target_lock(struct pdbg_target *target)
+{
+	pthread_mutex_lock(&target->lock);
+}
+
+void pdbg_target_unlock(struct pdbg_target *target)
+{
+	pthread_mutex_unlock(&target->lock);
+}
+
+void pdbg_set_probe_threads(unsigned int threads)
+{
+	probe_threads = threads ? threads : 1;
+}
+
+/* Indexes of the targets of one processor, run in order by a single thread */
+struct proc_group {
+	struct pdbg_target *proc;
+	unsigned int *index;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+struct proc_work {
+	struct pdbg_target **targets;
+	target_proc_fn fn;
+	void *priv;
+	struct proc_group *groups;
+	unsigned int count;
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Each processor has its own devices with these backends, so targets of
+ * different processors can be accessed at the same time.  The others reach
+ * every processor through one bus or connection.
+ */
+static bool proc_parallel_backend(void)
+{
+	switch (pdbg_get_backend()) {
+	case PDBG_BACKEND_KERNEL:
+	case PDBG_BACKEND_SBEFIFO:
+	case PDBG_BACKEND_FAKE:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static struct pdbg_target *proc_group_proc(struct pdbg_target *target)
+{
+	for (; target; target = get_parent(target, true))
+		if (pdbg_target_is_class(target, "proc"))
+			return target;
+
+	return NULL;
+}
+
+static void proc_group_add(struct proc_group *group, unsigned int index)
+{
+	if (group->count == group->alloc) {
+		group->alloc = group->alloc ? group->alloc * 2 : 16;
+		group->index = realloc(group->index,
+				       group->alloc * sizeof(*group->index));
+		assert(group->index);
+	}
+
+	group->index[group->count++] = index;
+}
+
+static void proc_group_run(struct proc_work *work, struct proc_group *group)
+{
+	unsigned int i, index;
+
+	for (i = 0; i < group->count; i++) {
+		index = group->index[i];
+		work->fn(work->targets[index], index, work->priv);
+	}
+}
+
+static void *proc_worker(void *arg)
+{
+	struct proc_work *work = (struct proc_work *)arg;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&work->lock);
+		i = work->next++;
+		pthread_mutex_unlock(&work->lock);
+
+		if (i >= work->count)
+			break;
+
+		proc_group_run(work, &work->groups[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run fn on the targets of each processor on a thread of their own.  The
+ * targets of one processor are run in the order given by the same thread.
+ * Targets which do not belong to a processor are run afterwards by the
+ * caller.
+ */
+unsigned int target_run_per_proc(struct pdbg_target **targets, unsigned int count,
+				 target_proc_fn fn, void *priv)
+{
+	struct proc_work work = {
+		.targets = targets,
+		.fn = fn,
+		.priv = priv,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct proc_group rest = { 0 };
+	struct pdbg_target *proc;
+	pthread_t *threads;
+	unsigned int i, j, nthreads;
+
+	if (probe_threads == 1 || count < 2 || !proc_parallel_backend()) {
+		for (i = 0; i < count; i++)
+			fn(targets[i], i, priv);
+		return 1;
+	}
+
+	/* Create everything up front rather than from several threads */
+	if (target_tree_partial)
+		target_tree_expand();
+
+	work.groups = calloc(count, sizeof(*work.groups));
+	assert(work.groups);
+
+	for (i = 0; i < count; i++) {
+		proc = proc_group_proc(targets[i]);
+		if (!proc) {
+			proc_group_add(&rest, i);
+			continue;
+		}
+
+		for (j = 0; j < work.count; j++)
+			if (work.groups[j].proc == proc)
+				break;
+
+		if (j == work.count)
+			work.groups[work.count++].proc = proc;
+
+		proc_group_add(&work.groups[j], i);
+	}
+
+	nthreads = work.count < probe_threads ? work.count : probe_threads;
+	if (!nthreads)
+		nthreads = 1;
+	threads = calloc(nthreads, sizeof(*threads));
+	assert(threads);
+
+	/* The calling thread is one of the workers */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, proc_worker, &work)) {
+			PR_WARNING("Unable to start worker thread\n");
+			break;
+		}
+	}
+	nthreads = i;
+
+	proc_worker(&work);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	proc_group_run(&work, &rest);
+
+	for (i = 0; i < work.count; i++)
+		free(work.groups[i].index);
+	free(work.groups);
+	free(rest.index);
+	free(threads);
+
+	return nthreads;
+}
+
+static void probe_one(struct pdbg_target *target, unsigned int index, void *priv)
+{
+	pdbg_target_probe(target);
+}
+
+/*
+ * Probe the targets of each processor on a thread of their own.  A target
+ * only depends on its parents and virtual node, which pdbg_target_probe()
+ * probes first under their own locks, so targets shared between
+ * processors are still only probed once.
+ */
+void pdbg_target_probe_list(struct pdbg_target **targets, unsigned int count)
+{
+	unsigned int nthreads;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	nthreads = target_run_per_proc(targets, count, probe_one, NULL);
+
+	PR_DEBUG("Probed %u targets on %u threads in %" PRIu64 " us\n",
+		 count, nthreads, probe_elapsed_us(&start));
+}
+
+void pdbg_target_run_per_proc(struct pdbg_target **targets, unsigned int count,
+			      pdbg_target_fn fn, void *priv)
+{
+	target_run_per_proc(targets, count, fn, priv);
+}
+
+struct probe_list {
+	struct pdbg_target **targets;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+static void probe_all_collect(struct pdbg_target *parent, struct probe_list *list)
+{
+	struct pdbg_target *child;
+
+	pdbg_for_each_child_target(parent, child) {
+		probe_all_collect(child, list);
+
+		if (list->count == list->alloc) {
+			list->alloc = list->alloc ? list->alloc * 2 : 16;
+			list->targets = realloc(list->targets,
+						list->alloc * sizeof(*list->targets));
+			assert(list->targets);
+		}
+
+		list->targets[list->count++] = child;
+	}
 }
 
 /*
@@ -539,21 +1147,22 @@ void pdbg_target_release(struct pdbg_target *target)
  */
 void pdbg_target_probe_all(struct pdbg_target *parent)
 {
-	struct pdbg_target *child;
+	struct probe_list list = { 0 };
 
 	if (!parent)
 		parent = pdbg_target_root();
 
-	pdbg_for_each_child_target(parent, child) {
-		pdbg_target_probe_all(child);
-		pdbg_target_probe(child);
-	}
+	probe_all_collect(parent, &list);
+	pdbg_target_probe_list(list.targets, list.count);
+	free(list.targets);
 }
 
 bool pdbg_target_is_class(struct pdbg_target *target, const char *class)
 {
 	if (!target || !target->class || !class)
 		return false;
+	if (target->class == class)
+		return true;
 	return strcmp(target->class, class) == 0;
 }
 
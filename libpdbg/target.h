@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <ccan/list/list.h>
 #include <ccan/str/str.h>
 #include <ccan/container_of/container_of.h>
@@ -37,6 +38,25 @@ struct pdbg_target_class {
 	char *name;
 	struct list_head targets;
 	struct list_node class_head_link;
+	struct pdbg_target_class *hash_next;
+	unsigned int count;
+	unsigned int index_generation[2];
+};
+
+struct pdbg_property_cache;
+struct pdbg_child_index;
+struct hw_unit_info;
+
+/* Descendants of a target which belong to a class, in class list order */
+struct pdbg_target_index {
+	struct pdbg_target_class *target_class;
+	bool system;
+	unsigned int generation;
+	unsigned int alloc;
+	unsigned int count;
+	unsigned int cursor;
+	struct pdbg_target **targets;
+	struct pdbg_target_index *next;
 };
 
 struct pdbg_target {
@@ -51,14 +71,31 @@ struct pdbg_target {
 	int fdt_offset;
 	int index;
 	enum pdbg_target_status status;
+	pthread_mutex_t lock;
+	uint64_t probe_time_us;
+	uint32_t trace_id;
+	uint32_t replay_id;
 	const char *dn_name;
+	unsigned int unit_offset;
+	bool unit_valid;
+	uint64_t unit_addr;
 	struct list_node list;
 	struct list_head properties;
 	struct list_head children;
+	bool expanded;
 	struct pdbg_target *parent;
 	u32 phandle;
 	bool probed;
+	const struct hw_unit_info *hw_info;
 	struct list_node class_link;
+	struct pdbg_target_class *target_class;
+	unsigned int class_order;
+	struct pdbg_target_index *descendants;
+	struct pdbg_property_cache *props;
+	struct pdbg_child_index *child_index;
+	unsigned int address_generation;
+	uint64_t address;
+	uint64_t address_size;
 	void *priv;
 	struct pdbg_target *vnode;
 };
@@ -81,15 +118,69 @@ struct pdbg_target *require_target_parent(const char *klass, struct pdbg_target
 struct pdbg_target_class *find_target_class(const char *name);
 struct pdbg_target_class *require_target_class(const char *name);
 struct pdbg_target_class *get_target_class(struct pdbg_target *target);
+void target_classes_reset(void);
 bool pdbg_target_is_class(struct pdbg_target *target, const char *class);
 
 extern struct list_head empty_list;
 extern struct list_head target_classes;
+extern unsigned int target_tree_generation;
+
+/*
+ * With lazy targets some nodes have not been created yet.  Children of a
+ * node are created on first use, class iteration creates everything.
+ */
+extern bool target_tree_partial;
+void target_expand_children(struct pdbg_target *target);
+void target_tree_expand(void);
+
+/*
+ * Children of lazy targets, property caches, paths and class indexes are
+ * created on first use.  They are created under this lock and published
+ * with release stores, so that targets can be probed and used from more
+ * than one thread.  The lock is recursive.
+ */
+void target_tree_lock(void);
+void target_tree_unlock(void);
+
+/*
+ * Set up the per-target lock, which serialises probing and releasing the
+ * target and any backend access through it
+ */
+void target_lock_init(struct pdbg_target *target);
+
+/*
+ * Call fn on each target, those of different processors in parallel with
+ * the kernel, sbefifo and fake backends, up to pdbg_set_probe_threads()
+ * threads.  Returns the number of threads used.
+ */
+typedef void (*target_proc_fn)(struct pdbg_target *target, unsigned int index, void *priv);
+unsigned int target_run_per_proc(struct pdbg_target **targets, unsigned int count,
+				 target_proc_fn fn, void *priv);
+
+/* Call the release of a target, replayed backends hold nothing to release */
+void target_release(struct pdbg_target *target);
+
+/* Replace the progress callback of the calling thread, returns the old one */
+pdbg_progress_tick_t progress_tick_swap(pdbg_progress_tick_t fn);
+
+/* Trace and record hook of sbefifo contexts, priv is the target */
+void access_sbefifo(const uint8_t *msg, uint32_t msg_len,
+		    const uint8_t *out, uint32_t out_len,
+		    int rc, uint64_t duration_ns, void *priv);
+
+/* The status is read without the target lock, so it is updated atomically */
+static inline void target_status_store(struct pdbg_target *target,
+				       enum pdbg_target_status status)
+{
+	__atomic_store_n(&target->status, status, __ATOMIC_RELEASE);
+}
 
 struct pdbg_dtb *pdbg_default_dtb(void *system_fdt);
 enum pdbg_backend pdbg_get_backend(void);
 const char *pdbg_get_backend_option(void);
 bool pdbg_fdt_is_readonly(void *fdt);
+bool pdbg_fdt_is_backend(void *fdt);
+void pdbg_close_dtbs(void);
 
 bool target_is_virtual(struct pdbg_target *target);
 struct pdbg_target *target_to_real(struct pdbg_target *target, bool strict);
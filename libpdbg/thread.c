@@ -15,9 +15,12 @@
  */
 #include <stdio.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include "libpdbg.h"
 #include "hwunit.h"
+#include "target.h"
+#include "chip.h"
 #include "debug.h"
 #include "sprs.h"
 
@@ -30,12 +33,37 @@ struct thread_state thread_status(struct pdbg_target *target)
 	return thread->status;
 }
 
+/* Throughput is only worth reporting for longer runs */
+#define THREAD_STEP_REPORT	64
+
+static uint64_t thread_elapsed_ms(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000 +
+	       (end.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void thread_step_report(const char *what, uint64_t steps,
+			       const struct timespec *start)
+{
+	uint64_t ms = thread_elapsed_ms(start);
+
+	PR_INFO("%s %" PRIu64 " instructions in %" PRIu64 " ms (%" PRIu64 "/s)\n",
+		what, steps, ms, ms ? steps * 1000 / ms : steps * 1000);
+}
+
 /*
- * Single step the thread count instructions.
+ * Single step the thread count instructions.  The backend steps them in
+ * one go, keeping interrupts fenced and single-step mode set throughout,
+ * and reports progress as it goes.
  */
 int thread_step(struct pdbg_target *target, int count)
 {
 	struct thread *thread;
+	struct timespec start;
+	int rc;
 
 	assert(pdbg_target_is_class(target, "thread"));
 
@@ -49,12 +77,92 @@ int thread_step(struct pdbg_target *target, int count)
 		return -1;
 	}
 
-	return thread->step(thread, count);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rc = thread->step(thread, count);
+
+	thread_states_invalidate();
+
+	if (!rc && count > THREAD_STEP_REPORT)
+		thread_step_report("Stepped", count, &start);
+
+	return rc;
+}
+
+/*
+ * Step the thread until it is about to execute addr, reading the NIA
+ * before each step.
+ *
+ * Each NIA read is a whole RAM session: setup, two rammed instructions
+ * and restore.  The session can't be kept open across the loop as the
+ * thread has to leave RAM mode to execute the stepped instruction, so
+ * every iteration costs a RAM setup and restore on top of the step.
+ * Progress is counted against max_steps rather than the single steps.
+ */
+int thread_run_to(struct pdbg_target *target, uint64_t addr, uint64_t max_steps,
+		  uint64_t *steps)
+{
+	pdbg_progress_tick_t tick;
+	struct thread *thread;
+	struct timespec start;
+	uint64_t i, nia;
+	int rc;
+
+	assert(pdbg_target_is_class(target, "thread"));
+
+	if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+		return -1;
+
+	thread = target_to_thread(target);
+
+	if (!thread->step || !thread->getnia) {
+		PR_ERROR("step() or getnia() not implemented for the target\n");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tick = progress_tick_swap(NULL);
+
+	for (i = 0; ; i++) {
+		if (thread->getnia(thread, &nia)) {
+			rc = -1;
+			break;
+		}
+
+		if (nia == addr) {
+			rc = 0;
+			break;
+		}
+
+		if (i == max_steps) {
+			rc = 1;
+			break;
+		}
+
+		if (thread->step(thread, 1)) {
+			rc = -1;
+			break;
+		}
+
+		if (max_steps && tick)
+			tick(i + 1, max_steps);
+	}
+
+	progress_tick_swap(tick);
+	thread_states_invalidate();
+
+	thread_step_report(rc ? "Ran" : "Reached target after", i, &start);
+
+	if (steps)
+		*steps = i;
+
+	return rc;
 }
 
 int thread_start(struct pdbg_target *target)
 {
 	struct thread *thread;
+	int rc;
 
 	assert(pdbg_target_is_class(target, "thread"));
 
@@ -68,12 +176,16 @@ int thread_start(struct pdbg_target *target)
 		return -1;
 	}
 
-	return thread->start(thread);
+	rc = thread->start(thread);
+	thread_states_invalidate();
+
+	return rc;
 }
 
 int thread_stop(struct pdbg_target *target)
 {
 	struct thread *thread;
+	int rc;
 
 	assert(pdbg_target_is_class(target, "thread"));
 
@@ -87,12 +199,16 @@ int thread_stop(struct pdbg_target *target)
 		return -1;
 	}
 
-	return thread->stop(thread);
+	rc = thread->stop(thread);
+	thread_states_invalidate();
+
+	return rc;
 }
 
 int thread_sreset(struct pdbg_target *target)
 {
 	struct thread *thread;
+	int rc;
 
 	assert(pdbg_target_is_class(target, "thread"));
 
@@ -106,7 +222,10 @@ int thread_sreset(struct pdbg_target *target)
 		return -1;
 	}
 
-	return thread->sreset(thread);
+	rc = thread->sreset(thread);
+	thread_states_invalidate();
+
+	return rc;
 }
 
 int thread_step_all(void)
@@ -127,8 +246,10 @@ int thread_step_all(void)
 		count++;
 	}
 
-	if (count > 0)
+	if (count > 0) {
+		thread_states_invalidate();
 		return rc;
+	}
 
 	pdbg_for_each_class_target("thread", thread) {
 		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
@@ -162,8 +283,10 @@ int thread_start_all(void)
 		count++;
 	}
 
-	if (count > 0)
+	if (count > 0) {
+		thread_states_invalidate();
 		return rc;
+	}
 
 	pdbg_for_each_class_target("thread", thread) {
 		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
@@ -197,8 +320,10 @@ int thread_stop_all(void)
 		count++;
 	}
 
-	if (count > 0)
+	if (count > 0) {
+		thread_states_invalidate();
 		return rc;
+	}
 
 	pdbg_for_each_class_target("thread", thread) {
 		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
@@ -232,8 +357,10 @@ int thread_sreset_all(void)
 		count++;
 	}
 
-	if (count > 0)
+	if (count > 0) {
+		thread_states_invalidate();
 		return rc;
+	}
 
 	pdbg_for_each_class_target("thread", thread) {
 		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
@@ -314,10 +441,9 @@ void thread_print_regs(struct thread_regs *regs)
 	printf("PPR   : 0x%016" PRIx64 "\n", regs->ppr);
 }
 
-int thread_getregs(struct pdbg_target *target, struct thread_regs *regs)
+static int thread_getregs_noprint(struct pdbg_target *target, struct thread_regs *regs)
 {
 	struct thread *thread;
-	int err;
 
 	assert(pdbg_target_is_class(target, "thread"));
 
@@ -331,13 +457,48 @@ int thread_getregs(struct pdbg_target *target, struct thread_regs *regs)
 		return -1;
 	}
 
-	err = thread->getregs(thread, regs);
+	return thread->getregs(thread, regs);
+}
+
+int thread_getregs(struct pdbg_target *target, struct thread_regs *regs)
+{
+	int err;
+
+	err = thread_getregs_noprint(target, regs);
 	if (!err)
 		thread_print_regs(regs);
 
 	return err;
 }
 
+struct getregs_list {
+	struct thread_regs *regs;
+	int *rc;
+};
+
+static void thread_getregs_one(struct pdbg_target *target, unsigned int index, void *priv)
+{
+	struct getregs_list *list = (struct getregs_list *)priv;
+
+	list->rc[index] = thread_getregs_noprint(target, &list->regs[index]);
+}
+
+int thread_getregs_list(struct pdbg_target **targets, unsigned int count,
+			struct thread_regs *regs, int *rc)
+{
+	struct getregs_list list = { .regs = regs, .rc = rc };
+	unsigned int i;
+	int n = 0;
+
+	target_run_per_proc(targets, count, thread_getregs_one, &list);
+
+	for (i = 0; i < count; i++)
+		if (!rc[i])
+			n++;
+
+	return n;
+}
+
 int thread_getgpr(struct pdbg_target *target, int gpr, uint64_t *value)
 {
 	struct thread *thread;
@@ -0,0 +1,315 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "target.h"
+#include "trace.h"
+#include "debug.h"
+
+#define TRACE_DEFAULT_ENTRIES	65536
+#define TRACE_MAX_TARGETS	1024
+
+/*
+ * Each thread records into a ring of its own, so recording takes no lock.
+ * Only the owner writes a ring; head counts the entries ever recorded and
+ * is published after the entry it covers.  Rings are never freed, the
+ * trace of a thread which has exited is still dumped.
+ */
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t tid;
+	uint32_t size;
+	uint64_t head;
+	struct trace_entry entries[];
+};
+
+bool trace_enabled;
+
+static char *trace_path;
+static uint32_t trace_entries;
+static bool trace_dumping;
+
+static struct trace_ring *trace_rings;
+static __thread struct trace_ring *trace_ring;
+
+/* Paths of traced targets, target ids index this from 1 */
+static char *trace_targets[TRACE_MAX_TARGETS];
+static uint32_t trace_num_targets;
+static pthread_mutex_t trace_target_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring;
+
+	if (trace_ring)
+		return trace_ring;
+
+	ring = calloc(1, sizeof(*ring) + trace_entries * sizeof(struct trace_entry));
+	if (!ring)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	ring->size = trace_entries;
+
+	/* Rings are only ever added, so a dump can walk the list any time */
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	trace_ring = ring;
+	return ring;
+}
+
+uint32_t trace_target_id(struct pdbg_target *target)
+{
+	const char *path;
+	uint32_t i, id;
+
+	if (!target)
+		return TRACE_TARGET_NONE;
+
+	id = __atomic_load_n(&target->trace_id, __ATOMIC_ACQUIRE);
+	if (id)
+		return id;
+
+	path = pdbg_target_path(target);
+
+	pthread_mutex_lock(&trace_target_lock);
+	id = target->trace_id;
+
+	/* Targets recreated after pdbg_targets_fini() keep their id */
+	for (i = 0; !id && i < trace_num_targets; i++)
+		if (!strcmp(trace_targets[i], path))
+			id = i + 1;
+
+	if (!id && trace_num_targets < TRACE_MAX_TARGETS) {
+		/* Copied as the tree may be freed before the trace is dumped */
+		trace_targets[trace_num_targets] = strdup(path);
+		if (trace_targets[trace_num_targets]) {
+			id = trace_num_targets + 1;
+			__atomic_store_n(&trace_num_targets, id, __ATOMIC_RELEASE);
+		}
+	}
+
+	if (id)
+		__atomic_store_n(&target->trace_id, id, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_target_lock);
+
+	return id;
+}
+
+const char *trace_target_path(uint32_t id)
+{
+	if (id == TRACE_TARGET_NONE || id > __atomic_load_n(&trace_num_targets, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return trace_targets[id - 1];
+}
+
+void trace_record(enum access_op op, struct pdbg_target *target,
+		  uint64_t addr, uint64_t data, int rc, uint64_t start)
+{
+	struct trace_ring *ring;
+	struct trace_entry *entry;
+	uint64_t duration = trace_now() - start;
+
+	ring = trace_ring_get();
+	if (!ring)
+		return;
+
+	entry = &ring->entries[ring->head & (ring->size - 1)];
+	*entry = (struct trace_entry) {
+		.time_ns = start,
+		.addr = addr,
+		.data = data,
+		.duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration,
+		.rc = rc,
+		.target = trace_target_id(target),
+		.op = op,
+	};
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Only uses async-signal-safe calls from here on */
+static int trace_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int trace_write_ring(int fd, struct trace_ring *ring)
+{
+	struct trace_ring_header hdr;
+	uint64_t head, first, count;
+	uint32_t start;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	/*
+	 * The oldest slot of a full ring is the next to be written and may
+	 * be half written if the dump interrupted its owner, leave it out.
+	 */
+	count = head < ring->size ? head : ring->size - 1;
+	first = head - count;
+
+	hdr = (struct trace_ring_header) {
+		.tid = ring->tid,
+		.num_entries = count,
+		.dropped = first,
+	};
+
+	if (trace_write(fd, &hdr, sizeof(hdr)))
+		return -1;
+
+	start = first & (ring->size - 1);
+	if (start + count > ring->size) {
+		if (trace_write(fd, &ring->entries[start],
+				(ring->size - start) * sizeof(struct trace_entry)))
+			return -1;
+
+		count -= ring->size - start;
+		start = 0;
+	}
+
+	return trace_write(fd, &ring->entries[start], count * sizeof(struct trace_entry));
+}
+
+int pdbg_trace_dump(void)
+{
+	struct trace_header hdr;
+	struct trace_ring *ring, *rings;
+	uint32_t i, len;
+	int fd, rc = -1;
+
+	if (!trace_path)
+		return -1;
+
+	/* A signal may arrive while the trace is dumped at exit */
+	if (__atomic_exchange_n(&trace_dumping, true, __ATOMIC_ACQUIRE))
+		return -1;
+
+	fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+
+	rings = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+
+	hdr = (struct trace_header) {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.entry_size = sizeof(struct trace_entry),
+		.num_targets = __atomic_load_n(&trace_num_targets, __ATOMIC_ACQUIRE),
+	};
+
+	for (ring = rings; ring; ring = ring->next)
+		hdr.num_rings++;
+
+	if (trace_write(fd, &hdr, sizeof(hdr)))
+		goto out_close;
+
+	for (i = 0; i < hdr.num_targets; i++) {
+		len = strlen(trace_targets[i]);
+		if (trace_write(fd, &len, sizeof(len)) ||
+		    trace_write(fd, trace_targets[i], len))
+			goto out_close;
+	}
+
+	for (ring = rings; ring; ring = ring->next)
+		if (trace_write_ring(fd, ring))
+			goto out_close;
+
+	rc = 0;
+
+out_close:
+	close(fd);
+out:
+	__atomic_store_n(&trace_dumping, false, __ATOMIC_RELEASE);
+	return rc;
+}
+
+static void trace_atexit(void)
+{
+	pdbg_trace_dump();
+}
+
+bool pdbg_trace_start(const char *path, unsigned int entries)
+{
+	static bool registered;
+	uint32_t size;
+
+	if (trace_enabled)
+		return true;
+
+	/* Rings are sized once, they outlive any stop and start */
+	if (!trace_entries) {
+		if (!entries)
+			entries = TRACE_DEFAULT_ENTRIES;
+
+		for (size = 2; size < entries && size < (1U << 31); size <<= 1)
+			;
+		trace_entries = size;
+	}
+
+	free(trace_path);
+	trace_path = strdup(path);
+	if (!trace_path)
+		return false;
+
+	if (!registered) {
+		atexit(trace_atexit);
+		registered = true;
+	}
+
+	PR_INFO("Tracing hardware accesses to %s\n", trace_path);
+	__atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+void pdbg_trace_stop(void)
+{
+	__atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,98 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __LIBPDBG_TRACE_H
+#define __LIBPDBG_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Binary trace of hardware accesses, see pdbg_trace_start().
+ *
+ * A trace file is written in the byte order of the host which recorded it
+ * and contains a struct trace_header, then hdr.num_targets target paths,
+ * each a uint32_t length followed by the path without a terminating nul,
+ * then hdr.num_rings rings, each a struct trace_ring_header followed by
+ * its entries, oldest first.
+ */
+#define TRACE_MAGIC	0x50444247545243ULL	/* "PDBGTRC" */
+#define TRACE_VERSION	1
+
+/* Target id of accesses which could not be given one */
+#define TRACE_TARGET_NONE	0
+
+/* Hardware accesses, as traced and as recorded (see record.h) */
+enum access_op {
+	ACCESS_PIB_READ = 1,	/* addr, data */
+	ACCESS_PIB_WRITE,	/* addr, data */
+	ACCESS_FSI_READ,	/* addr, data */
+	ACCESS_FSI_WRITE,	/* addr, data */
+	ACCESS_MEM_READ,	/* addr, data is the size */
+	ACCESS_MEM_WRITE,	/* addr, data is the size */
+	ACCESS_SBEFIFO,		/* addr is the message length when traced and
+				 * a hash of the request when recorded, data
+				 * the command */
+	ACCESS_OPB_READ,	/* addr, data */
+	ACCESS_OPB_WRITE,	/* addr, data */
+	ACCESS_OCMB_READ,	/* addr, data */
+	ACCESS_OCMB_WRITE,	/* addr, data */
+	ACCESS_PROBE,		/* rc of a backend probe, only recorded */
+	ACCESS_TARGET,		/* introduces a target id, only recorded */
+	ACCESS_OP_MAX,
+};
+
+struct trace_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t num_targets;
+	uint32_t num_rings;
+};
+
+struct trace_ring_header {
+	uint32_t tid;
+	uint32_t num_entries;
+	uint64_t dropped;
+};
+
+struct trace_entry {
+	uint64_t time_ns;	/* CLOCK_MONOTONIC at the start of the access */
+	uint64_t addr;
+	uint64_t data;
+	uint32_t duration_ns;
+	int32_t rc;
+	uint32_t target;	/* index into the target paths, from 1 */
+	uint16_t op;
+	uint16_t reserved;
+};
+
+struct pdbg_target;
+
+/* Set while a trace is being recorded */
+extern bool trace_enabled;
+
+uint64_t trace_now(void);
+void trace_record(enum access_op op, struct pdbg_target *target,
+		  uint64_t addr, uint64_t data, int rc, uint64_t start);
+
+/*
+ * Targets are given ids from 1 in the order they are first accessed, the
+ * same path always gets the same id.  Recordings use these ids too.
+ */
+uint32_t trace_target_id(struct pdbg_target *target);
+const char *trace_target_path(uint32_t id);
+
+#endif
@@ -74,7 +74,10 @@ int sbefifo_get_ffdc(struct sbefifo_context *sctx)
 		return rc;
 
 	status = SBEFIFO_PRI_UNKNOWN_ERROR | SBEFIFO_SEC_GENERIC_FAILURE;
+	pthread_mutex_lock(&sctx->lock);
 	sbefifo_ffdc_set(sctx, status, out, out_len);
+	pthread_mutex_unlock(&sctx->lock);
+	free(out);
 	return 0;
 }
 
@@ -50,6 +50,7 @@ int sbefifo_connect(const char *fifo_path, int proc, struct sbefifo_context **ou
 	*sctx = (struct sbefifo_context) {
 		.fd = -1,
 		.proc = proc,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
 	};
 
 	fd = open(fifo_path, O_RDWR | O_SYNC);
@@ -84,6 +85,7 @@ int sbefifo_connect_transport(int proc, sbefifo_transport_fn transport, void *pr
 		.proc = proc,
 		.transport = transport,
 		.priv = priv,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
 	};
 
 	*out = sctx;
@@ -98,6 +100,7 @@ void sbefifo_disconnect(struct sbefifo_context *sctx)
 	if (sctx->ffdc)
 		free(sctx->ffdc);
 
+	pthread_mutex_destroy(&sctx->lock);
 	free(sctx);
 }
 
@@ -106,6 +109,12 @@ int sbefifo_proc(struct sbefifo_context *sctx)
 	return sctx->proc;
 }
 
+void sbefifo_set_trace(struct sbefifo_context *sctx, sbefifo_trace_fn trace, void *priv)
+{
+	sctx->trace = trace;
+	sctx->trace_priv = priv;
+}
+
 void sbefifo_debug(const char *fmt, ...)
 {
 	va_list ap;
@@ -54,6 +54,36 @@ uint32_t sbefifo_ffdc_get(struct sbefifo_context *sctx, const uint8_t **ffdc, ui
 	return sctx->status;
 }
 
+/*
+ * The context may be shared by several targets, so take a copy of the
+ * status and ffdc while no other operation can replace them. The caller
+ * frees *ffdc.
+ */
+uint32_t sbefifo_ffdc_copy(struct sbefifo_context *sctx, uint8_t **ffdc, uint32_t *ffdc_len)
+{
+	uint32_t status;
+
+	*ffdc = NULL;
+	*ffdc_len = 0;
+
+	pthread_mutex_lock(&sctx->lock);
+
+	status = sctx->status;
+	if (sctx->ffdc && sctx->ffdc_len > 0) {
+		*ffdc = malloc(sctx->ffdc_len);
+		if (*ffdc) {
+			memcpy(*ffdc, sctx->ffdc, sctx->ffdc_len);
+			*ffdc_len = sctx->ffdc_len;
+		} else {
+			fprintf(stderr, "Memory allocation error\n");
+		}
+	}
+
+	pthread_mutex_unlock(&sctx->lock);
+
+	return status;
+}
+
 static int sbefifo_ffdc_get_uint32(struct sbefifo_context *sctx, uint32_t offset, uint32_t *value)
 {
 	uint32_t v;
@@ -140,6 +170,8 @@ void sbefifo_ffdc_dump(struct sbefifo_context *sctx)
 {
 	uint32_t offset = 0;
 
+	pthread_mutex_lock(&sctx->lock);
+
 	while (offset < sctx->ffdc_len) {
 		int n;
 
@@ -149,4 +181,6 @@ void sbefifo_ffdc_dump(struct sbefifo_context *sctx)
 
 		offset += n;
 	}
+
+	pthread_mutex_unlock(&sctx->lock);
 }
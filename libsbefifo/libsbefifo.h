@@ -109,10 +109,16 @@ typedef int (*sbefifo_transport_fn)(uint8_t *msg, uint32_t msg_len,
 				    uint8_t *out, uint32_t *out_len,
 				    void *private_data);
 
+typedef void (*sbefifo_trace_fn)(const uint8_t *msg, uint32_t msg_len,
+				 const uint8_t *out, uint32_t out_len,
+				 int rc, uint64_t duration_ns,
+				 void *private_data);
+
 int sbefifo_connect(const char *fifo_path, int proc, struct sbefifo_context **out);
 int sbefifo_connect_transport(int proc, sbefifo_transport_fn transport, void *priv, struct sbefifo_context **out);
 void sbefifo_disconnect(struct sbefifo_context *sctx);
 int sbefifo_proc(struct sbefifo_context *sctx);
+void sbefifo_set_trace(struct sbefifo_context *sctx, sbefifo_trace_fn trace, void *priv);
 
 int sbefifo_parse_output(struct sbefifo_context *sctx, uint32_t cmd,
 			 uint8_t *buf, uint32_t buflen,
@@ -122,6 +128,7 @@ int sbefifo_operation(struct sbefifo_context *sctx,
 		      uint8_t **out, uint32_t *out_len);
 
 uint32_t sbefifo_ffdc_get(struct sbefifo_context *sctx, const uint8_t **ffdc, uint32_t *ffdc_len);
+uint32_t sbefifo_ffdc_copy(struct sbefifo_context *sctx, uint8_t **ffdc, uint32_t *ffdc_len);
 void sbefifo_ffdc_dump(struct sbefifo_context *sctx);
 
 int sbefifo_istep_execute(struct sbefifo_context *sctx, uint8_t major, uint8_t minor);
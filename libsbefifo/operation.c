@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <endian.h>
+#include <time.h>
 
 #include "libsbefifo.h"
 #include "sbefifo_private.h"
@@ -136,6 +137,14 @@ int sbefifo_parse_output(struct sbefifo_context *sctx, uint32_t cmd,
 	return 0;
 }
 
+static uint64_t sbefifo_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 int sbefifo_operation(struct sbefifo_context *sctx,
 		      uint8_t *msg, uint32_t msg_len,
 		      uint8_t **out, uint32_t *out_len)
@@ -143,6 +152,7 @@ int sbefifo_operation(struct sbefifo_context *sctx,
 	uint8_t *buf;
 	uint32_t buflen;
 	uint32_t cmd;
+	uint64_t start = 0;
 	int rc;
 
 	assert(msg);
@@ -164,25 +174,34 @@ int sbefifo_operation(struct sbefifo_context *sctx,
 
 	LOG("request: cmd=%08x, len=%u\n", cmd, msg_len);
 
+	/* The reply and ffdc must belong to this request */
+	pthread_mutex_lock(&sctx->lock);
+
+	if (sctx->trace)
+		start = sbefifo_now();
+
 	if (sctx->transport)
 		rc = sctx->transport(msg, msg_len, buf, &buflen, sctx->priv);
 	else
 		rc = sbefifo_transport(sctx, msg, msg_len, buf, &buflen);
 
-	if (rc) {
-		free(buf);
+	if (sctx->trace)
+		sctx->trace(msg, msg_len, buf, rc ? 0 : buflen, rc,
+			    sbefifo_now() - start, sctx->trace_priv);
 
+	if (rc) {
 		if (rc == ETIMEDOUT) {
 			uint32_t status;
 
 			status = SBEFIFO_PRI_UNKNOWN_ERROR | SBEFIFO_SEC_HW_TIMEOUT;
 			sbefifo_ffdc_set(sctx, status, NULL, 0);
 		}
-
-		return rc;
+	} else {
+		rc = sbefifo_parse_output(sctx, cmd, buf, buflen, out, out_len);
 	}
 
-	rc = sbefifo_parse_output(sctx, cmd, buf, buflen, out, out_len);
+	pthread_mutex_unlock(&sctx->lock);
+
 	free(buf);
 	return rc;
 }
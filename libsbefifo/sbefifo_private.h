@@ -18,6 +18,7 @@
 #define __SBEFIFO_PRIVATE_H__
 
 #include <stdint.h>
+#include <pthread.h>
 #include "libsbefifo.h"
 
 #define SBEFIFO_CMD_CLASS_CONTROL        0xA100
@@ -73,9 +74,16 @@ struct sbefifo_context {
 	int fd;
 	int proc;
 
+	/* Serialises operations, the fifo carries one request at a time */
+	pthread_mutex_t lock;
+
 	sbefifo_transport_fn transport;
 	void *priv;
 
+	/* Called with the raw request and reply of every transfer when set */
+	sbefifo_trace_fn trace;
+	void *trace_priv;
+
 	uint32_t status;
 	uint8_t *ffdc;
 	uint32_t ffdc_len;
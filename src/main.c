@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <signal.h>
 
 #include <ccan/array_size/array_size.h>
 
@@ -57,6 +58,9 @@ static int i2c_addr = 0x50;
 
 #define MAX_PATH_ARGS	16
 
+/* Probing is mostly waiting for devices, so use more threads than cpus */
+#define PROBE_THREADS	8
+
 static const char *pathsel[MAX_PATH_ARGS];
 static int pathsel_count;
 
@@ -68,7 +72,7 @@ static int probe(void);
 extern struct optcmd_cmd
 	optcmd_getscom, optcmd_putscom,	optcmd_getcfam, optcmd_putcfam,
 	optcmd_getgpr, optcmd_putgpr, optcmd_getspr, optcmd_putspr,
-	optcmd_getring, optcmd_start, optcmd_stop, optcmd_step,
+	optcmd_getring, optcmd_start, optcmd_stop, optcmd_step, optcmd_runto,
 	optcmd_threadstatus, optcmd_sreset, optcmd_regs, optcmd_probe,
 	optcmd_getmem, optcmd_putmem, optcmd_getmemio, optcmd_putmemio,
 	optcmd_getmempba, optcmd_putmempba,
@@ -77,7 +81,7 @@ extern struct optcmd_cmd
 static struct optcmd_cmd *cmds[] = {
 	&optcmd_getscom, &optcmd_putscom, &optcmd_getcfam, &optcmd_putcfam,
 	&optcmd_getgpr, &optcmd_putgpr, &optcmd_getspr, &optcmd_putspr,
-	&optcmd_getring, &optcmd_start, &optcmd_stop, &optcmd_step,
+	&optcmd_getring, &optcmd_start, &optcmd_stop, &optcmd_step, &optcmd_runto,
 	&optcmd_threadstatus, &optcmd_sreset, &optcmd_regs, &optcmd_probe,
 	&optcmd_getmem, &optcmd_putmem, &optcmd_getmemio, &optcmd_putmemio,
 	&optcmd_getmempba, &optcmd_putmempba,
@@ -100,6 +104,7 @@ static struct action actions[] = {
 	{ "getring", "<addr> <len>", "Read a ring. Length must be correct" },
 	{ "start",   "", "Start thread" },
 	{ "step",    "<count>", "Set a thread <count> instructions" },
+	{ "runto",   "<address> [<max steps>]", "Step a thread until it reaches <address>" },
 	{ "stop",    "", "Stop thread" },
 	{ "htm", "core|nest start|stop|status|dump|record", "Hardware Trace Macro" },
 	{ "probe", "", "" },
@@ -148,6 +153,7 @@ static void print_usage(void)
 	printf("\t-d, --device=<backend device>\n");
 	printf("\t\tFor I2C the device node used by the backend to access the bus.\n");
 	printf("\t\tFor FSI the system board type, one of p8 or p9w\n");
+	printf("\t\tFor Cronus <proc>@<server>[:<port>], port defaults to 8192\n");
 	printf("\t\tDefaults to /dev/i2c4 for I2C\n");
 	printf("\t-s, --slave-address=<backend device address>\n");
 	printf("\t\tDevice slave address to use for the backend. Not used by FSI\n");
@@ -558,12 +564,19 @@ static void atexit_release(void)
 	pdbg_target_release(pdbg_target_root());
 }
 
+/* Lets a hanging pdbg be asked for the accesses it has made so far */
+static void trace_dump_signal(int sig)
+{
+	pdbg_trace_dump();
+}
+
 int main(int argc, char *argv[])
 {
 	int i, rc = 0;
 	void **args, **flags;
 	optcmd_cmd_t *cmd;
-	struct pdbg_target *target;
+	struct pdbg_target *target, **targets;
+	unsigned int count;
 
 	if (!parse_options(argc, argv))
 		return 1;
@@ -577,6 +590,9 @@ int main(int argc, char *argv[])
 		if (!pdbg_set_backend(backend, device_node))
 			return 1;
 
+	if (getenv("PDBG_TRACE"))
+		signal(SIGUSR1, trace_dump_signal);
+
 	if (!pdbg_targets_init(NULL))
 		return 1;
 
@@ -591,10 +607,22 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	/* Probe all selected targets */
-	for_each_path_target(target) {
-		pdbg_target_probe(target);
-	}
+	/* Probe all selected targets, processors in parallel */
+	count = 0;
+	for_each_path_target(target)
+		count++;
+
+	targets = malloc(count * sizeof(*targets));
+	if (!targets)
+		return 1;
+
+	count = 0;
+	for_each_path_target(target)
+		targets[count++] = target;
+
+	pdbg_set_probe_threads(PROBE_THREADS);
+	pdbg_target_probe_list(targets, count);
+	free(targets);
 
 	atexit(atexit_release);
 
@@ -0,0 +1,246 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decode a trace of hardware accesses written by libpdbg, see
+ * pdbg_trace_start().  The accesses of all threads are merged and printed
+ * in time order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+struct access {
+	struct trace_entry entry;
+	uint32_t tid;
+};
+
+static const char *op_names[ACCESS_OP_MAX] = {
+	[ACCESS_PIB_READ] = "pib_read",
+	[ACCESS_PIB_WRITE] = "pib_write",
+	[ACCESS_FSI_READ] = "fsi_read",
+	[ACCESS_FSI_WRITE] = "fsi_write",
+	[ACCESS_MEM_READ] = "mem_read",
+	[ACCESS_MEM_WRITE] = "mem_write",
+	[ACCESS_SBEFIFO] = "sbefifo",
+	[ACCESS_OPB_READ] = "opb_read",
+	[ACCESS_OPB_WRITE] = "opb_write",
+	[ACCESS_OCMB_READ] = "ocmb_read",
+	[ACCESS_OCMB_WRITE] = "ocmb_write",
+};
+
+static char **targets;
+static uint32_t num_targets;
+
+static struct access *accesses;
+static uint64_t num_accesses;
+
+static const char *op_name(uint16_t op)
+{
+	if (op < ACCESS_OP_MAX && op_names[op])
+		return op_names[op];
+
+	return "unknown";
+}
+
+static const char *target_name(uint32_t id)
+{
+	if (id == TRACE_TARGET_NONE || id > num_targets)
+		return "-";
+
+	return targets[id - 1];
+}
+
+static bool read_exact(FILE *f, void *buf, size_t len)
+{
+	return fread(buf, 1, len, f) == len;
+}
+
+static bool read_targets(FILE *f)
+{
+	uint32_t i, len;
+
+	targets = calloc(num_targets, sizeof(*targets));
+	if (num_targets && !targets)
+		return false;
+
+	for (i = 0; i < num_targets; i++) {
+		if (!read_exact(f, &len, sizeof(len)))
+			return false;
+
+		targets[i] = malloc(len + 1);
+		if (!targets[i] || !read_exact(f, targets[i], len))
+			return false;
+
+		targets[i][len] = '\0';
+	}
+
+	return true;
+}
+
+static bool read_ring(FILE *f, bool quiet)
+{
+	struct trace_ring_header ring;
+	struct access *tmp;
+	uint32_t i;
+
+	if (!read_exact(f, &ring, sizeof(ring)))
+		return false;
+
+	if (!quiet)
+		printf("# thread %" PRIu32 ": %" PRIu32 " accesses, %" PRIu64 " dropped\n",
+		       ring.tid, ring.num_entries, ring.dropped);
+
+	tmp = realloc(accesses, (num_accesses + ring.num_entries) * sizeof(*accesses));
+	if (ring.num_entries && !tmp)
+		return false;
+	accesses = tmp;
+
+	for (i = 0; i < ring.num_entries; i++) {
+		if (!read_exact(f, &accesses[num_accesses].entry, sizeof(struct trace_entry)))
+			return false;
+
+		accesses[num_accesses++].tid = ring.tid;
+	}
+
+	return true;
+}
+
+static int access_cmp(const void *a, const void *b)
+{
+	const struct access *x = a, *y = b;
+
+	if (x->entry.time_ns < y->entry.time_ns)
+		return -1;
+	if (x->entry.time_ns > y->entry.time_ns)
+		return 1;
+	return 0;
+}
+
+static void print_text(void)
+{
+	struct trace_entry *e;
+	uint64_t base, i;
+
+	base = num_accesses ? accesses[0].entry.time_ns : 0;
+
+	for (i = 0; i < num_accesses; i++) {
+		e = &accesses[i].entry;
+		printf("%12.6f %6" PRIu32 " %-9s %-24s 0x%016" PRIx64 " 0x%016" PRIx64
+		       " rc=%" PRId32 " %" PRIu32 "ns\n",
+		       (e->time_ns - base) / 1e9, accesses[i].tid, op_name(e->op),
+		       target_name(e->target), e->addr, e->data, e->rc, e->duration_ns);
+	}
+}
+
+static void print_csv(void)
+{
+	struct trace_entry *e;
+	uint64_t i;
+
+	printf("time_ns,tid,op,target,addr,data,rc,duration_ns\n");
+
+	for (i = 0; i < num_accesses; i++) {
+		e = &accesses[i].entry;
+		printf("%" PRIu64 ",%" PRIu32 ",%s,%s,0x%" PRIx64 ",0x%" PRIx64
+		       ",%" PRId32 ",%" PRIu32 "\n",
+		       e->time_ns, accesses[i].tid, op_name(e->op),
+		       target_name(e->target), e->addr, e->data, e->rc, e->duration_ns);
+	}
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c|--csv] <trace-file>\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option long_opts[] = {
+		{"csv",		no_argument,	NULL,	'c'},
+		{"help",	no_argument,	NULL,	'h'},
+		{NULL,		0,		NULL,	0}
+	};
+	struct trace_header hdr;
+	bool csv = false;
+	uint32_t i;
+	FILE *f;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "ch", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			csv = true;
+			break;
+
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (!read_exact(f, &hdr, sizeof(hdr)) || hdr.magic != TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a pdbg trace\n", argv[optind]);
+		return 1;
+	}
+
+	if (hdr.version != TRACE_VERSION ||
+	    hdr.entry_size != sizeof(struct trace_entry)) {
+		fprintf(stderr, "%s: unsupported trace version %" PRIu32 "\n",
+			argv[optind], hdr.version);
+		return 1;
+	}
+
+	num_targets = hdr.num_targets;
+	if (!read_targets(f))
+		goto truncated;
+
+	for (i = 0; i < hdr.num_rings; i++)
+		if (!read_ring(f, csv))
+			goto truncated;
+
+	fclose(f);
+
+	qsort(accesses, num_accesses, sizeof(*accesses), access_cmp);
+
+	if (csv)
+		print_csv();
+	else
+		print_text();
+
+	return 0;
+
+truncated:
+	fprintf(stderr, "%s: trace is truncated\n", argv[optind]);
+	return 1;
+}
@@ -8,6 +8,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <inttypes.h>
@@ -27,23 +29,59 @@
 
 #ifndef DISABLE_GDBSERVER
 
-/* Maximum packet size */
-#define BUFFER_SIZE    	8192
+/* Maximum packet size, gdb does not use more than 16KiB for memory */
+#define BUFFER_SIZE    	0x4000
 
 /* GDB packets */
 #define STR(e) "e"
 #define ACK "+"
 #define NACK "-"
 #define OK "OK"
-#define TRAP "S05"
+#define TRAP "T05"
 #define ERROR(e) "E"STR(e)
 
 #define TEST_SKIBOOT_ADDR 0x40000000
 
-static struct pdbg_target *thread_target = NULL;
+/*
+ * While a thread runs its status is polled from a timer, starting every
+ * POLL_DELAY_MIN_MS and backing off exponentially to POLL_DELAY_MAX_MS.
+ * Otherwise the server only wakes up for the client.
+ */
+#define POLL_DELAY_MIN_MS	1
+#define POLL_DELAY_MAX_MS	100
+
+/*
+ * Every selected thread is a gdb thread, its id is the index in threads[]
+ * plus one.  Registers are read once per stop and kept until the threads
+ * run again.
+ */
+struct gdb_thread {
+	struct pdbg_target *target;
+	struct thread_regs regs;
+	bool regs_valid;
+	bool trapped;
+};
+
+/* A packet from the client, data is what is between '$' and '#' */
+struct gdb_packet {
+	char *data;
+	size_t len;
+};
+
+/* qfThreadInfo/qsThreadInfo list this many threads per reply */
+#define THREAD_INFO_CHUNK	64
+
+static struct gdb_thread *threads;
+static int nr_threads;
+static int thread_info_next;
+
+/* Thread for register and memory accesses (Hg) and for steps (Hc) */
+static struct gdb_thread *thread_g;
+static struct gdb_thread *thread_c;
+
 static struct pdbg_target *adu_target;
-static struct timeval timeout;
-static int poll_interval = 100;
+static int timer_fd = -1;
+static int poll_delay_ms;
 static int fd = -1;
 static int littleendian = 1;
 enum client_state {IDLE, SIGNAL_WAIT};
@@ -51,26 +89,117 @@ static enum client_state state = IDLE;
 
 static void destroy_client(int dead_fd);
 
-static uint8_t gdbcrc(char *data)
+static void poll_timer_set(int ms)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = ms / 1000,
+			.tv_nsec = (ms % 1000) * 1000000,
+		},
+	};
+
+	if (timerfd_settime(timer_fd, 0, &its, NULL))
+		perror(__FUNCTION__);
+}
+
+static void poll_start(void)
+{
+	state = SIGNAL_WAIT;
+	poll_delay_ms = POLL_DELAY_MIN_MS;
+	poll_timer_set(poll_delay_ms);
+}
+
+static void poll_stop(void)
+{
+	state = IDLE;
+	poll_timer_set(0);
+}
+
+static uint8_t gdbcrc(const char *data, size_t len)
 {
 	uint8_t crc = 0;
-	int i;
+	size_t i;
 
-	for (i = 0; i < strlen(data); i++)
+	for (i = 0; i < len; i++)
 		crc += data[i];
 
 	return crc;
 }
 
+/* Sends len bytes of data, which may be binary, as a packet */
+static void send_packet(int fd, const char *data, size_t len)
+{
+	static char packet[BUFFER_SIZE + 4];
+
+	assert(len <= BUFFER_SIZE);
+
+	packet[0] = '$';
+	memcpy(packet + 1, data, len);
+	sprintf(packet + len + 1, "#%02x", gdbcrc(data, len));
+	PR_INFO("Send: %.*s\n", (int) len + 4, packet);
+	send(fd, packet, len + 4, 0);
+}
+
 static void send_response(int fd, char *response)
 {
-	int len;
-	char *result;
+	send_packet(fd, response, strlen(response));
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Encodes len bytes as 2 * len hex digits */
+static size_t hex_encode(char *out, const uint8_t *in, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*out++ = hex_digits[in[i] >> 4];
+		*out++ = hex_digits[in[i] & 0xf];
+	}
+
+	return 2 * len;
+}
+
+/*
+ * Binary data has '#', '$', '}' and '*' escaped as '}' followed by the
+ * byte xor 0x20.  Encodes as much of len bytes as fits in size, returns
+ * the number of bytes encoded and the size used in *out_len.
+ */
+static size_t binary_encode(char *out, size_t size, const uint8_t *in,
+			    size_t len, size_t *out_len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (in[i] == '#' || in[i] == '$' || in[i] == '}' || in[i] == '*') {
+			if (n + 2 > size)
+				break;
+			out[n++] = '}';
+			out[n++] = in[i] ^ 0x20;
+		} else {
+			if (n + 1 > size)
+				break;
+			out[n++] = in[i];
+		}
+	}
+
+	*out_len = n;
+	return i;
+}
+
+/* Returns the number of bytes decoded from len bytes of binary data */
+static size_t binary_decode(uint8_t *out, const char *in, size_t len)
+{
+	size_t i, n = 0;
 
-	len = asprintf(&result, "$%s#%02x", response, gdbcrc(response));
-	PR_INFO("Send: %s\n", result);
-	send(fd, result, len, 0);
-	free(result);
+	for (i = 0; i < len; i++) {
+		if (in[i] == '}' && i + 1 < len)
+			out[n++] = in[++i] ^ 0x20;
+		else
+			out[n++] = in[i];
+	}
+
+	return n;
 }
 
 void send_nack(void *priv)
@@ -85,14 +214,161 @@ void send_ack(void *priv)
 	send(fd, ACK, 1, 0);
 }
 
+static int gdb_thread_id(struct gdb_thread *thread)
+{
+	return thread - threads + 1;
+}
+
+static struct gdb_thread *gdb_thread_get(long id)
+{
+	if (id < 1 || id > nr_threads)
+		return NULL;
+
+	return &threads[id - 1];
+}
+
+/*
+ * Parses a thread-id, [p<pid>.]<tid> in hex.  Returns 0 for any thread
+ * and -1 for all of them.
+ */
+static long parse_thread_id(const char *str, char **end)
+{
+	char *tmp;
+
+	if (*str == 'p') {
+		strtol(str + 1, &tmp, 16);
+		str = (*tmp == '.') ? tmp + 1 : tmp;
+	}
+
+	if (!strncmp(str, "-1", 2)) {
+		if (end)
+			*end = (char *) str + 2;
+		return -1;
+	}
+
+	return strtol(str, end, 16);
+}
+
+static void gdb_threads_invalidate(void)
+{
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		threads[i].regs_valid = false;
+}
+
+static struct thread_regs *gdb_thread_regs(struct gdb_thread *thread)
+{
+	int rc;
+
+	if (thread->regs_valid)
+		return &thread->regs;
+
+	if (thread_getregs_list(&thread->target, 1, &thread->regs, &rc) != 1 || rc) {
+		PR_ERROR("Error reading registers of thread %d\n", gdb_thread_id(thread));
+		return NULL;
+	}
+
+	thread->regs_valid = true;
+	return &thread->regs;
+}
+
+static void send_stop(struct gdb_thread *thread)
+{
+	char data[32];
+
+	snprintf(data, sizeof(data), TRAP "thread:%x;", gdb_thread_id(thread));
+	send_response(fd, data);
+}
+
 static void set_thread(uint64_t *stack, void *priv)
 {
+	struct gdb_packet *packet = priv;
+	struct gdb_thread *thread = NULL;
+	long id;
+
+	/* H<op><thread-id> */
+	id = parse_thread_id(packet->data + 2, NULL);
+	if (id > 0) {
+		thread = gdb_thread_get(id);
+		if (!thread) {
+			send_response(fd, ERROR(EPERM));
+			return;
+		}
+	}
+
+	if (packet->data[1] == 'g')
+		thread_g = thread ? thread : &threads[0];
+	else
+		thread_c = thread;
+
 	send_response(fd, OK);
 }
 
+static bool packet_crc_ok(struct gdb_packet *packet)
+{
+	uint8_t crc = gdbcrc(packet->data, packet->len);
+
+	return crc == strtoul(packet->data + packet->len + 1, NULL, 16);
+}
+
+static void q_supported(struct gdb_packet *packet)
+{
+	char data[128];
+
+	snprintf(data, sizeof(data), "PacketSize=%x;multiprocess+;vContSupported+;"
+		 "binary-upload+;qXfer:threads:read+", BUFFER_SIZE);
+	send_response(fd, data);
+}
+
+static void v_cont_query(struct gdb_packet *packet)
+{
+	send_response(fd, "vCont;c;C;s;S");
+}
+
+static void q_current_thread(struct gdb_packet *packet)
+{
+	char data[32];
+
+	snprintf(data, sizeof(data), "QC%x", gdb_thread_id(thread_g));
+	send_response(fd, data);
+}
+
+static void q_thread_info(struct gdb_packet *packet)
+{
+	char data[THREAD_INFO_CHUNK * 9 + 2];
+	int len = 0, i;
+
+	/* qfThreadInfo starts the list, qsThreadInfo continues it */
+	if (packet->data[1] == 'f')
+		thread_info_next = 0;
+
+	if (thread_info_next >= nr_threads) {
+		send_response(fd, "l");
+		return;
+	}
+
+	data[len++] = 'm';
+	for (i = 0; i < THREAD_INFO_CHUNK && thread_info_next < nr_threads; i++) {
+		len += sprintf(data + len, "%s%x", i ? "," : "",
+			       gdb_thread_id(&threads[thread_info_next]));
+		thread_info_next++;
+	}
+
+	send_response(fd, data);
+}
+
+static void thread_alive(struct gdb_packet *packet)
+{
+	if (gdb_thread_get(parse_thread_id(packet->data + 1, NULL)))
+		send_response(fd, OK);
+	else
+		send_response(fd, ERROR(EPERM));
+}
+
 static void stop_reason(uint64_t *stack, void *priv)
 {
-	send_response(fd, TRAP);
+	send_stop(thread_g);
 }
 
 static void disconnect(uint64_t *stack, void *priv)
@@ -106,15 +382,18 @@ static void disconnect(uint64_t *stack, void *priv)
 static void get_gprs(uint64_t *stack, void *priv)
 {
 	char data[REG_DATA_SIZE] = "";
-	struct thread_regs regs;
+	struct thread_regs *regs;
 	int i;
 
-	if(thread_getregs(thread_target, &regs))
-		PR_ERROR("Error reading gprs\n");
+	regs = gdb_thread_regs(thread_g);
+	if (!regs) {
+		send_response(fd, ERROR(EPERM));
+		return;
+	}
 
 	for (i = 0; i < 32; i++) {
-		PR_INFO("r%d = 0x%016" PRIx64 "\n", i, regs.gprs[i]);
-		snprintf(data + i*16, 17, "%016" PRIx64 , be64toh(regs.gprs[i]));
+		PR_INFO("r%d = 0x%016" PRIx64 "\n", i, regs->gprs[i]);
+		snprintf(data + i*16, 17, "%016" PRIx64 , be64toh(regs->gprs[i]));
 	}
 
 	send_response(fd, data);
@@ -123,47 +402,39 @@ static void get_gprs(uint64_t *stack, void *priv)
 static void get_spr(uint64_t *stack, void *priv)
 {
 	char data[REG_DATA_SIZE];
+	struct thread_regs *regs;
 	uint64_t value;
 
+	regs = gdb_thread_regs(thread_g);
+	if (!regs) {
+		send_response(fd, ERROR(EPERM));
+		return;
+	}
+
 	switch (stack[0]) {
 	case 0x40:
 		/* Get PC/NIA */
-		if (thread_getnia(thread_target, &value))
-			PR_ERROR("Error reading NIA\n");
-		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
-		send_response(fd, data);
+		value = regs->nia;
 		break;
 
 	case 0x41:
 		/* Get MSR */
-		if (thread_getmsr(thread_target, &value))
-			PR_ERROR("Error reading MSR\n");
-		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
-		send_response(fd, data);
+		value = regs->msr;
 		break;
 
 	case 0x42:
 		/* Get CR */
-		if (thread_getcr(thread_target, (uint32_t *)&value))
-			PR_ERROR("Error reading CR \n");
-		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
-		send_response(fd, data);
+		value = regs->cr;
 		break;
 
 	case 0x43:
 		/* Get LR */
-		if (thread_getspr(thread_target, 8, &value))
-			PR_ERROR("Error reading LR\n");
-		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
-		send_response(fd, data);
+		value = regs->lr;
 		break;
 
 	case 0x44:
 		/* Get CTR */
-		if (thread_getspr(thread_target, 9, &value))
-			PR_ERROR("Error reading CTR\n");
-		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
-		send_response(fd, data);
+		value = regs->ctr;
 		break;
 
 	case 0x45:
@@ -171,16 +442,14 @@ static void get_spr(uint64_t *stack, void *priv)
 		 * is in latches that we need to stop the clocks to get. Probably
 		 * not helpful to only return part of a register in a debugger so
 		 * return unavailable. */
-		send_response(fd, "xxxxxxxxxxxxxxxx");
-		break;
-
 	default:
 		send_response(fd, "xxxxxxxxxxxxxxxx");
-		break;
+		return;
 	}
-}
 
-#define MAX_DATA 0x1000
+	snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
+	send_response(fd, data);
+}
 
 /* Returns a real address to use with mem_read or -1UL if we
  * couldn't determine a real address. At the moment we only deal with
@@ -199,81 +468,240 @@ static uint64_t get_real_addr(uint64_t addr)
 	return addr;
 }
 
-static void get_mem(uint64_t *stack, void *priv)
+static uint64_t mem_data[BUFFER_SIZE / sizeof(uint64_t)];
+static char mem_reply[BUFFER_SIZE];
+
+/*
+ * While the threads are stopped gdb reads the same stack and code again
+ * and again, so memory read is kept by cache line until the threads run
+ * or memory is written.  Lines of virtual addresses belong to the thread
+ * they were translated for.
+ */
+#define MEM_CACHE_LINE		128
+#define MEM_CACHE_LINES		256
+
+struct mem_cache_line {
+	uint64_t addr;
+	struct gdb_thread *thread;
+	unsigned int generation;
+	uint8_t data[MEM_CACHE_LINE];
+};
+
+static struct mem_cache_line mem_cache[MEM_CACHE_LINES];
+static unsigned int mem_cache_generation = 1;
+static unsigned long mem_cache_hits, mem_cache_misses;
+
+/* Lines around a request which are read in one go */
+static uint64_t mem_fill[(BUFFER_SIZE + 2 * MEM_CACHE_LINE) / sizeof(uint64_t)];
+
+static void mem_cache_invalidate(void)
 {
-	uint64_t addr, len, linear_map;
-	int i, err = 0;
-	uint64_t data[MAX_DATA/sizeof(uint64_t)];
-	char result[2*MAX_DATA];
+	if (mem_cache_hits || mem_cache_misses)
+		PR_INFO("Memory cache: %lu hits, %lu misses\n",
+			mem_cache_hits, mem_cache_misses);
 
-	/* stack[0] is the address and stack[1] is the length */
-	addr = stack[0];
-	len = stack[1];
+	mem_cache_generation++;
+	mem_cache_hits = 0;
+	mem_cache_misses = 0;
+}
 
-	if (len > MAX_DATA) {
-		PR_INFO("Too much memory requested, truncating\n");
-		len = MAX_DATA;
-	}
+static struct mem_cache_line *mem_cache_lookup(uint64_t addr, struct gdb_thread *thread)
+{
+	struct mem_cache_line *line;
 
-	if (!addr) {
-		err = 2;
-		goto out;
-	}
+	line = &mem_cache[(addr / MEM_CACHE_LINE) % MEM_CACHE_LINES];
+	if (line->generation != mem_cache_generation ||
+	    line->addr != addr || line->thread != thread)
+		return NULL;
+
+	return line;
+}
+
+static void mem_cache_fill(uint64_t addr, struct gdb_thread *thread, const uint8_t *data)
+{
+	struct mem_cache_line *line;
+
+	line = &mem_cache[(addr / MEM_CACHE_LINE) % MEM_CACHE_LINES];
+	line->addr = addr;
+	line->thread = thread;
+	line->generation = mem_cache_generation;
+	memcpy(line->data, data, MEM_CACHE_LINE);
+}
+
+/*
+ * Reads len bytes at addr into buf, which has room for len rounded up to
+ * a doubleword.  Returns 0 or a gdb error.
+ */
+static int read_mem_uncached(uint64_t addr, uint64_t *buf, uint64_t len)
+{
+	uint64_t linear_map;
+	int i;
 
 	linear_map = get_real_addr(addr);
 	if (linear_map != -1UL) {
-		if (mem_read(adu_target, linear_map, (uint8_t *) data, len, 0, false)) {
+		if (mem_read(adu_target, linear_map, (uint8_t *) buf, len, 0, false)) {
 			PR_ERROR("Unable to read memory\n");
-			err = 1;
+			return 1;
 		}
 	} else {
 		/* Virtual address */
 		for (i = 0; i < len; i += sizeof(uint64_t)) {
-			if (thread_getmem(thread_target, addr, &data[i/sizeof(uint64_t)])) {
+			if (thread_getmem(thread_g->target, addr + i, &buf[i/sizeof(uint64_t)])) {
 				PR_ERROR("Fault reading memory\n");
-				err = 2;
-				break;
+				return 2;
 			}
 		}
 	}
 
-out:
-	if (!err)
-		for (i = 0; i < len; i ++) {
-			sprintf(&result[i*2], "%02x", *(((uint8_t *) data) + i));
+	return 0;
+}
+
+/* Reads len bytes at addr into mem_data, returns 0 or a gdb error */
+static int read_mem(uint64_t addr, uint64_t len)
+{
+	uint64_t start, end, line_addr, miss = 0;
+	struct gdb_thread *thread;
+	struct mem_cache_line *line;
+	uint8_t *fill = (uint8_t *) mem_fill;
+	bool missed = false;
+
+	if (!addr)
+		return 2;
+
+	thread = get_real_addr(addr) == -1UL ? thread_g : NULL;
+	start = addr & ~(uint64_t) (MEM_CACHE_LINE - 1);
+	end = (addr + len + MEM_CACHE_LINE - 1) & ~(uint64_t) (MEM_CACHE_LINE - 1);
+
+	/* Read the lines from the first one missing to the last one missing */
+	for (line_addr = start; line_addr < end; line_addr += MEM_CACHE_LINE) {
+		line = mem_cache_lookup(line_addr, thread);
+		if (line) {
+			mem_cache_hits++;
+			memcpy(fill + (line_addr - start), line->data, MEM_CACHE_LINE);
+			continue;
 		}
-	else
-		sprintf(result, "E%02x", err);
 
-	send_response(fd, result);
+		mem_cache_misses++;
+		if (!missed)
+			miss = line_addr;
+		missed = true;
+	}
+
+	if (missed) {
+		uint64_t miss_end = end;
+
+		while (miss_end > miss && mem_cache_lookup(miss_end - MEM_CACHE_LINE, thread))
+			miss_end -= MEM_CACHE_LINE;
+
+		/* Whole lines may not be readable, fall back to what was asked for */
+		if (read_mem_uncached(miss, mem_fill + (miss - start) / sizeof(uint64_t),
+				      miss_end - miss))
+			return read_mem_uncached(addr, mem_data, len);
+
+		for (line_addr = miss; line_addr < miss_end; line_addr += MEM_CACHE_LINE)
+			mem_cache_fill(line_addr, thread, fill + (line_addr - start));
+	}
+
+	memcpy(mem_data, fill + (addr - start), len);
+
+	return 0;
 }
 
-static void put_mem(uint64_t *stack, void *priv)
+static void get_mem(uint64_t *stack, void *priv)
 {
 	uint64_t addr, len;
-	uint8_t *data;
-	uint8_t attn_opcode[] = {0x00, 0x00, 0x02, 0x00};
-	int err = 0;
-	struct thread *thread = target_to_thread(thread_target);
-
-	if (littleendian) {
-		attn_opcode[1] = 0x02;
-		attn_opcode[2] = 0x00;
-	}
+	int err;
 
+	/* stack[0] is the address and stack[1] is the length */
 	addr = stack[0];
 	len = stack[1];
-	data = (uint8_t *) &stack[2];
+
+	/* Two hex digits per byte, gdb reads the rest with another packet */
+	if (len > BUFFER_SIZE / 2)
+		len = BUFFER_SIZE / 2;
+
+	err = read_mem(addr, len);
+	if (err) {
+		sprintf(mem_reply, "E%02x", err);
+		send_response(fd, mem_reply);
+		return;
+	}
+
+	send_packet(fd, mem_reply, hex_encode(mem_reply, (uint8_t *) mem_data, len));
+}
+
+static void get_mem_binary(struct gdb_packet *packet)
+{
+	uint64_t addr, len;
+	size_t n;
+	char *end;
+	int err;
+
+	/* x<addr>,<length> */
+	addr = strtoull(packet->data + 1, &end, 16);
+	if (*end != ',') {
+		send_response(fd, ERROR(EPERM));
+		return;
+	}
+	len = strtoull(end + 1, NULL, 16);
+
+	/* The reply starts with 'b' and may be shorter than asked for */
+	if (len > BUFFER_SIZE - 1)
+		len = BUFFER_SIZE - 1;
+
+	err = len ? read_mem(addr, len) : 0;
+	if (err) {
+		sprintf(mem_reply, "E%02x", err);
+		send_response(fd, mem_reply);
+		return;
+	}
+
+	mem_reply[0] = 'b';
+	binary_encode(mem_reply + 1, BUFFER_SIZE - 1, (uint8_t *) mem_data, len, &n);
+	send_packet(fd, mem_reply, n + 1);
+}
+
+/* Breakpoints may be hit by any of the threads */
+static int enable_attn(void)
+{
+	int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct thread *thread = target_to_thread(threads[i].target);
+
+		if (!thread->enable_attn) {
+			PR_ERROR("Breakpoints are not supported on %s\n",
+				 pdbg_target_path(threads[i].target));
+			return -1;
+		}
+
+		if (thread->enable_attn(thread))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* attn in either byte order */
+static const uint8_t attn_le[] = {0x00, 0x02, 0x00, 0x00};
+static const uint8_t attn_be[] = {0x00, 0x00, 0x02, 0x00};
+
+/* Writes len bytes of data to addr, returns 0 or a gdb error */
+static int write_mem(uint64_t addr, uint8_t *data, uint64_t len)
+{
+	/* tw 12,r2,r2 in either byte order */
+	static const uint8_t trap_le[] = {0x08, 0x10, 0x82, 0x7d};
+	static const uint8_t trap_be[] = {0x7d, 0x82, 0x10, 0x08};
 
 	addr = get_real_addr(addr);
 	if (addr == -1UL) {
 		PR_ERROR("TODO: No virtual address support for putmem\n");
-		err = 1;
-		goto out;
+		return 1;
 	}
 
+	mem_cache_invalidate();
 
-	if (len == 4 && stack[2] == 0x0810827d) {
+	if (len == 4 && !memcmp(data, littleendian ? trap_le : trap_be, 4)) {
 		/* According to linux-ppc-low.c gdb only uses this
 		 * op-code for sw break points so we replace it with
 		 * the correct attn opcode which is what we need for
@@ -282,85 +710,224 @@ static void put_mem(uint64_t *stack, void *priv)
 		 * TODO: Upstream a patch to gdb so that it uses the
 		 * right opcode for baremetal debug. */
 		PR_INFO("Breakpoint opcode detected, replacing with attn\n");
-		data = attn_opcode;
+		data = (uint8_t *) (littleendian ? attn_le : attn_be);
 
 		/* Need to enable the attn instruction in HID0 */
-		if (thread->enable_attn(thread))
-			goto out;
-	} else
-		stack[2] = __builtin_bswap64(stack[2]) >> 32;
-
-	PR_INFO("put_mem 0x%016" PRIx64 " = 0x%016" PRIx64 "\n", addr, stack[2]);
+		if (enable_attn())
+			return 2;
+	}
 
 	if (mem_write(adu_target, addr, data, len, 0, false)) {
 		PR_ERROR("Unable to write memory\n");
-		err = 3;
+		return 3;
 	}
 
-out:
-	if (err)
+	return 0;
+}
+
+static void put_mem(uint64_t *stack, void *priv)
+{
+	uint64_t addr, len;
+
+	addr = stack[0];
+	len = stack[1];
+
+	/* The data was parsed as a number, put it back in memory order */
+	stack[2] = __builtin_bswap64(stack[2]) >> 32;
+
+	PR_INFO("put_mem 0x%016" PRIx64 " = 0x%016" PRIx64 "\n", addr, stack[2]);
+
+	if (write_mem(addr, (uint8_t *) &stack[2], len))
 		send_response(fd, ERROR(EPERM));
 	else
 		send_response(fd, OK);
 }
 
+static void put_mem_binary(struct gdb_packet *packet)
+{
+	uint64_t addr, len;
+	char *end;
+
+	/* X<addr>,<length>:<binary data> */
+	addr = strtoull(packet->data + 1, &end, 16);
+	if (*end != ',')
+		goto err;
+
+	len = strtoull(end + 1, &end, 16);
+	if (*end != ':')
+		goto err;
+
+	end++;
+	if (binary_decode((uint8_t *) mem_data, end, packet->data + packet->len - end) != len)
+		goto err;
+
+	PR_INFO("put_mem 0x%016" PRIx64 ", %" PRIu64 " bytes\n", addr, len);
+
+	/* gdb checks for X support with an empty write */
+	if (len && write_mem(addr, (uint8_t *) mem_data, len))
+		goto err;
+
+	send_response(fd, OK);
+	return;
+
+err:
+	send_response(fd, ERROR(EPERM));
+}
+
 static void v_conts(uint64_t *stack, void *priv)
 {
-	thread_step(thread_target, 1);
-	send_response(fd, TRAP);
+	struct gdb_packet *packet = priv;
+	struct gdb_thread *thread = thread_c ? thread_c : thread_g;
+	char *tid;
+
+	/* vCont;s[:<thread-id>] or vCont;S<sig>[:<thread-id>], other
+	 * threads stay stopped */
+	tid = packet->data + strlen("vCont;s");
+	tid += strspn(tid, "0123456789abcdefABCDEF");
+	if (*tid == ':') {
+		long id = parse_thread_id(tid + 1, NULL);
+
+		if (id > 0)
+			thread = gdb_thread_get(id);
+		if (!thread) {
+			send_response(fd, ERROR(EPERM));
+			return;
+		}
+	}
+
+	thread->regs_valid = false;
+	mem_cache_invalidate();
+	thread_step(thread->target, 1);
+	thread_g = thread;
+	send_stop(thread);
 }
 
-#define VCONT_POLL_DELAY 100000
 static void v_contc(uint64_t *stack, void *priv)
 {
-	thread_start(thread_target);
-	state = SIGNAL_WAIT;
-	poll_interval = 1;
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		threads[i].trapped = false;
+
+	gdb_threads_invalidate();
+	mem_cache_invalidate();
+	thread_start_all();
+	poll_start();
 }
 
 static void interrupt(uint64_t *stack, void *priv)
 {
 	PR_INFO("Interrupt\n");
-	thread_stop(thread_target);
-	send_response(fd, TRAP);
+	poll_stop();
+	thread_stop_all();
+	gdb_threads_invalidate();
+	mem_cache_invalidate();
+	send_stop(thread_g);
 
 	return;
 }
 
+/*
+ * Returns true if the thread stopped on one of the breakpoints, the
+ * instruction before its NIA being attn.
+ */
+static bool thread_hit_attn(struct gdb_thread *thread, uint64_t nia)
+{
+	/* Virtual addresses are translated by thread_g */
+	thread_g = thread;
+	if (read_mem(nia - 4, 4))
+		return false;
+
+	return !memcmp(mem_data, littleendian ? attn_le : attn_be, 4);
+}
+
 static void poll(void)
 {
-	uint64_t nia;
+	struct gdb_thread *stopped = NULL;
 	struct thread_state status;
-
-	thread_target->probe(thread_target);
-	status = thread_status(thread_target);
+	uint64_t nia;
+	int i;
 
 	switch (state) {
 	case IDLE:
 		break;
 
 	case SIGNAL_WAIT:
-		if (!(status.quiesced))
+		for (i = 0; i < nr_threads; i++) {
+			struct gdb_thread *thread = &threads[i];
+
+			/* Probing again refreshes the status */
+			if (thread->target->probe)
+				thread->target->probe(thread->target);
+			status = thread_status(thread->target);
+			if (!status.quiesced)
+				continue;
+
+			if (!status.active) {
+				PR_ERROR("Thread %d inactive after trap\n",
+					 gdb_thread_id(thread));
+				poll_stop();
+				send_response(fd, ERROR(EPERM));
+				return;
+			}
+
+			thread->trapped = true;
+			if (!stopped)
+				stopped = thread;
+		}
+
+		if (!stopped) {
+			/* Still running, check again later */
+			poll_delay_ms *= 2;
+			if (poll_delay_ms > POLL_DELAY_MAX_MS)
+				poll_delay_ms = POLL_DELAY_MAX_MS;
+			poll_timer_set(poll_delay_ms);
 			break;
+		}
 
-		state = IDLE;
-		poll_interval = VCONT_POLL_DELAY;
-		if (!(status.active)) {
-			PR_ERROR("Thread inactive after trap\n");
-			send_response(fd, ERROR(EPERM));
-			return;
+		/* All-stop, one thread trapping stops the others */
+		poll_stop();
+		thread_stop_all();
+
+		/*
+		 * Rewind the threads which hit a breakpoint to the attn, the
+		 * others stopped for another reason and are left alone.
+		 */
+		for (i = 0; i < nr_threads; i++) {
+			struct gdb_thread *thread = &threads[i];
+
+			if (!thread->trapped)
+				continue;
+
+			if (thread_getnia(thread->target, &nia)) {
+				PR_ERROR("Error during getnia\n");
+				continue;
+			}
+
+			if (!thread_hit_attn(thread, nia))
+				continue;
+
+			if (thread_putnia(thread->target, nia - 4))
+				PR_ERROR("Error during putnia\n");
 		}
 
-		/* Restore NIA */
-		if (thread_getnia(thread_target, &nia))
-			PR_ERROR("Error during getnia\n");
-		if (thread_putnia(thread_target, nia - 4))
-			PR_ERROR("Error during putnia\n");
-		send_response(fd, TRAP);
+		thread_g = stopped;
+		send_stop(stopped);
 		break;
 	}
 }
 
+static void v_cont(struct gdb_packet *packet)
+{
+	char action = packet->data[strlen("vCont;")];
+
+	/* Any action for the other threads is implied, see v_conts() */
+	if (action == 's' || action == 'S')
+		v_conts(NULL, packet);
+	else
+		v_contc(NULL, packet);
+}
+
 static void cmd_default(uint64_t *stack, void *priv)
 {
 	uintptr_t tmp = stack[0];
@@ -374,6 +941,9 @@ static void create_client(int new_fd)
 {
 	PR_INFO("Client connected\n");
 	fd = new_fd;
+
+	/* Memory may have been changed while nobody was looking */
+	mem_cache_invalidate();
 }
 
 static void destroy_client(int dead_fd)
@@ -381,27 +951,179 @@ static void destroy_client(int dead_fd)
 	PR_INFO("Client disconnected\n");
 	close(dead_fd);
 	fd = -1;
+
+	/* Nobody to report a stop to */
+	poll_stop();
 }
 
+static void q_xfer_threads(struct gdb_packet *packet)
+{
+	uint64_t offset, length;
+	char *xml, *end;
+	size_t len, n, done;
+	FILE *f;
+	int i;
+
+	/* qXfer:threads:read::<offset>,<length> */
+	offset = strtoull(packet->data + strlen("qXfer:threads:read::"), &end, 16);
+	if (*end != ',') {
+		send_response(fd, ERROR(EPERM));
+		return;
+	}
+	length = strtoull(end + 1, NULL, 16);
+
+	f = open_memstream(&xml, &len);
+	if (!f) {
+		send_response(fd, ERROR(EPERM));
+		return;
+	}
+
+	fprintf(f, "<?xml version=\"1.0\"?>\n<threads>\n");
+	for (i = 0; i < nr_threads; i++)
+		fprintf(f, "<thread id=\"%x\" name=\"%s\"/>\n",
+			gdb_thread_id(&threads[i]), pdbg_target_path(threads[i].target));
+	fprintf(f, "</threads>\n");
+	fclose(f);
+
+	if (offset >= len) {
+		send_response(fd, "l");
+		free(xml);
+		return;
+	}
+
+	if (length > len - offset)
+		length = len - offset;
+
+	/* 'm' if there is more to read, 'l' for the last part */
+	done = binary_encode(mem_reply + 1, BUFFER_SIZE - 1, (uint8_t *) xml + offset,
+			     length, &n);
+	mem_reply[0] = (offset + done < len) ? 'm' : 'l';
+	send_packet(fd, mem_reply, n + 1);
+	free(xml);
+}
+
+/*
+ * Packets answered here rather than by the parser, which either has canned
+ * single thread answers for them or does not answer them at all.
+ */
+static const struct {
+	const char *name;
+	bool prefix;
+	void (*fn)(struct gdb_packet *packet);
+} queries[] = {
+	{ "qSupported",		true,	q_supported },
+	{ "vCont?",		false,	v_cont_query },
+	{ "vCont;",		true,	v_cont },
+	{ "qC",			false,	q_current_thread },
+	{ "qfThreadInfo",	false,	q_thread_info },
+	{ "qsThreadInfo",	false,	q_thread_info },
+	{ "T",			true,	thread_alive },
+	{ "x",			true,	get_mem_binary },
+	{ "X",			true,	put_mem_binary },
+	{ "qXfer:threads:read::", true,	q_xfer_threads },
+};
+
+static bool handle_query(struct gdb_packet *packet)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(queries); i++) {
+		len = strlen(queries[i].name);
+		if (packet->len < len || (!queries[i].prefix && packet->len != len))
+			continue;
+
+		if (!strncmp(packet->data, queries[i].name, len))
+			break;
+	}
+
+	if (i == ARRAY_SIZE(queries))
+		return false;
+
+	if (!packet_crc_ok(packet)) {
+		send_nack(packet);
+		return true;
+	}
+
+	send_ack(packet);
+	queries[i].fn(packet);
+
+	return true;
+}
+
+/* start points to the '$' of a complete packet of len bytes */
+static void dispatch_packet(char *start, size_t len)
+{
+	static char buffer[BUFFER_SIZE + 6];
+	struct gdb_packet packet;
+
+	/*
+	 * The parser only matches a packet which follows some other input,
+	 * so precede it with the ack gdb sends.  It reads up to a
+	 * terminating nul.
+	 */
+	buffer[0] = '+';
+	memcpy(buffer + 1, start, len);
+	buffer[len + 1] = '\0';
+	packet.data = buffer + 2;
+	packet.len = len - 4;
+
+	PR_INFO("Recv: %s\n", buffer + 1);
+
+	if (handle_query(&packet))
+		return;
+
+	parse_buffer(buffer, len + 1, &packet);
+}
+
+/*
+ * Client input is split into packets, which may span several reads, and
+ * handed to the parser one at a time so the callbacks get the packet.
+ */
+static char input[BUFFER_SIZE + 4];
+static size_t input_len;
+
 static int read_from_client(int fd)
 {
-	char buffer[BUFFER_SIZE + 1];
+	char *p, *end, *hash;
 	int nbytes;
 
-	nbytes = read(fd, buffer, sizeof(buffer));
+	nbytes = read(fd, input + input_len, sizeof(input) - input_len);
 	if (nbytes < 0) {
 		perror(__FUNCTION__);
 		return -1;
 	} else if (nbytes == 0) {
 		PR_INFO("0 bytes\n");
+		input_len = 0;
 		return -1;
-	} else {
-		buffer[nbytes] = '\0';
-		PR_INFO("%x\n", buffer[0]);
-		PR_INFO("Recv: %s\n", buffer);
-		parse_buffer(buffer, nbytes, &fd);
 	}
 
+	p = input;
+	end = input + input_len + nbytes;
+	while (p < end) {
+		if (*p == '$') {
+			hash = memchr(p, '#', end - p);
+			if (!hash || end - hash < 3)
+				break;
+
+			dispatch_packet(p, hash + 3 - p);
+			p = hash + 3;
+		} else {
+			/* We ignore ACK/NACK */
+			if (*p == 3)
+				interrupt(NULL, NULL);
+			p++;
+		}
+	}
+
+	input_len = end - p;
+	if (input_len == sizeof(input)) {
+		PR_ERROR("Packet too large\n");
+		send_nack(NULL);
+		input_len = 0;
+	}
+	memmove(input, p, input_len);
+
 	return 0;
 }
 
@@ -419,14 +1141,31 @@ command_cb callbacks[LAST_CMD + 1] = {
 	disconnect,
 	NULL};
 
-int gdbserver_start(struct pdbg_target *thread, struct pdbg_target *adu, uint16_t port)
+static int epoll_add(int epoll_fd, int new_fd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.fd = new_fd,
+	};
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev) < 0) {
+		perror(__FUNCTION__);
+		return -1;
+	}
+
+	return 0;
+}
+
+int gdbserver_start(struct pdbg_target *adu, uint16_t port)
 {
-	int sock, i;
+	int sock, epoll_fd, i, n;
 	struct sockaddr_in name;
-	fd_set active_fd_set, read_fd_set;
+	struct epoll_event events[4];
+	uint64_t expirations;
 
 	parser_init(callbacks);
-	thread_target = thread;
+	thread_g = &threads[0];
+	thread_c = NULL;
 	adu_target = adu;
 
 	sock = socket(PF_INET, SOCK_STREAM, 0);
@@ -448,45 +1187,54 @@ int gdbserver_start(struct pdbg_target *thread, struct pdbg_target *adu, uint16_
 		return -1;
 	}
 
-	FD_ZERO(&active_fd_set);
-	FD_SET(sock, &active_fd_set);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (timer_fd < 0 || epoll_fd < 0) {
+		perror(__FUNCTION__);
+		return -1;
+	}
+
+	if (epoll_add(epoll_fd, sock) || epoll_add(epoll_fd, timer_fd))
+		return -1;
 
 	while (1) {
-		read_fd_set = active_fd_set;
-		timeout.tv_sec = 0;
-		timeout.tv_usec = poll_interval;
-		if (select(FD_SETSIZE, &read_fd_set, NULL, NULL, &timeout) < 0) {
+		/* Sleeps until the client sends something or the timer fires */
+		n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			perror(__FUNCTION__);
 			return -1;
 		}
 
-		for (i = 0; i < FD_SETSIZE; i++) {
-			if (FD_ISSET(i, &read_fd_set)) {
-				if (i == sock) {
-					int new;
-					new = accept(sock, NULL, NULL);
-					if (new < 0) {
-						perror(__FUNCTION__);
-						return -1;
-					}
-
-					if (fd > 0)
-						/* It only makes sense to accept a single client */
-						close(new);
-					else {
-						create_client(new);
-						FD_SET(new, &active_fd_set);
-					}
-				} else {
-					if (read_from_client(i) < 0) {
-						destroy_client(i);
-						FD_CLR(i, &active_fd_set);
-					}
+		for (i = 0; i < n; i++) {
+			int ready = events[i].data.fd;
+
+			if (ready == sock) {
+				int new;
+				new = accept(sock, NULL, NULL);
+				if (new < 0) {
+					perror(__FUNCTION__);
+					return -1;
+				}
+
+				if (fd > 0)
+					/* It only makes sense to accept a single client */
+					close(new);
+				else if (!epoll_add(epoll_fd, new))
+					create_client(new);
+				else
+					close(new);
+			} else if (ready == timer_fd) {
+				if (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+					poll();
+			} else {
+				if (read_from_client(ready) < 0) {
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ready, NULL);
+					destroy_client(ready);
 				}
 			}
 		}
-
-		poll();
 	}
 
 	return 1;
@@ -494,36 +1242,38 @@ int gdbserver_start(struct pdbg_target *thread, struct pdbg_target *adu, uint16_
 
 static int gdbserver(uint16_t port)
 {
-	struct pdbg_target *target, *adu, *thread = NULL;
+	struct pdbg_target *target, *adu;
 	uint64_t msr;
 	int rc;
 
 	for_each_path_target_class("thread", target) {
+		struct gdb_thread *tmp;
+
 		if (pdbg_target_probe(target) != PDBG_TARGET_ENABLED)
 			continue;
 
-		if (!thread) {
-			thread = target;
-		} else {
-			fprintf(stderr, "GDB server cannot be run on multiple threads at once.\n");
-			return 0;
+		/* Inactive threads can't be stopped, stepped or rammed */
+		if (!thread_status(target).active)
+			continue;
+
+		tmp = realloc(threads, (nr_threads + 1) * sizeof(*threads));
+		if (!tmp) {
+			PR_ERROR("Unable to allocate threads\n");
+			return 1;
 		}
+
+		threads = tmp;
+		memset(&threads[nr_threads], 0, sizeof(*threads));
+		threads[nr_threads++].target = target;
 	}
 
-	if (!thread) {
+	if (!nr_threads) {
 		fprintf(stderr, "No thread selected\n");
 		return 0;
 	}
 
-	//
-	// Temporary until I can get this working a bit smoother on p9
-	if (strcmp(thread->compatible, "ibm,power8-thread")) {
-		PR_ERROR("GDBSERVER is only tested on POWER8\n");
-		return -1;
-	}
-
 	/* Check endianess in MSR */
-	rc = thread_getmsr(thread, &msr);
+	rc = thread_getmsr(threads[0].target, &msr);
 	if (rc) {
 		PR_ERROR("Couldn't read the MSR. Are all threads on this chiplet quiesced?\n");
 		return 1;
@@ -541,7 +1291,7 @@ static int gdbserver(uint16_t port)
 		return 0;
 	}
 
-	gdbserver_start(thread, adu, port);
+	gdbserver_start(adu, port);
 	return 0;
 }
 #else
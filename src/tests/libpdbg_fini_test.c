@@ -0,0 +1,111 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <libpdbg.h>
+
+#define MAX_PATHS	1024
+
+struct paths {
+	char *path[MAX_PATHS];
+	int count;
+};
+
+static int save_path(struct pdbg_target *target, void *priv)
+{
+	struct paths *paths = (struct paths *)priv;
+
+	assert(paths->count < MAX_PATHS);
+	paths->path[paths->count] = strdup(pdbg_target_path(target));
+	assert(paths->path[paths->count]);
+	paths->count++;
+
+	return 0;
+}
+
+static int count_class_target(const char *classname)
+{
+	struct pdbg_target *target;
+	int n = 0;
+
+	pdbg_for_each_class_target(classname, target)
+		n++;
+
+	return n;
+}
+
+static void init_targets(struct paths *paths)
+{
+	struct pdbg_target *root;
+
+	assert(pdbg_set_backend(PDBG_BACKEND_FAKE, NULL));
+	assert(pdbg_targets_init(NULL));
+
+	root = pdbg_target_root();
+	assert(root);
+
+	pdbg_target_probe_all(root);
+
+	assert(count_class_target("fsi") == 8);
+	assert(count_class_target("pib") == 8);
+	assert(count_class_target("core") == 32);
+	assert(count_class_target("thread") == 64);
+
+	paths->count = 0;
+	pdbg_target_traverse(NULL, save_path, paths);
+	assert(paths->count > 0);
+}
+
+int main(void)
+{
+	struct paths first, second;
+	struct pdbg_target *target;
+	int i;
+
+	init_targets(&first);
+
+	target = pdbg_target_from_path(NULL, "/proc0/pib/core@10010/thread@0");
+	assert(target);
+	assert(pdbg_target_status(target) == PDBG_TARGET_ENABLED);
+
+	pdbg_targets_fini();
+	assert(pdbg_target_root() == NULL);
+
+	/* A second fini does nothing */
+	pdbg_targets_fini();
+
+	/* The tree can be created again and comes out the same */
+	init_targets(&second);
+
+	assert(first.count == second.count);
+	for (i = 0; i < first.count; i++) {
+		assert(!strcmp(first.path[i], second.path[i]));
+		free(first.path[i]);
+		free(second.path[i]);
+	}
+
+	target = pdbg_target_from_path(NULL, "/proc0/pib/core@10010/thread@0");
+	assert(target);
+	assert(pdbg_target_status(target) == PDBG_TARGET_ENABLED);
+
+	pdbg_targets_fini();
+
+	return 0;
+}
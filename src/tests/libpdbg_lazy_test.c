@@ -0,0 +1,79 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <libpdbg.h>
+
+static const char *classes[] = {
+	"fsi", "pib", "core", "thread", "chiplet", "adu", "mem", NULL,
+};
+
+static int print_target(struct pdbg_target *target, void *priv)
+{
+	const char *class = pdbg_target_class_name(target);
+
+	printf("%s %s %d %d\n", pdbg_target_path(target), class ? class : "-",
+	       pdbg_target_index(target), pdbg_target_status(target));
+	return 0;
+}
+
+static void print_class(const char *class, struct pdbg_target *parent)
+{
+	struct pdbg_target *target;
+
+	pdbg_for_each_target(class, parent, target)
+		printf("%s: %s\n", class, pdbg_target_path(target));
+}
+
+/*
+ * Dump the tree and class lists, optionally after looking up a target
+ * first.  The output must not depend on whether targets are lazy.
+ */
+int main(int argc, const char **argv)
+{
+	struct pdbg_target *target;
+	int i;
+
+	if (argc > 1 && !strcmp(argv[1], "-l")) {
+		pdbg_set_lazy_targets(true);
+		argc--;
+		argv++;
+	}
+
+	pdbg_set_backend(PDBG_BACKEND_KERNEL, NULL);
+	assert(pdbg_targets_init(NULL));
+
+	for (i = 1; i < argc; i++) {
+		target = pdbg_target_from_path(NULL, argv[i]);
+		printf("%s: %s\n", argv[i], target ? pdbg_target_path(target) : "not found");
+	}
+
+	pdbg_target_traverse(NULL, print_target, NULL);
+
+	for (i = 0; classes[i]; i++)
+		print_class(classes[i], NULL);
+
+	target = pdbg_target_from_path(NULL, "/proc1");
+	if (target) {
+		for (i = 0; classes[i]; i++)
+			print_class(classes[i], target);
+	}
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <libpdbg.h>
+
+static int counts[PDBG_DEBUG + 1];
+
+static void count_log(int loglevel, const char *fmt, va_list ap)
+{
+	assert(loglevel >= PDBG_ERROR && loglevel <= PDBG_DEBUG);
+	counts[loglevel]++;
+}
+
+/* Count the messages logged by accessing the hardware */
+static void access_targets(int loglevel)
+{
+	struct pdbg_target *target;
+	uint64_t value;
+	uint32_t value32;
+
+	memset(counts, 0, sizeof(counts));
+	pdbg_set_loglevel(loglevel);
+
+	pdbg_for_each_class_target("pib", target)
+		assert(pib_read(target, 0x1000, &value) == 0);
+
+	pdbg_for_each_class_target("core", target)
+		assert(pib_write(target, 0x10, 0) == 0);
+
+	pdbg_for_each_class_target("fsi", target)
+		assert(fsi_read(target, 0x1000, &value32) == 0);
+
+	pdbg_set_loglevel(PDBG_ERROR);
+}
+
+int main(void)
+{
+	int i;
+
+	pdbg_set_logfunc(count_log);
+
+	assert(pdbg_set_backend(PDBG_BACKEND_FAKE, NULL));
+	assert(pdbg_targets_init(NULL));
+	pdbg_target_probe_all(NULL);
+
+	access_targets(PDBG_ERROR);
+	for (i = PDBG_ERROR; i <= PDBG_DEBUG; i++)
+		assert(counts[i] == 0);
+
+	access_targets(PDBG_INFO);
+	assert(counts[PDBG_DEBUG] == 0);
+
+	access_targets(PDBG_DEBUG);
+#ifdef DISABLE_DEBUG_LOG
+	assert(counts[PDBG_DEBUG] == 0);
+#else
+	assert(counts[PDBG_DEBUG] > 0);
+#endif
+
+	return 0;
+}
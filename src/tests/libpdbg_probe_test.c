@@ -258,6 +258,13 @@ int main(void)
 		test2();
 	} else if (test_id == 3) {
 		test3();
+	} else if (test_id == 4) {
+		/* Same results probing processors in parallel */
+		pdbg_set_probe_threads(4);
+		test1();
+	} else if (test_id == 5) {
+		pdbg_set_probe_threads(4);
+		test3();
 	} else {
 		printf("No test for TEST_ID=%d\n", test_id);
 		return 1;
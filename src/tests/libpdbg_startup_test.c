@@ -0,0 +1,84 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include <libpdbg.h>
+
+static int count_target(struct pdbg_target *target, void *priv)
+{
+	int *count = (int *)priv;
+
+	(*count)++;
+	return 0;
+}
+
+static long elapsed_us(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000 +
+	       (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+int main(int argc, const char **argv)
+{
+	struct pdbg_stats stats;
+	struct timespec start, end;
+	long limit_ms = 0, took_us;
+	int count = 0;
+
+	if (argc >= 2 && !strcmp(argv[1], "-l")) {
+		pdbg_set_lazy_targets(true);
+		argc--;
+		argv++;
+	}
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [-l] [<limit-ms>]\n", argv[0]);
+		return 1;
+	}
+
+	/* Without a limit the time is only printed */
+	if (argc == 2)
+		limit_ms = atol(argv[1]);
+
+	pdbg_set_backend(PDBG_BACKEND_KERNEL, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	assert(pdbg_targets_init(NULL));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	took_us = elapsed_us(&start, &end);
+
+	pdbg_target_traverse(NULL, count_target, &count);
+	printf("%d targets\n", count);
+
+	pdbg_get_stats(&stats, sizeof(stats));
+
+	fprintf(stderr, "pdbg_targets_init took %ld us\n", took_us);
+	fprintf(stderr, "%" PRIu64 " hw unit lookups, %" PRIu64 " misses\n",
+		stats.hwunit_lookups, stats.hwunit_misses);
+	if (limit_ms && took_us > limit_ms * 1000) {
+		fprintf(stderr, "pdbg_targets_init took longer than %ld ms\n", limit_ms);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,273 @@
+/* Copyright 2020 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include <libpdbg.h>
+
+#define NUM_THREADS	8
+#define NUM_LOOPS	200
+
+static pthread_barrier_t start_barrier;
+
+static int count_class(const char *class)
+{
+	struct pdbg_target *target;
+	int count = 0;
+
+	pdbg_for_each_class_target(class, target)
+		count++;
+
+	return count;
+}
+
+/* Every thread does the same things to all targets at the same time */
+static void *stress_worker(void *arg)
+{
+	struct pdbg_target *target, *core;
+	uint64_t value;
+	uint32_t value32;
+	int i;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < NUM_LOOPS; i++) {
+		pdbg_for_each_class_target("core", core) {
+			assert(pdbg_target_probe(core) == PDBG_TARGET_ENABLED);
+			assert(pdbg_target_path(core));
+			assert(pdbg_target_index(core) < 4);
+			assert(pdbg_target_status(core) == PDBG_TARGET_ENABLED);
+
+			pdbg_for_each_target("thread", core, target)
+				assert(pdbg_target_probe(target) == PDBG_TARGET_ENABLED);
+		}
+
+		pdbg_for_each_class_target("pib", target) {
+			value = 0;
+			assert(pib_read(target, 0x1000, &value) == 0);
+			assert(value == 0xdeadbeef);
+			assert(pib_write(target, 0x1000, value) == 0);
+			assert(pib_write_mask(target, 0x1000, 0, 0xff) == 0);
+		}
+
+		pdbg_for_each_class_target("fsi", target) {
+			assert(fsi_read(target, 0x1000, &value32) == 0);
+			assert(value32 == 0xfeed0cfa);
+			assert(fsi_write_mask(target, 0x1000, 0, 0xff) == 0);
+		}
+
+		assert(count_class("thread") == 64);
+	}
+
+	return NULL;
+}
+
+static void test_stress(void)
+{
+	pthread_t threads[NUM_THREADS];
+	int i;
+
+	pthread_barrier_init(&start_barrier, NULL, NUM_THREADS + 1);
+
+	for (i = 0; i < NUM_THREADS; i++)
+		assert(pthread_create(&threads[i], NULL, stress_worker, NULL) == 0);
+
+	/* Probe everything while the others are using the targets */
+	pthread_barrier_wait(&start_barrier);
+	pdbg_target_probe_all(NULL);
+
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_barrier_destroy(&start_barrier);
+}
+
+struct access {
+	struct pdbg_target *pib;
+	int done;
+};
+
+static void *access_worker(void *arg)
+{
+	struct access *access = (struct access *)arg;
+	uint64_t value;
+
+	assert(pib_read(access->pib, 0x1000, &value) == 0);
+	__atomic_store_n(&access->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static bool access_done(struct access *access)
+{
+	return __atomic_load_n(&access->done, __ATOMIC_ACQUIRE);
+}
+
+/* Accesses to a locked pib wait, other pibs can still be used */
+static void test_lock(void)
+{
+	struct pdbg_target *pib0, *pib1;
+	struct access access0, access1;
+	pthread_t thread0, thread1;
+	int i;
+
+	pib0 = pdbg_target_from_path(NULL, "/proc0/pib");
+	pib1 = pdbg_target_from_path(NULL, "/proc1/pib");
+	assert(pib0 && pib1);
+
+	access0 = (struct access) { .pib = pib0 };
+	access1 = (struct access) { .pib = pib1 };
+
+	pdbg_target_lock(pib0);
+
+	assert(pthread_create(&thread0, NULL, access_worker, &access0) == 0);
+	assert(pthread_create(&thread1, NULL, access_worker, &access1) == 0);
+
+	for (i = 0; i < 5000 && !access_done(&access1); i++)
+		usleep(1000);
+	assert(access_done(&access1));
+
+	usleep(10000);
+	assert(!access_done(&access0));
+
+	pdbg_target_unlock(pib0);
+
+	pthread_join(thread0, NULL);
+	pthread_join(thread1, NULL);
+	assert(access_done(&access0));
+}
+
+/* The fake threads return registers made from their processor, core and thread index */
+static uint64_t thread_id(struct pdbg_target *thread)
+{
+	struct pdbg_target *core, *proc;
+
+	core = pdbg_target_require_parent("core", thread);
+	proc = pdbg_target_require_parent("proc", thread);
+
+	return (uint64_t)pdbg_target_index(proc) << 16 |
+	       pdbg_target_index(core) << 8 |
+	       pdbg_target_index(thread);
+}
+
+/* Every thread gets its own registers, read through several workers */
+static void test_getregs_list(void)
+{
+	struct pdbg_target *targets[64], *target;
+	struct thread_regs regs[64];
+	int rc[64];
+	unsigned int i, j, count = 0;
+
+	pdbg_for_each_class_target("thread", target) {
+		assert(count < 64);
+		assert(pdbg_target_probe(target) == PDBG_TARGET_ENABLED);
+		targets[count++] = target;
+	}
+	assert(count > 1);
+
+	for (i = 0; i < count; i++)
+		rc[i] = 1;
+	memset(regs, 0, sizeof(regs));
+
+	pdbg_set_probe_threads(4);
+	assert(thread_getregs_list(targets, count, regs, rc) == (int)count);
+	pdbg_set_probe_threads(1);
+
+	for (i = 0; i < count; i++) {
+		assert(rc[i] == 0);
+		assert(regs[i].nia == (0xfa6e000000000000ULL | thread_id(targets[i])));
+		for (j = 0; j < 32; j++)
+			assert(regs[i].gprs[j] == (thread_id(targets[i]) << 8 | j));
+	}
+}
+
+static void *release_worker(void *arg)
+{
+	struct pdbg_target *proc = (struct pdbg_target *)arg;
+
+	pdbg_target_release(proc);
+	return NULL;
+}
+
+/* Processors can be released at the same time */
+static void test_release(void)
+{
+	pthread_t threads[NUM_THREADS];
+	struct pdbg_target *proc, *target;
+	int i = 0;
+
+	pdbg_for_each_class_target("proc", proc) {
+		assert(i < NUM_THREADS);
+		assert(pthread_create(&threads[i++], NULL, release_worker, proc) == 0);
+	}
+
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	pdbg_for_each_class_target("thread", target)
+		assert(pdbg_target_status(target) == PDBG_TARGET_RELEASED);
+	pdbg_for_each_class_target("pib", target)
+		assert(pdbg_target_status(target) == PDBG_TARGET_RELEASED);
+}
+
+static int ticks;
+
+static void tick(uint64_t cur, uint64_t end)
+{
+	ticks++;
+}
+
+static void *tick_worker(void *arg)
+{
+	/* The callback of the main thread is not called here */
+	pdbg_progress_tick(1, 2);
+	return NULL;
+}
+
+static void test_progress_tick(void)
+{
+	pthread_t thread;
+
+	pdbg_set_progress_tick(tick);
+
+	assert(pthread_create(&thread, NULL, tick_worker, NULL) == 0);
+	pthread_join(thread, NULL);
+	assert(ticks == 0);
+
+	pdbg_progress_tick(1, 2);
+	assert(ticks == 1);
+
+	pdbg_set_progress_tick(NULL);
+}
+
+int main(void)
+{
+	assert(pdbg_set_backend(PDBG_BACKEND_FAKE, NULL));
+	assert(pdbg_targets_init(NULL));
+
+	test_stress();
+	test_lock();
+	test_getregs_list();
+	test_release();
+	test_progress_tick();
+
+	return 0;
+}
@@ -19,12 +19,14 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <endian.h>
+#include <string.h>
 
 #include <libpdbg.h>
 
 #include "main.h"
 #include "optcmd.h"
 #include "path.h"
+#include "progress.h"
 
 static bool is_real_address(struct thread_regs *regs, uint64_t addr)
 {
@@ -34,13 +36,78 @@ static bool is_real_address(struct thread_regs *regs, uint64_t addr)
 	return false;
 }
 
-static int load8(struct pdbg_target *target, uint64_t addr, uint64_t *value)
+/*
+ * Stacks are read a window at a time rather than 8 bytes per load.  Frames
+ * are usually close together so most loads hit the window read for an
+ * earlier frame, and as the unwind moves up the stack the next window is
+ * read before the frames reach it.
+ */
+#define STACK_WINDOW_SIZE	4096
+
+struct stack_cache {
+	struct pdbg_target *adu;
+	uint64_t base;
+	uint64_t len;
+	uint64_t last;
+	uint8_t data[2 * STACK_WINDOW_SIZE];
+};
+
+static int stack_cache_read(struct stack_cache *cache, uint64_t addr,
+			    uint8_t *buf, uint64_t size)
 {
-	if (mem_read(target, addr, (uint8_t *)value, 8, 0, false)) {
-		pdbg_log(PDBG_ERROR, "Unable to read memory address=%016" PRIx64 ".\n", addr);
-		return 0;
+	return mem_read(cache->adu, addr, buf, size, 0, false);
+}
+
+static void stack_cache_fill(struct stack_cache *cache, uint64_t addr)
+{
+	cache->base = addr & ~(uint64_t)(STACK_WINDOW_SIZE - 1);
+	cache->len = 0;
+
+	if (stack_cache_read(cache, cache->base, cache->data, STACK_WINDOW_SIZE))
+		return;
+
+	cache->len = STACK_WINDOW_SIZE;
+}
+
+/* Read the window above the cached one, dropping the lowest if full */
+static void stack_cache_prefetch(struct stack_cache *cache)
+{
+	if (cache->len == sizeof(cache->data)) {
+		memmove(cache->data, cache->data + STACK_WINDOW_SIZE, STACK_WINDOW_SIZE);
+		cache->base += STACK_WINDOW_SIZE;
+		cache->len -= STACK_WINDOW_SIZE;
 	}
 
+	if (stack_cache_read(cache, cache->base + cache->len,
+			     cache->data + cache->len, STACK_WINDOW_SIZE))
+		return;
+
+	cache->len += STACK_WINDOW_SIZE;
+}
+
+static bool stack_cache_hit(struct stack_cache *cache, uint64_t addr)
+{
+	return cache->len && addr >= cache->base &&
+	       addr - cache->base <= cache->len - 8;
+}
+
+static int load8(struct stack_cache *cache, uint64_t addr, uint64_t *value)
+{
+	if (!stack_cache_hit(cache, addr))
+		stack_cache_fill(cache, addr);
+
+	/* The window may not be readable as a whole, try just these bytes */
+	if (!stack_cache_hit(cache, addr))
+		return !stack_cache_read(cache, addr, (uint8_t *)value, 8);
+
+	memcpy(value, cache->data + (addr - cache->base), 8);
+
+	if (addr > cache->last &&
+	    cache->base + cache->len - addr <= STACK_WINDOW_SIZE / 2)
+		stack_cache_prefetch(cache);
+
+	cache->last = addr;
+
 	return 1;
 }
 
@@ -53,19 +120,55 @@ uint64_t flip_endian(uint64_t v)
 #endif
 }
 
-static int dump_stack(struct thread_regs *regs, struct pdbg_target *adu)
+struct stack_frame {
+	uint64_t sp;
+	uint64_t pc;
+	bool be;
+};
+
+/* The unwound stack of one thread, printed once all threads are done */
+struct stack_trace {
+	struct thread_regs *regs;
+	struct pdbg_target *adu;
+	struct stack_frame *frames;
+	int count;
+	bool not_stack;
+	bool failed;
+	uint64_t fail_addr;
+	uint64_t next_sp;
+};
+
+static void stack_trace_add(struct stack_trace *trace, uint64_t sp, uint64_t pc, bool be)
 {
+	trace->frames = realloc(trace->frames, (trace->count + 1) * sizeof(*trace->frames));
+	assert(trace->frames);
+
+	trace->frames[trace->count++] = (struct stack_frame) {
+		.sp = sp,
+		.pc = pc,
+		.be = be,
+	};
+}
+
+static void unwind_stack(struct stack_trace *trace)
+{
+	struct thread_regs *regs = trace->regs;
+	struct stack_cache *cache;
 	uint64_t next_sp = regs->gprs[1];
 	uint64_t pc;
 	bool finished = false;
 	bool prev_flip = false;
 
-	printf("STACK:           SP                NIA\n");
 	if (!(next_sp && is_real_address(regs, next_sp))) {
-		printf("SP:0x%016" PRIx64 " does not appear to be a stack\n", next_sp);
-		return 0;
+		trace->not_stack = true;
+		trace->next_sp = next_sp;
+		return;
 	}
 
+	cache = calloc(1, sizeof(*cache));
+	assert(cache);
+	cache->adu = trace->adu;
+
 	while (!finished) {
 		uint64_t sp = next_sp;
 		uint64_t tmp, tmp2;
@@ -79,10 +182,16 @@ static int dump_stack(struct thread_regs *regs, struct pdbg_target *adu)
 		if (!is_real_address(regs, sp))
 			break;
 
-		if (!load8(adu, sp, &tmp))
-			return 1;
-		if (!load8(adu, sp + 16, &pc))
-			return 1;
+		if (!load8(cache, sp, &tmp)) {
+			trace->failed = true;
+			trace->fail_addr = sp;
+			goto out;
+		}
+		if (!load8(cache, sp + 16, &pc)) {
+			trace->failed = true;
+			trace->fail_addr = sp + 16;
+			goto out;
+		}
 
 		if (!tmp) {
 			finished = true;
@@ -140,16 +249,99 @@ do_pc:
 		if (flip)
 			pc = flip_endian(pc);
 
-		printf(" 0x%016" PRIx64 " 0x%016" PRIx64 " (%s)\n",
-			sp, pc, be ? "big-endian" : "little-endian");
+		stack_trace_add(trace, sp, pc, be);
 
 		prev_flip = flip;
 	}
-	printf(" 0x%016" PRIx64 "\n", next_sp);
+
+	trace->next_sp = next_sp;
+
+out:
+	free(cache);
+}
+
+static int print_stack(struct stack_trace *trace)
+{
+	int i;
+
+	printf("STACK:           SP                NIA\n");
+	if (trace->not_stack) {
+		printf("SP:0x%016" PRIx64 " does not appear to be a stack\n", trace->next_sp);
+		return 0;
+	}
+
+	for (i = 0; i < trace->count; i++)
+		printf(" 0x%016" PRIx64 " 0x%016" PRIx64 " (%s)\n",
+		       trace->frames[i].sp, trace->frames[i].pc,
+		       trace->frames[i].be ? "big-endian" : "little-endian");
+
+	if (trace->failed) {
+		pdbg_log(PDBG_ERROR, "Unable to read memory address=%016" PRIx64 ".\n",
+			 trace->fail_addr);
+		return 1;
+	}
+
+	printf(" 0x%016" PRIx64 "\n", trace->next_sp);
 
 	return 0;
 }
 
+static void unwind_stack_fn(struct pdbg_target *adu, unsigned int index, void *priv)
+{
+	struct stack_trace **traces = (struct stack_trace **)priv;
+
+	unwind_stack(traces[index]);
+}
+
+/*
+ * Unwind the stacks of several threads.  Each thread uses the ADU of its
+ * own processor when it has one, so stacks of different processors can
+ * be unwound in parallel by pdbg_target_run_per_proc().
+ */
+static void unwind_stacks(struct stack_trace *traces, int count)
+{
+	struct stack_trace **unwind;
+	struct pdbg_target **adus;
+	int i, n = 0;
+
+	unwind = calloc(count, sizeof(*unwind));
+	adus = calloc(count, sizeof(*adus));
+	assert(unwind && adus);
+
+	for (i = 0; i < count; i++) {
+		if (!traces[i].adu)
+			continue;
+
+		adus[n] = traces[i].adu;
+		unwind[n++] = &traces[i];
+	}
+
+	pdbg_target_run_per_proc(adus, n, unwind_stack_fn, unwind);
+
+	free(adus);
+	free(unwind);
+}
+
+static struct pdbg_target *thread_stack_adu(struct pdbg_target *thread)
+{
+	struct pdbg_target *pib, *adu, *any = NULL;
+
+	pib = pdbg_target_parent("pib", thread);
+
+	pdbg_for_each_class_target("mem", adu) {
+		if (pdbg_target_probe(adu) != PDBG_TARGET_ENABLED)
+			continue;
+
+		if (pdbg_target_index(adu) == pdbg_target_index(pib))
+			return adu;
+
+		if (!any)
+			any = adu;
+	}
+
+	return any;
+}
+
 static int thr_start(void)
 {
 	struct pdbg_target *target;
@@ -178,9 +370,9 @@ static int thr_step(uint64_t steps)
 	int count = 0;
 
 	if (path_target_all_selected("thread", NULL)) {
-		int i;
+		uint64_t i;
 
-		for (i=0; i<count; i++)
+		for (i = 0; i < steps; i++)
 			thread_step_all();
 
 		return 1;
@@ -190,7 +382,15 @@ static int thr_step(uint64_t steps)
 		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
 			continue;
 
+		if (steps > 1) {
+			pdbg_set_progress_tick(progress_tick);
+			progress_init();
+		}
+
 		thread_step(target, (int)steps);
+
+		if (steps > 1)
+			progress_end();
 		count++;
 	}
 
@@ -198,6 +398,42 @@ static int thr_step(uint64_t steps)
 }
 OPTCMD_DEFINE_CMD_WITH_ARGS(step, thr_step, (DATA));
 
+#define RUNTO_MAX_STEPS	"100000"
+
+static int thr_runto(uint64_t addr, uint64_t max_steps)
+{
+	struct pdbg_target *target;
+	uint64_t steps;
+	int count = 0, rc;
+
+	for_each_path_target_class("thread", target) {
+		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		pdbg_set_progress_tick(progress_tick);
+		progress_init();
+		rc = thread_run_to(target, addr, max_steps, &steps);
+		progress_end();
+
+		if (rc < 0) {
+			pdbg_log(PDBG_ERROR, "Unable to step %s\n", pdbg_target_path(target));
+			continue;
+		}
+
+		if (rc)
+			printf("%s: 0x%016" PRIx64 " not reached after %" PRIu64 " steps\n",
+			       pdbg_target_path(target), addr, steps);
+		else
+			printf("%s: 0x%016" PRIx64 " reached after %" PRIu64 " steps\n",
+			       pdbg_target_path(target), addr, steps);
+
+		count++;
+	}
+
+	return count;
+}
+OPTCMD_DEFINE_CMD_WITH_ARGS(runto, thr_runto, (ADDRESS, DEFAULT_DATA(RUNTO_MAX_STEPS)));
+
 static int thr_stop(void)
 {
 	struct pdbg_target *target;
@@ -347,10 +583,45 @@ struct reg_flags {
 static int thread_regs_print(struct reg_flags flags)
 {
 	struct pdbg_target *pib, *core, *thread;
-	struct thread_regs regs;
-	int count = 0;
+	struct pdbg_target **threads = NULL;
+	struct stack_trace *traces = NULL;
+	struct thread_regs *regs;
+	int *rc;
+	int i, nthreads = 0, count = 0;
 
 	for_each_path_target_class("thread", thread) {
+		threads = realloc(threads, (nthreads + 1) * sizeof(*threads));
+		assert(threads);
+		threads[nthreads++] = thread;
+	}
+
+	if (!nthreads)
+		return 0;
+
+	regs = calloc(nthreads, sizeof(*regs));
+	rc = calloc(nthreads, sizeof(*rc));
+	assert(regs && rc);
+
+	/* Threads of different chips are read in parallel, print in order */
+	thread_getregs_list(threads, nthreads, regs, rc);
+
+	if (flags.do_backtrace) {
+		traces = calloc(nthreads, sizeof(*traces));
+		assert(traces);
+
+		for (i = 0; i < nthreads; i++) {
+			if (rc[i])
+				continue;
+
+			traces[i].regs = &regs[i];
+			traces[i].adu = thread_stack_adu(threads[i]);
+		}
+
+		unwind_stacks(traces, nthreads);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		thread = threads[i];
 		core = pdbg_target_parent("core", thread);
 		pib = pdbg_target_parent("pib", core);
 
@@ -359,23 +630,28 @@ static int thread_regs_print(struct reg_flags flags)
 		       pdbg_target_index(core),
 		       pdbg_target_index(thread));
 
-		if (thread_getregs(thread, &regs))
+		if (rc[i])
 			continue;
 
-		if (flags.do_backtrace) {
-			struct pdbg_target *adu;
+		thread_print_regs(&regs[i]);
 
-			pdbg_for_each_class_target("mem", adu) {
-				if (pdbg_target_probe(adu) == PDBG_TARGET_ENABLED) {
-					dump_stack(&regs, adu);
-					break;
-				}
-			}
-		}
+		if (flags.do_backtrace && traces[i].adu)
+			print_stack(&traces[i]);
 
 		count++;
 	}
 
+	if (traces) {
+		for (i = 0; i < nthreads; i++)
+			free(traces[i].frames);
+		free(traces);
+	}
+
+	free(threads);
+	free(regs);
+	free(rc);
+
 	return count;
 }
+
 OPTCMD_DEFINE_CMD_ONLY_FLAGS(regs, thread_regs_print, reg_flags, (REG_BACKTRACE_FLAG));
@@ -49,6 +49,19 @@
 #    The test wrapper function will be passed all the arguments to test_run
 #    command.
 #
+# wait_for_port <port> <pid>
+#
+#    Wait until process <pid> listens on the local tcp <port>.  Returns 77
+#    if the process exits first, most likely because the port is in use,
+#    and 1 if it doesn't listen within 30 seconds.
+#
+# start_cronus_server <port> [<arguments>]
+#
+#    Start the cronus emulator in the background on 127.0.0.1:<port>, with
+#    any arguments passed before the address, and wait for it as
+#    wait_for_port does.  The pid is left in cronus_server_pid, a server
+#    which doesn't start is stopped.
+#
 #
 # Matching output:
 #
@@ -127,6 +140,49 @@ test_cleanup ()
 	test_cleanup_hooks="${test_cleanup_hooks}${test_cleanup_hooks:+ ; }$*"
 }
 
+wait_for_port ()
+{
+	_port=$(printf ':%04X' "$1")
+	_tries=300
+
+	while [ $_tries -gt 0 ] ; do
+		# Listening sockets are in state 0A, another process may hold the port
+		for _inode in $(cat /proc/net/tcp /proc/net/tcp6 2>/dev/null | \
+				awk -v port="$_port" '$4 == "0A" && substr($2, length($2) - 4) == port { print $10 }') ; do
+			if ls -l /proc/"$2"/fd 2>/dev/null | grep -q "socket:\[$_inode\]" ; then
+				return 0
+			fi
+		done
+
+		if ! kill -0 "$2" 2>/dev/null ; then
+			return 77
+		fi
+
+		sleep 0.1
+		_tries=$((_tries - 1))
+	done
+
+	return 1
+}
+
+start_cronus_server ()
+{
+	_port=$1
+	shift
+
+	cronus_server "$@" 127.0.0.1 "$_port" &
+	cronus_server_pid=$!
+
+	wait_for_port "$_port" $cronus_server_pid
+	_rc=$?
+	if [ $_rc -ne 0 ] ; then
+		kill $cronus_server_pid 2>/dev/null
+		cronus_server_pid=
+	fi
+
+	return $_rc
+}
+
 test_end ()
 {
 	trap 0
@@ -0,0 +1,115 @@
+#!/bin/sh
+
+. $(dirname "$0")/driver.sh
+
+# Run the cronus backend against the emulator.  A second emulator fails
+# every instruction.
+SERVER_PORT=8194
+ERROR_PORT=8195
+
+server_pid=
+error_pid=
+
+start_server ()
+{
+	start_cronus_server $SERVER_PORT || return $?
+	server_pid=$cronus_server_pid
+
+	start_cronus_server $ERROR_PORT -e 100
+	rc=$?
+	if [ $rc -ne 0 ] ; then
+		stop_server
+		return $rc
+	fi
+	error_pid=$cronus_server_pid
+
+	return 0
+}
+
+stop_server ()
+{
+	[ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+	[ -n "$error_pid" ] && kill $error_pid 2>/dev/null
+}
+
+test_setup start_server
+test_cleanup stop_server
+
+test_group "cronus emulator tests"
+
+PDBG="pdbg -b cronus -d p9@127.0.0.1:$SERVER_PORT"
+
+
+# Registers which have never been written read back as their address
+test_result 0 <<EOF
+p0: 0x0000000000101234 = 0x0000000000101234 (/proc0/pib)
+EOF
+
+test_run $PDBG -P pib0 getscom 0x101234
+
+
+test_result 0 --
+test_run $PDBG -P pib0 putscom 0x101234 0x0123456789abcdef
+
+
+# The register model is shared across connections
+test_result 0 <<EOF
+p0: 0x0000000000101234 = 0x0123456789abcdef (/proc0/pib)
+EOF
+
+test_run $PDBG -P pib0 getscom 0x101234
+
+
+# Each pib has its own registers
+test_result 0 <<EOF
+p1: 0x0000000000101234 = 0x0000000000101234 (/proc1/pib)
+EOF
+
+test_run $PDBG -P pib1 getscom 0x101234
+
+
+test_result 0 --
+test_run $PDBG -p1 putcfam 0x2804 0xdeadbeef
+
+
+test_result 0 <<EOF
+p1: 0x2804 = 0xdeadbeef
+EOF
+
+test_run $PDBG -p1 getcfam 0x2804
+
+
+test_result 0 <<EOF
+p0: 0x2804 = 0x00002804
+EOF
+
+test_run $PDBG -p0 getcfam 0x2804
+
+
+# Memory goes through SBEFIFO instructions
+putmem_pattern ()
+{
+	for i in $(seq 1 8) ; do
+		printf "0123456789abcdef"
+	done | $PDBG -S -p0 putmempba 0x1000
+}
+
+test_result 0 <<EOF
+Wrote 128 bytes starting at 0x0000000000001000
+EOF
+
+test_run putmem_pattern
+
+
+test_result 0 <<EOF
+456789abcdef0123
+EOF
+
+test_run $PDBG -S -p0 getmempba 0x1004 16 --raw
+
+
+test_result 1 <<EOF
+p0: 0x0000000000101234 failed (/proc0/pib)
+EOF
+
+test_run pdbg -b cronus -d p9@127.0.0.1:$ERROR_PORT -P pib0 getscom 0x101234
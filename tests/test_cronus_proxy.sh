@@ -0,0 +1,109 @@
+#!/bin/sh
+
+. $(dirname "$0")/driver.sh
+
+# pdbg talks to the proxy, the emulator sits behind it
+PROXY_PORT=8196
+SERVER_PORT=8197
+PROXY_LOG=$(mktemp)
+
+server_pid=
+proxy_pid=
+
+start_proxy ()
+{
+	start_cronus_server $SERVER_PORT
+	rc=$?
+	if [ $rc -ne 0 ] ; then
+		stop_proxy
+		return $rc
+	fi
+	server_pid=$cronus_server_pid
+
+	cronus_proxy -l $PROXY_PORT -u 2 127.0.0.1 $SERVER_PORT 2>"$PROXY_LOG" &
+	proxy_pid=$!
+
+	wait_for_port $PROXY_PORT $proxy_pid
+	rc=$?
+	if [ $rc -ne 0 ] ; then
+		stop_proxy
+		return $rc
+	fi
+
+	return 0
+}
+
+stop_proxy ()
+{
+	[ -n "$proxy_pid" ] && kill $proxy_pid 2>/dev/null
+	[ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+	rm -f "$PROXY_LOG"
+}
+
+test_setup start_proxy
+test_cleanup stop_proxy
+
+test_group "cronus proxy tests"
+
+PDBG="pdbg -b cronus -d p9@127.0.0.1:$PROXY_PORT"
+
+test_result 0 <<EOF
+p0: 0x0000000000101234 = 0x0000000000101234 (/proc0/pib)
+EOF
+
+test_run $PDBG -P pib0 getscom 0x101234
+
+
+test_result 0 <<EOF
+p1: 0x2804 = 0x00002804
+EOF
+
+test_run $PDBG -p1 getcfam 0x2804
+
+
+concurrent_getscom ()
+{
+	for i in $(seq 1 $1) ; do
+		$PDBG -P pib0 getscom $(printf "0x%x" $((0x1000 * i))) &
+	done
+	wait
+}
+
+test_result 0 <<EOF
+p0: 0x0000000000001000 = 0x0000000000001000 (/proc0/pib)
+p0: 0x0000000000002000 = 0x0000000000002000 (/proc0/pib)
+p0: 0x0000000000003000 = 0x0000000000003000 (/proc0/pib)
+p0: 0x0000000000004000 = 0x0000000000004000 (/proc0/pib)
+p0: 0x0000000000005000 = 0x0000000000005000 (/proc0/pib)
+p0: 0x0000000000006000 = 0x0000000000006000 (/proc0/pib)
+p0: 0x0000000000007000 = 0x0000000000007000 (/proc0/pib)
+p0: 0x0000000000008000 = 0x0000000000008000 (/proc0/pib)
+EOF
+
+result_filter ()
+{
+	sort
+}
+
+test_run concurrent_getscom 8
+
+result_filter ()
+{
+	result_filter_default
+}
+
+
+# Every client disconnect reports its request rate and latency
+client_stats ()
+{
+	sleep 1
+	grep -c "requests (0 failed)" "$PROXY_LOG"
+	grep -c "latency us p50=" "$PROXY_LOG"
+}
+
+test_result 0 <<EOF
+10
+10
+EOF
+
+test_run client_stats
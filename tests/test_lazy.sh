@@ -0,0 +1,44 @@
+#!/bin/sh
+
+. $(dirname "$0")/driver.sh
+
+test_group "lazy target tests"
+
+# Lazy targets must give the same tree and class lists as creating every
+# target up front, whichever target is looked up first
+compare_lazy ()
+{
+	eager=$(libpdbg_lazy_test "$@") || return 1
+	lazy=$(libpdbg_lazy_test -l "$@") || return 1
+
+	if [ "$eager" = "$lazy" ] ; then
+		echo "same"
+	else
+		echo "differ"
+	fi
+}
+
+for dtb in fake.dtb:fake-backend.dtb p9.dtb:bmc-kernel.dtb p10.dtb:bmc-kernel.dtb ; do
+	export PDBG_DTB=${dtb%:*}
+	export PDBG_BACKEND_DTB=${dtb#*:}
+
+	test_result 0 <<EOF
+same
+EOF
+
+	test_run compare_lazy
+
+
+	test_result 0 <<EOF
+same
+EOF
+
+	test_run compare_lazy /proc1/pib
+
+
+	test_result 0 <<EOF
+same
+EOF
+
+	test_run compare_lazy /proc0/pib/chiplet@20000000/eq@0/fc@0/core@0/thread@1
+done
@@ -0,0 +1,147 @@
+#!/bin/sh
+
+. $(dirname "$0")/driver.sh
+
+# Record sessions on the fake backend and against the cronus emulator,
+# then replay them with nothing to talk to
+SERVER_PORT=8198
+
+RECORD_DIR=$(mktemp -d)
+RECORDING="$RECORD_DIR/recording"
+
+server_pid=
+
+start_server ()
+{
+	start_cronus_server $SERVER_PORT
+	rc=$?
+	if [ $rc -ne 0 ] ; then
+		stop_server
+		return $rc
+	fi
+	server_pid=$cronus_server_pid
+
+	return 0
+}
+
+stop_server ()
+{
+	[ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+	rm -rf "$RECORD_DIR"
+}
+
+test_setup start_server
+test_cleanup stop_server
+
+test_group "record and replay tests"
+
+record ()
+{
+	PDBG_RECORD="$RECORDING" pdbg "$@"
+}
+
+replay ()
+{
+	PDBG_REPLAY="$RECORDING" pdbg "$@"
+}
+
+
+test_result 0 <<EOF
+p0: 0x0000000000001000 = 0x00000000deadbeef (/proc0/pib)
+p1: 0x0000000000001000 = 0x00000000deadbeef (/proc1/pib)
+EOF
+
+test_run record -b fake -p0,1 getscom 0x1000
+
+
+# The backend is taken from the recording
+test_result 0 <<EOF
+p0: 0x0000000000001000 = 0x00000000deadbeef (/proc0/pib)
+p1: 0x0000000000001000 = 0x00000000deadbeef (/proc1/pib)
+EOF
+
+test_run replay -p0,1 getscom 0x1000
+
+
+test_result 0 <<EOF
+p0: 0x0000000000001000 = 0x00000000deadbeef (/proc0/pib)
+p1: 0x0000000000001000 = 0x00000000deadbeef (/proc1/pib)
+EOF
+
+test_run env PDBG_REPLAY_TIMED=1 PDBG_REPLAY="$RECORDING" pdbg -p0,1 getscom 0x1000
+
+
+# Accesses which were not recorded fail
+test_result 1 <<EOF
+p0: 0x0000000000002000 failed (/proc0/pib)
+EOF
+
+test_run replay -p0 getscom 0x2000
+
+
+# The cronus emulator keeps its registers, so a replay must see the
+# values the emulator returned while recording
+record_cronus ()
+{
+	PDBG="pdbg -b cronus -d p9@127.0.0.1:$SERVER_PORT"
+
+	$PDBG -P pib0 putscom 0x101234 0x0123456789abcdef || return 1
+	record -b cronus -d p9@127.0.0.1:$SERVER_PORT -P pib0 getscom 0x101234
+}
+
+test_result 0 <<EOF
+p0: 0x0000000000101234 = 0x0123456789abcdef (/proc0/pib)
+EOF
+
+test_run record_cronus
+
+
+test_result 0 <<EOF
+p0: 0x0000000000101234 = 0x0123456789abcdef (/proc0/pib)
+EOF
+
+test_run replay -P pib0 getscom 0x101234
+
+
+test_result 0 <<EOF
+p0: 0x2804 = 0x00002804
+EOF
+
+test_run record -b cronus -d p9@127.0.0.1:$SERVER_PORT -p0 getcfam 0x2804
+
+
+# Nothing listens on the port the recording was made with
+test_result 0 <<EOF
+p0: 0x2804 = 0x00002804
+EOF
+
+test_run replay -b cronus -d p9@127.0.0.1:1 -p0 getcfam 0x2804
+
+
+# Memory is replayed with the data read
+putmem_pattern ()
+{
+	for i in $(seq 1 8) ; do
+		printf "0123456789abcdef"
+	done | pdbg -b cronus -d p9@127.0.0.1:$SERVER_PORT -S -p0 putmempba 0x1000
+}
+
+test_result 0 <<EOF
+Wrote 128 bytes starting at 0x0000000000001000
+EOF
+
+test_run putmem_pattern
+
+
+test_result 0 <<EOF
+456789abcdef0123
+EOF
+
+test_run record -b cronus -d p9@127.0.0.1:$SERVER_PORT -S -p0 getmempba 0x1004 16 --raw
+
+
+test_result 0 <<EOF
+456789abcdef0123
+EOF
+
+test_run replay -S -p0 getmempba 0x1004 16 --raw
@@ -0,0 +1,90 @@
+#!/bin/sh
+
+. $(dirname "$0")/driver.sh
+
+test_group "target snapshot tests"
+
+SNAPSHOT_DIR=$(mktemp -d)
+SNAPSHOT="$SNAPSHOT_DIR/targets"
+
+# The inode of the snapshot changes whenever it is written again
+snapshot_inode ()
+{
+	ls -i "$SNAPSHOT" 2>/dev/null | cut -d' ' -f1
+}
+
+# A tree loaded from a snapshot must be the same as one built from the
+# device trees.  Print whether the snapshot was used or written.
+compare_snapshot ()
+{
+	before=$(snapshot_inode)
+	built=$(libpdbg_lazy_test "$@") || return 1
+	loaded=$(PDBG_SNAPSHOT="$SNAPSHOT" libpdbg_lazy_test "$@") || return 1
+	after=$(snapshot_inode)
+
+	if [ "$built" = "$loaded" ] ; then
+		echo "same"
+	else
+		echo "differ"
+	fi
+
+	if [ -z "$after" ] ; then
+		echo "none"
+	elif [ "$before" = "$after" ] ; then
+		echo "loaded"
+	else
+		echo "written"
+	fi
+}
+
+for dtb in fake.dtb:fake-backend.dtb p9.dtb:bmc-kernel.dtb p10.dtb:bmc-kernel.dtb ; do
+	export PDBG_DTB=${dtb%:*}
+	export PDBG_BACKEND_DTB=${dtb#*:}
+
+	# The snapshot of the previous system does not match
+	test_result 0 <<EOF
+same
+written
+EOF
+
+	test_run compare_snapshot
+
+
+	test_result 0 <<EOF
+same
+loaded
+EOF
+
+	test_run compare_snapshot /proc1/pib
+
+
+	test_result 0 <<EOF
+same
+loaded
+EOF
+
+	test_run compare_snapshot -l /proc0/pib
+done
+
+
+# A damaged snapshot is ignored and replaced
+head -c 100 "$SNAPSHOT" > "$SNAPSHOT_DIR/short"
+mv "$SNAPSHOT_DIR/short" "$SNAPSHOT"
+
+test_result 0 <<EOF
+same
+written
+EOF
+
+test_run compare_snapshot
+
+
+# Not being able to write the snapshot is not an error
+rm -rf "$SNAPSHOT_DIR"
+
+test_result 0 <<EOF
+same
+none
+EOF
+
+test_run compare_snapshot
@@ -0,0 +1,38 @@
+#!/bin/sh
+
+. $(dirname "$0")/driver.sh
+
+test_group "startup benchmark"
+
+# The time taken to build the device tree is only printed, unless a limit
+# in ms is given in PDBG_BENCH_LIMIT_MS.  Wall clock limits fail on loaded
+# machines and under valgrind or sanitizers.
+STARTUP_LIMIT_MS=${PDBG_BENCH_LIMIT_MS:-}
+
+export PDBG_BACKEND_DTB="bmc-kernel.dtb"
+
+export PDBG_DTB="p9.dtb"
+
+test_result 0 <<EOF
+2049 targets
+EOF
+
+test_run libpdbg_startup_test $STARTUP_LIMIT_MS
+
+
+export PDBG_DTB="p10.dtb"
+
+test_result 0 <<EOF
+2529 targets
+EOF
+
+test_run libpdbg_startup_test $STARTUP_LIMIT_MS
+
+
+# Creating targets on demand only creates what is used, but walking the
+# tree still finds all of them
+test_result 0 <<EOF
+2529 targets
+EOF
+
+test_run libpdbg_startup_test -l $STARTUP_LIMIT_MS
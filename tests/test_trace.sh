@@ -0,0 +1,100 @@
+#!/bin/sh
+
+. $(dirname "$0")/driver.sh
+
+# Trace hardware accesses on the fake backend and against the cronus
+# emulator, which also goes through the sbefifo
+SERVER_PORT=8199
+
+TRACE_DIR=$(mktemp -d)
+export PDBG_TRACE="$TRACE_DIR/trace"
+
+server_pid=
+
+start_server ()
+{
+	start_cronus_server $SERVER_PORT
+	rc=$?
+	if [ $rc -ne 0 ] ; then
+		stop_server
+		return $rc
+	fi
+	server_pid=$cronus_server_pid
+
+	return 0
+}
+
+stop_server ()
+{
+	[ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+	rm -rf "$TRACE_DIR"
+}
+
+test_setup start_server
+test_cleanup stop_server
+
+test_group "hardware access trace tests"
+
+# Run pdbg and print the accesses it made, leaving out times, thread ids
+# and durations which change from run to run
+trace ()
+{
+	rm -f "$PDBG_TRACE"
+	pdbg "$@" >/dev/null || return 1
+	pdbg-trace --csv "$PDBG_TRACE" | cut -d, -f3-7
+}
+
+
+test_result 0 <<EOF
+op,target,addr,data,rc
+pib_read,/proc0/pib,0x1000,0xdeadbeef,0
+pib_read,/proc1/pib,0x1000,0xdeadbeef,0
+EOF
+
+test_run trace -b fake -p0,1 getscom 0x1000
+
+
+test_result 0 <<EOF
+op,target,addr,data,rc
+pib_write,/proc0/pib,0x2000,0x1234,0
+EOF
+
+test_run trace -b fake -P pib0 putscom 0x2000 0x1234
+
+
+test_result 0 <<EOF
+op,target,addr,data,rc
+fsi_read,/proc0/fsi,0x1000,0xfeed0cfa,0
+EOF
+
+test_run trace -b fake -P fsi0 getcfam 0x1000
+
+
+test_result 0 <<EOF
+op,target,addr,data,rc
+fsi_write,/proc1/fsi,0x1000,0x55,0
+EOF
+
+test_run trace -b fake -P fsi1 putcfam 0x1000 0x55
+
+
+test_result 0 <<EOF
+op,target,addr,data,rc
+mem_read,/mempba0,0x1004,0x10,0
+sbefifo,/sbefifo0,0x18,0xa401,0
+EOF
+
+test_run trace -b cronus -d p9@127.0.0.1:$SERVER_PORT -S -p0 getmempba 0x1004 16 --raw
+
+
+# Nothing is traced without PDBG_TRACE
+no_trace ()
+{
+	rm -f "$PDBG_TRACE"
+	env -u PDBG_TRACE pdbg -b fake -p0 getscom 0x1000 >/dev/null || return 1
+	[ -e "$PDBG_TRACE" ] && echo "trace written"
+	return 0
+}
+
+test_result 0 --
+test_run no_trace